@@ -0,0 +1,51 @@
+#ifndef __ANSCHEDULER_FPU_H__
+#define __ANSCHEDULER_FPU_H__
+
+#include "types.h"
+
+/**
+ * FPU/SIMD state is switched lazily. Each CPU remembers which thread's state
+ * its registers hold, and a thread only gets the FPU enabled when it runs on
+ * a CPU which still holds its state. Any other thread traps on its first
+ * FPU/SIMD instruction, and only then is its state loaded. The registers
+ * of the previous owner are saved at that point too, so a thread which is
+ * switched out and back in without anybody else using the FPU is never saved
+ * at all. Threads which never touch the FPU never pay for a save or a
+ * restore.
+ */
+
+/**
+ * Call this when a thread traps because the FPU is disabled (#NM on x86-64).
+ * This saves the registers of the CPU's previous owner before loading the
+ * thread's. If the thread's newest registers are still held by another CPU,
+ * that CPU is asked to save them the next time it switches threads, and the
+ * thread goes back on the queue to trap again.
+ * This function should never return; it switches back into the thread.
+ * @critical
+ */
+void anscheduler_fpu_fault();
+
+/**
+ * Disables the FPU for the thread leaving this CPU. Its registers are left in
+ * place. The run loop calls this before it lets go of the thread's task.
+ * @critical
+ */
+void anscheduler_fpu_leave();
+
+/**
+ * Enables the FPU if this CPU's registers still hold the state of the thread
+ * about to run, and disables it otherwise. The registers are saved first if
+ * their owner is waiting for them on another CPU or this CPU is going idle.
+ * @param next The thread about to run, or NULL if the CPU will go idle.
+ * @critical
+ */
+void anscheduler_fpu_enter(thread_t * next);
+
+/**
+ * Forgets and frees a thread's FPU state. Call this before freeing a thread
+ * which may have used the FPU.
+ * @critical
+ */
+void anscheduler_fpu_release(thread_t * thread);
+
+#endif
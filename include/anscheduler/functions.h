@@ -15,6 +15,11 @@
 #define ANSCHEDULER_PAGE_FLAG_GLOBAL 0x100
 #define ANSCHEDULER_PAGE_FLAG_UNALLOC 0x200
 #define ANSCHEDULER_PAGE_FLAG_SWAPPED 0x400
+#define ANSCHEDULER_PAGE_FLAG_COW 0x800
+
+#ifndef ANSCHEDULER_MAX_CPUS
+#define ANSCHEDULER_MAX_CPUS 0x20
+#endif
 
 /*******************
  * General Purpose *
@@ -60,6 +65,14 @@ void anscheduler_abort(const char * error);
  */
 void anscheduler_zero(void * buf, int len);
 
+/**
+ * Copy a chunk of memory. The two buffers must not overlap. Like
+ * anscheduler_zero(), this is external so that the platform can use its
+ * fastest copy.
+ * @noncritical or @critical
+ */
+void anscheduler_copy(void * dest, const void * source, int len);
+
 /**
  * Atomically increment the value at a memory address.
  * @critical
@@ -156,6 +169,13 @@ void anscheduler_cpu_lock();
  */
 void anscheduler_cpu_unlock();
 
+/**
+ * Returns a number which uniquely identifies the current CPU. This must be
+ * less than ANSCHEDULER_MAX_CPUS, and it is used to index per-CPU caches.
+ * @critical
+ */
+uint64_t anscheduler_cpu_get_index();
+
 /**
  * @critical
  */
@@ -203,6 +223,45 @@ void anscheduler_cpu_stack_run(void * arg, void (* fn)(void * a));
  */
 void anscheduler_cpu_halt(); // wait until timer or interrupt
 
+/*******
+ * FPU *
+ *******/
+
+/**
+ * Lets the current CPU use its FPU/SIMD registers without trapping. On
+ * x86-64, this clears CR0.TS.
+ * @critical
+ */
+void anscheduler_fpu_enable();
+
+/**
+ * Makes the next FPU/SIMD instruction on this CPU trap, after which the
+ * platform should call anscheduler_fpu_fault(). On x86-64, this sets CR0.TS.
+ * @critical
+ */
+void anscheduler_fpu_disable();
+
+/**
+ * Saves this CPU's FPU/SIMD registers into a page-aligned, page-sized area
+ * (e.g. with XSAVE). The FPU has been enabled.
+ * @critical
+ */
+void anscheduler_fpu_save(void * area);
+
+/**
+ * Loads this CPU's FPU/SIMD registers from an area filled in by
+ * anscheduler_fpu_save(). The FPU has been enabled.
+ * @critical
+ */
+void anscheduler_fpu_restore(const void * area);
+
+/**
+ * Resets this CPU's FPU/SIMD registers to their initial state. The FPU has
+ * been enabled.
+ * @critical
+ */
+void anscheduler_fpu_init();
+
 /******************
  * Virtual Memory *
  ******************/
@@ -249,6 +308,64 @@ uint64_t anscheduler_vm_lookup(void * root,
                                uint64_t vpage,
                                uint16_t * flags);
 
+/**
+ * Maps `count` consecutive virtual pages starting at `vpage`. Page `i` of the
+ * range is mapped to `dpage + (i * stride)`, so pass a stride of 0 to give
+ * every page the same entry and 1 to map a contiguous physical range.
+ * @return false if a page table could not be allocated, in which case some
+ * of the range may have been mapped.
+ * @critical O(count), but page tables are only walked once per table.
+ */
+bool anscheduler_vm_map_range(void * root,
+                              uint64_t vpage,
+                              uint64_t count,
+                              uint64_t dpage,
+                              uint64_t stride,
+                              uint16_t flags);
+
+/**
+ * Unmaps `count` consecutive virtual pages starting at `vpage`. This does
+ * not flush any TLBs; use anscheduler_cpu_notify_invlpg() once afterwards.
+ * @critical O(count)
+ */
+void anscheduler_vm_unmap_range(void * root, uint64_t vpage, uint64_t count);
+
+/**
+ * Looks up `count` consecutive virtual pages starting at `vpage`, like
+ * calling anscheduler_vm_lookup() on each one.
+ * @param entries Filled in with `count` physical entries.
+ * @param flags Filled in with `count` sets of flags.
+ * @critical O(count)
+ */
+void anscheduler_vm_lookup_range(void * root,
+                                 uint64_t vpage,
+                                 uint64_t count,
+                                 uint64_t * entries,
+                                 uint16_t * flags);
+
+/**
+ * Calls `fn` for every page between `start` and `end` (exclusive) whose entry
+ * has non-zero flags, in ascending order. `fn` may remap the page it was
+ * passed, and it may stop the walk early by returning false.
+ * @return false if `fn` stopped the walk early.
+ * @critical
+ */
+bool anscheduler_vm_walk(void * root,
+                         uint64_t start,
+                         uint64_t end,
+                         bool (* fn)(void * arg,
+                                     uint64_t vpage,
+                                     uint64_t entry,
+                                     uint16_t flags),
+                         void * arg);
+
+/**
+ * @return The number of pages occupied by the page tables of an address
+ * space, including the root table.
+ * @critical
+ */
+uint64_t anscheduler_vm_table_count(void * root);
+
 /**
  * This will only be called early on if very little memory has been mapped
  * Like anscheduler_vm_root_free_async(), but made to run in critical sections.
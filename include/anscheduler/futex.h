@@ -0,0 +1,44 @@
+#ifndef __ANSCHEDULER_FUTEX_H__
+#define __ANSCHEDULER_FUTEX_H__
+
+#include "types.h"
+
+#define ANSCHEDULER_FUTEX_WOKEN 0
+#define ANSCHEDULER_FUTEX_MISMATCH 1
+#define ANSCHEDULER_FUTEX_TIMEOUT 2
+#define ANSCHEDULER_FUTEX_FAULT 3
+
+/**
+ * Blocks the current thread until another thread in the same task calls
+ * anscheduler_futex_wake() on the same address. The value is checked while
+ * the futex is locked, so a wakeup can't be missed between the check and
+ * going to sleep.
+ * @param addr An 8-byte aligned address in the current task's address space.
+ * @param expected The thread only sleeps if `*addr` holds this value.
+ * @param timeout The longest time to sleep, in the units returned by
+ * anscheduler_get_time(), or 0 to sleep until woken.
+ * @return ANSCHEDULER_FUTEX_WOKEN, ANSCHEDULER_FUTEX_TIMEOUT, or, without
+ * sleeping, ANSCHEDULER_FUTEX_MISMATCH if `*addr` was not `expected` and
+ * ANSCHEDULER_FUTEX_FAULT if `addr` is unaligned or not mapped.
+ * @critical Call this from the thread's kernel stack, presumably in a syscall
+ * handler. It returns when the thread runs again.
+ */
+int anscheduler_futex_wait(uint64_t * addr, uint64_t expected,
+                           uint64_t timeout);
+
+/**
+ * Wakes up to `count` threads of the current task which are waiting on
+ * `addr`, oldest first.
+ * @return The number of threads woken.
+ * @critical
+ */
+uint64_t anscheduler_futex_wake(uint64_t * addr, uint64_t count);
+
+/**
+ * Takes a thread which will never run again out of the futex it is waiting
+ * on, if any. The task teardown calls this for every thread.
+ * @critical
+ */
+void anscheduler_futex_cancel(thread_t * thread);
+
+#endif
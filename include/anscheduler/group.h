@@ -0,0 +1,68 @@
+#ifndef __ANSCHEDULER_GROUP_H__
+#define __ANSCHEDULER_GROUP_H__
+
+#include "types.h"
+
+/**
+ * Creates a task group with a CPU quota.
+ * @param period The length of a budget period, in the units returned by
+ * anscheduler_get_time().
+ * @param quota The CPU time the group's threads may consume in each period,
+ * summed across all CPUs. Pass 0 for no limit.
+ * @return A referenced group, or NULL on failure.
+ * @critical
+ */
+task_group_t * anscheduler_group_create(uint64_t period, uint64_t quota);
+
+/**
+ * @critical
+ */
+void anscheduler_group_reference(task_group_t * group);
+
+/**
+ * Releases a reference to a group, freeing it once no references remain.
+ * @critical
+ */
+void anscheduler_group_dereference(task_group_t * group);
+
+/**
+ * Changes a group's quota. The new period and quota take effect right away,
+ * and time the group already used in the current period counts against the
+ * new quota.
+ * @critical
+ */
+void anscheduler_group_set_quota(task_group_t * group,
+                                 uint64_t period,
+                                 uint64_t quota);
+
+/**
+ * Moves a task into a group. Tasks forked from this task will join the same
+ * group.
+ * @param task A task which has not been launched yet.
+ * @param group The group to join, or NULL to leave the current group.
+ * @critical
+ */
+void anscheduler_group_join(task_t * task, task_group_t * group);
+
+/**
+ * Charges CPU time to a group. This is called by the run loop whenever a CPU
+ * stops running one of the group's threads. Since each CPU only learns what
+ * the others used once they switch away, threads running on several CPUs at
+ * once can overrun the quota by up to one time slice per CPU.
+ * @critical
+ */
+void anscheduler_group_charge(task_group_t * group, uint64_t time);
+
+/**
+ * Figures out whether a group may run right now.
+ * @param remaining Set to the time left in the current period's budget, or
+ * to ~0 if the group has no quota. Only set when the group may run.
+ * @return 0 if the group may run, or else the timestamp at which its budget
+ * will next be refilled.
+ * @critical
+ */
+uint64_t anscheduler_group_throttle(task_group_t * group,
+                                    uint64_t now,
+                                    uint64_t * remaining);
+
+#endif
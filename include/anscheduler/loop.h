@@ -27,6 +27,20 @@ void anscheduler_loop_delete(thread_t * thread);
  */
 void anscheduler_loop_push(thread_t * newThread);
 
+/**
+ * Adds a chain of threads to the scheduling queue while taking the queue's
+ * lock only once.
+ * @param first The first thread in the chain. The threads must already be
+ * linked to each other through `queueNext` and `queueLast`, and they must
+ * belong to tasks which have not been killed.
+ * @param last The last thread in the chain.
+ * @param count The number of threads in the chain.
+ * @critical O(1)
+ */
+void anscheduler_loop_push_chain(thread_t * first,
+                                 thread_t * last,
+                                 uint64_t count);
+
 /**
  * Enters the scheduling loop.  This function should never return.  By this
  * point, you should be on the CPU dedicated stack.  Calling this function
@@ -65,9 +79,10 @@ void anscheduler_loop_save_and_resign();
  * Add a kernel thread to the scheduler queue. The kernel thread must not exit
  * via anscheduler_thread_exit(), but rather through 
  * anscheduler_loop_delete_cur_kernel()
+ * @return The new kernel thread. It may already be running on another CPU.
  * @critical
  */
-void anscheduler_loop_push_kernel(void * arg, void (* fn)(void * arg));
+thread_t * anscheduler_loop_push_kernel(void * arg, void (* fn)(void * arg));
 
 /**
  * Deletes the current kernel thread, freeing its memory and not adding it
@@ -8,6 +8,10 @@
 #define ANSCHEDULER_PAGE_FAULT_USER 4
 #define ANSCHEDULER_PAGE_FAULT_INSTRUCTION 0x10
 
+// not a hardware bit: the fault could not be resolved because the task
+// reached its memory limit
+#define ANSCHEDULER_PAGE_FAULT_LIMIT 0x8000
+
 /**
  * Call this whenever a page fault or platform-equivalent interrupt occurs.
  *
@@ -18,6 +22,26 @@
  */
 void anscheduler_page_fault(void * ptr, uint64_t flags);
 
+/**
+ * Allocates and maps every lazily allocated page in a range of a task's
+ * address space, charging each one to the task. Pages which are already
+ * mapped are skipped.
+ * @return the number of pages allocated. This is short of the number of
+ * unallocated pages if the task reached its memory limit or memory ran out.
+ * @critical Call this with the task's vmLock held.
+ */
+uint64_t anscheduler_page_populate(task_t * task,
+                                   uint64_t page,
+                                   uint64_t count);
+
+/**
+ * Unmaps a user page from a task and frees its frame with anscheduler_free()
+ * unless another task still maps it. If the task was charged for the frame,
+ * the charge is dropped.
+ * @critical
+ */
+void anscheduler_page_unmap(task_t * task, uint64_t vpage);
+
 /**
  * Get the system thread which is responsible for handling non-trivial
  * application page faults.
@@ -64,4 +88,11 @@ void anscheduler_pager_unlock();
  */
 bool anscheduler_pager_waiting();
 
+/**
+ * Frees a page fault once the pager is done with it. You must still
+ * dereference the fault's task yourself.
+ * @critical
+ */
+void anscheduler_pager_free(page_fault_t * fault);
+
 #endif
@@ -3,8 +3,17 @@
 
 #include "types.h"
 
+// the default depth of a socket's queues
 #define ANSCHEDULER_SOCKET_MSG_MAX 0x10
 
+// the deepest a queue may be made; its ring then takes a whole page
+#define ANSCHEDULER_SOCKET_DEPTH_MAX 0x1fe
+
+// the most pages one message may grant; at most 0x1fd fit in a message
+#ifndef ANSCHEDULER_SOCKET_GRANT_MAX
+#define ANSCHEDULER_SOCKET_GRANT_MAX 0x40
+#endif
+
 /**
  * Creates a new socket and assigns it to the current task.
  * @return The socket link in the task's sockets linked list. NULL if any
@@ -48,7 +57,8 @@ void anscheduler_socket_dereference(socket_desc_t * socket);
  * @param msg The message to push to the socket.
  *
  * @return true when the message was sent, false when the buffer was full.
- * When false is returned, you are responsible for freeing the message.
+ * When false is returned, you are responsible for freeing the message with
+ * anscheduler_socket_msg_free().
  * When the message is sent successfully, the reference to `socket` is
  * also consumed. You should not hold any references or locks across this
  * method.
@@ -61,6 +71,33 @@ void anscheduler_socket_dereference(socket_desc_t * socket);
 bool anscheduler_socket_msg(socket_desc_t * socket,
                             socket_msg_t * msg);
 
+/**
+ * Sends several messages to the socket with one lock round trip on each side
+ * and at most one wakeup of the receiving task.
+ * @param socket A referenced socket link.
+ * @param msgs The messages to send, in order.
+ * @return The number of messages which were sent. These are always the first
+ * ones in `msgs`; you are responsible for freeing the rest. If any message
+ * was sent, the reference to `socket` is consumed, just as with
+ * anscheduler_socket_msg().
+ * @critical -> @noncritical -> @critical See anscheduler_socket_msg().
+ */
+uint64_t anscheduler_socket_msg_batch(socket_desc_t * socket,
+                                      socket_msg_t ** msgs,
+                                      uint64_t count);
+
+/**
+ * Blocks the current thread until the other end of the socket has room for
+ * another data message, so that a sender whose anscheduler_socket_msg()
+ * failed needn't spin. The thread is woken once the receiver reads, or once
+ * either end of the socket goes away, so the send may still fail afterwards.
+ * @param socket A referenced socket link. The reference is consumed, since
+ * none may be held while blocked; look the descriptor up again afterwards.
+ * @return false without blocking if the socket has no other end.
+ * @critical -> @noncritical -> @critical
+ */
+bool anscheduler_socket_wait_writable(socket_desc_t * socket);
+
 /**
  * Triggers an asynchronous message send. If you use this, you will have no
  * way of knowing if the message ever went through or not. Thus, this method
@@ -73,18 +110,83 @@ void anscheduler_socket_msg_async(socket_desc_t * socket,
 /**
  * Allocates a socket message with specified data. Maximum length for the
  * data is 0xfe8 bytes. May return NULL if the message could not be 
- * allocated.
+ * allocated. Only the first `len` bytes of the message body exist, since a
+ * small message is not given a whole page.
  * @critical
  */
 socket_msg_t * anscheduler_socket_msg_data(const void * data, uint64_t len);
 
+/**
+ * Takes a page away from the current task and wraps it in a message, so that
+ * it can be handed to another task without being copied. The message's body
+ * holds the page's physical entry.
+ * @param vpage A present, writable data page which is not shared
+ * copy-on-write. If the task was charged for it, it no longer counts against
+ * the task's `mem.user` once it has been granted. Pages the task was never
+ * charged for, such as ones the platform mapped, can be granted too.
+ * @return NULL if the page could not be granted, in which case it is left
+ * mapped.
+ * @critical
+ */
+socket_msg_t * anscheduler_socket_msg_grant(uint64_t vpage);
+
+/**
+ * Like anscheduler_socket_msg_grant(), but grants up to
+ * ANSCHEDULER_SOCKET_GRANT_MAX pages in one message. The pages need not be
+ * contiguous; the receiver maps them in order at consecutive addresses. The
+ * body of the message holds `count` physical entries.
+ * @return NULL if any of the pages could not be granted, in which case all
+ * of them are left mapped.
+ * @critical O(count), with one TLB shootdown for the whole vector.
+ */
+socket_msg_t * anscheduler_socket_msg_grant_vector(const uint64_t * vpages,
+                                                   uint64_t count);
+
+/**
+ * Maps the pages granted by a message into the current task, starting at
+ * `vpage`, and charges them to the task's `mem.user`. The destination pages
+ * must be unmapped data pages. You must still free the message afterwards.
+ * @return false if the message grants no pages, the destination isn't free,
+ * or the task can't be charged for the pages; nothing is mapped in that case.
+ * @critical
+ */
+bool anscheduler_socket_msg_map(socket_msg_t * msg, uint64_t vpage);
+
+/**
+ * Copies the body of a message into a buffer, such as the one a task passed
+ * to its read system call. The buffer must already be accessible.
+ * @return the number of bytes copied, at most `size`.
+ * @critical O(len)
+ */
+uint64_t anscheduler_socket_msg_copy(socket_msg_t * msg,
+                                    void * buf,
+                                    uint64_t size);
+
+/**
+ * Frees a message, along with any pages it grants which were never mapped.
+ * @critical
+ */
+void anscheduler_socket_msg_free(socket_msg_t * msg);
+
 /**
  * Returns the next message on the queue, or NULL if no messages are pending.
+ * Free the message with anscheduler_socket_msg_free() when you're done.
  * @param socket A referenced socket link.
  * @critical
  */
 socket_msg_t * anscheduler_socket_read(socket_desc_t * socket);
 
+/**
+ * Pops up to `max` messages off the queue under a single lock acquisition.
+ * @param socket A referenced socket link.
+ * @param msgs Filled in with the messages, oldest first.
+ * @return The number of messages read.
+ * @critical O(max)
+ */
+uint64_t anscheduler_socket_read_batch(socket_desc_t * socket,
+                                       socket_msg_t ** msgs,
+                                       uint64_t max);
+
 /**
  * Connects a socket to a different task. No references will be conusmed if
  * this function returns false.
@@ -107,6 +209,18 @@ bool anscheduler_socket_connect(socket_desc_t * socket, task_t * task);
  */
 void anscheduler_socket_close(socket_desc_t * socket, uint64_t code);
 
+/**
+ * Sets how many data messages may be queued for this end of a socket, in
+ * place of ANSCHEDULER_SOCKET_MSG_MAX. Each queued message is charged to the
+ * task, so the depth may not exceed the task's memory limit. Messages which
+ * are already queued stay queued even if there are more than `depth`.
+ * @param socket A referenced socket link.
+ * @param depth Between 1 and ANSCHEDULER_SOCKET_DEPTH_MAX.
+ * @return false if the depth is out of bounds or memory ran out.
+ * @critical O(depth)
+ */
+bool anscheduler_socket_set_depth(socket_desc_t * socket, uint64_t depth);
+
 /**
  * Finds the remote task which is connected to this socket. If the task is
  * found, it is referenced and returned. Otherwise, NULL is returned.
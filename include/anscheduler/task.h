@@ -6,15 +6,57 @@
 #define ANSCHEDULER_TASK_KILL_REASON_SELF 0
 #define ANSCHEDULER_TASK_KILL_REASON_EXTERNAL 1
 #define ANSCHEDULER_TASK_KILL_REASON_MEMORY 2
+#define ANSCHEDULER_TASK_KILL_REASON_STACK 3
 
-// maximum of 0x100000 threads when it's done this way
+// the user stacks region is shared out between threads as they need it
 #define ANSCHEDULER_TASK_CODE_PAGE              0x400
 #define ANSCHEDULER_TASK_KERN_STACKS_PAGE    0x100000
 #define ANSCHEDULER_TASK_USER_STACKS_PAGE    0x200000
 #define ANSCHEDULER_TASK_DATA_PAGE         0x10200000
+#define ANSCHEDULER_TASK_END_PAGE         0x800000000
 
 task_t * anscheduler_task_create();
 
+/**
+ * Creates a new task whose address space is a copy-on-write clone of the
+ * code and data regions of `task`. Writable user pages are made read-only
+ * and shared by both tasks; the first write to such a page from either task
+ * copies it. Thread stacks are not cloned, and the new task has no threads or
+ * sockets. Each shared frame stays charged to exactly one of the tasks which
+ * map it.
+ * @param task A referenced task.
+ * @return A new task which has not been launched, or NULL on failure.
+ * @critical This walks every mapped page in the code and data regions.
+ */
+task_t * anscheduler_task_fork(task_t * task);
+
+/**
+ * Creates instances of a template task in one batch. The template is an
+ * unlaunched task whose code and data have been set up; each instance gets a
+ * copy-on-write clone of them (see anscheduler_task_fork()), the template's
+ * group and memory limit, and one thread. The template's address space is
+ * only walked once for the whole batch, but every instance still allocates
+ * its own page tables, kernel mappings and thread.
+ * @param template A referenced task. It may be reused for more batches.
+ * @param tasks Filled in with the new tasks, which have not been launched.
+ * Each task's thread is its `firstThread`, and its state must be configured
+ * before the task is launched.
+ * @return The number of tasks created, which may be less than `count` if
+ * memory runs out.
+ * @critical O(count) plus the size of the template's address space
+ */
+uint64_t anscheduler_task_spawn(task_t * template,
+                                task_t ** tasks,
+                                uint64_t count);
+
+/**
+ * Launches a batch of tasks, scheduling all of their threads with a single
+ * insertion into the run queue.
+ * @param tasks Tasks which have not been launched.
+ * @critical O(n) in the number of threads
+ */
+void anscheduler_task_launch_batch(task_t ** tasks, uint64_t count);
+
 /**
  * Adds a task's to the scheduling queue.
  * @param task A reference is not needed here since the task is presumed not
@@ -49,11 +91,62 @@ void anscheduler_task_dereference(task_t * task);
 /**
  * Finds a launched task with a specified PID. The returned task is
  * referenced, so you must dereference it yourself.
- * @critical With many tasks, this may take some time, despite the fact that
- * a PID hashmap is used.
+ * @critical O(1), and lock-free with respect to other lookups.
  */
 task_t * anscheduler_task_for_pid(uint64_t pid);
 
+/**
+ * Takes a snapshot of launched tasks for monitoring, without holding any lock
+ * across the walk. Tasks which are being killed are included.
+ * @param firstPid The lowest PID to report. To fetch the next batch, pass one
+ * more than the last PID in this batch.
+ * @param stats An array of at least `max` entries.
+ * @return The number of entries filled in, in ascending PID order. If this is
+ * less than `max`, there are no more tasks.
+ * @critical O(max), so pick a batch size which keeps this short.
+ */
+uint64_t anscheduler_task_stats(uint64_t firstPid,
+                                task_stats_t * stats,
+                                uint64_t max);
+
+/**
+ * Charges pages of memory to a task.
+ * @param counter One of the fields of `task->mem`.
+ * @param force If true, the pages are charged even if this puts the task
+ * over its limit. Use this for memory the task cannot refuse.
+ * @return false if the pages would put the task over its memory limit, in
+ * which case nothing is charged.
+ * @critical
+ */
+bool anscheduler_task_mem_charge(task_t * task,
+                                 uint64_t * counter,
+                                 uint64_t pages,
+                                 bool force);
+
+/**
+ * Releases pages which were charged with anscheduler_task_mem_charge(). The
+ * platform should call this if it frees user memory out from under a task.
+ * @critical
+ */
+void anscheduler_task_mem_uncharge(task_t * task,
+                                   uint64_t * counter,
+                                   uint64_t pages);
+
+/**
+ * Sets the maximum number of pages which may be charged to a task. Memory
+ * which is already charged is not affected.
+ * @param pages The new limit, or 0 for no limit.
+ * @critical
+ */
+void anscheduler_task_mem_limit(task_t * task, uint64_t pages);
+
+/**
+ * Takes a snapshot of the memory charged to a task, including the pages its
+ * page tables occupy.
+ * @critical O(n) with the size of the task's address space
+ */
+void anscheduler_task_mem(task_t * task, task_mem_t * usage);
+
 /**
  * Exit the current task with a specified code. This will automatically
  * switch to the CPU stack for you and run the next task in the loop. This
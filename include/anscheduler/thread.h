@@ -3,8 +3,31 @@
 
 #include "types.h"
 
+// the most pages a thread's user stack and guard pages may take together
+#define ANSCHEDULER_THREAD_STACK_MAX 0x100000
+
+// bounded by the kernel stack slots, which fill the kernel stacks region
+#define ANSCHEDULER_THREAD_MAX 0x10000
+
+#define ANSCHEDULER_THREAD_STACK_PAGES 0x100
+#define ANSCHEDULER_THREAD_GUARD_PAGES 1
+
+// a stack fault allocates up to this many pages, counting down from the
+// faulting one, so that a growing stack doesn't fault on every page
+#define ANSCHEDULER_THREAD_FAULT_PAGES 4
+
+// each thread's kernel stack lives in its own slot of this many pages, the
+// lowest of which is always a guard page
+#define ANSCHEDULER_THREAD_KERN_SLOT 0x10
+#ifndef ANSCHEDULER_THREAD_KERN_PAGES
+#define ANSCHEDULER_THREAD_KERN_PAGES 2
+#endif
+
+// the most exited threads a task keeps around for reuse
+#define ANSCHEDULER_THREAD_CACHE_SIZE 8
+
 /**
- * Creates a thread and all its associated resources.
+ * Creates a thread with the default stack and guard sizes.
  * @param task A referenced task.
  * @return a new thread, or NULL if allocation failed.
  * @critical This doesn't take too much time because the user stack is
@@ -12,6 +35,29 @@
  */
 thread_t * anscheduler_thread_create(task_t * task);
 
+/**
+ * Fills in the default thread options.
+ */
+void anscheduler_thread_attr_init(thread_attr_t * attr);
+
+/**
+ * Creates a thread and all its associated resources. If the task has a cached
+ * thread with the same stack sizes, it is reused along with its stacks and
+ * any user stack pages it faulted in.
+ * @param task A referenced task.
+ * @param attr The thread's options, or NULL for the defaults. The user stack
+ * must be at least one page, and the stack and guard together may be at most
+ * ANSCHEDULER_THREAD_STACK_MAX pages; they reserve just that much of the
+ * task's user stacks region. The kernel stack must be at least one page and
+ * less than ANSCHEDULER_THREAD_KERN_SLOT pages. At most `stackPages` pages
+ * may be prefaulted; they are allocated as far as the task's memory limit
+ * allows, and the rest of the stack is still faulted in lazily.
+ * @return a new thread, or NULL if allocation failed or `attr` is invalid.
+ * @critical Only the page tables covering the stack are allocated here.
+ */
+thread_t * anscheduler_thread_create_attr(task_t * task,
+                                          const thread_attr_t * attr);
+
 /**
  * Adds a thread to a task. This will schedule the thread, so make sure the
  * task has already been launched when you call this.
@@ -21,6 +67,14 @@ thread_t * anscheduler_thread_create(task_t * task);
  */
 void anscheduler_thread_add(task_t * task, thread_t * thread);
 
+/**
+ * Adds a thread to a task without scheduling it. Use this for tasks which
+ * have not been launched yet; launching the task schedules the thread.
+ * @param task A referenced task.
+ * @critical
+ */
+void anscheduler_thread_link(task_t * task, thread_t * thread);
+
 /**
  * Set the thread to listen for events from sockets. If an event has already
  * been received, false is returned. Otherwise, true is returned.
@@ -31,12 +85,41 @@ void anscheduler_thread_add(task_t * task, thread_t * thread);
  */
 bool anscheduler_thread_poll();
 
+/**
+ * Removes the oldest thread from the task's waiter queue which is still
+ * polling, and clears its isPolling flag. Threads which were woken some other
+ * way are dropped from the queue as they are found.
+ * @param task A referenced task.
+ * @return The thread, which you must now push or switch to, or NULL if no
+ * thread is polling.
+ * @critical
+ */
+thread_t * anscheduler_thread_pop_waiter(task_t * task);
+
 /**
  * Call this to exit the current thread, presumably in a syscall handler.
+ * Unless the thread is joinable or its task's cache is full, the thread keeps
+ * its stacks and is cached for the next anscheduler_thread_create_attr().
+ * @param code The exit code, which is reported to the thread which joins this
+ * one if it is joinable.
  * @noncritical This potentially frees lots of memory, so it should be called
  * from a thread's execution state in kernel mode.
  */
-void anscheduler_thread_exit();
+void anscheduler_thread_exit(uint64_t code);
+
+/**
+ * Waits for a joinable thread in the current task to exit and frees what is
+ * left of it. Each joinable thread must be joined exactly once, or it is
+ * only freed along with its task.
+ * @param thread A joinable thread in the current task other than the current
+ * thread. It may have exited already.
+ * @param code Set to the thread's exit code.
+ * @return false without waiting if the thread isn't joinable or another
+ * thread is already joining it.
+ * @critical Call this from the thread's kernel stack, presumably in a syscall
+ * handler. It returns when the current thread runs again.
+ */
+bool anscheduler_thread_join(thread_t * thread, uint64_t * code);
 
 /**
  * Deallocates a thread's user stack, locking the CPU when needed.
@@ -46,11 +129,17 @@ void anscheduler_thread_exit();
 void anscheduler_thread_deallocate(task_t * task, thread_t * thread);
 
 /**
- * Returns the beginning of the kernel stack for a given thread or NULL if one
- * is not mapped.  The address returned is in the kernel's address space.
+ * Frees every thread in a dead task's thread cache, along with their stacks.
+ * @noncritical
+ */
+void anscheduler_thread_free_cache(task_t * task);
+
+/**
+ * Unmaps a thread's kernel stack and frees its pages. The thread must not be
+ * running.
  * @critical
  */
-void * anscheduler_thread_kernel_stack(task_t * task, thread_t * thread);
+void anscheduler_thread_free_kernel_stack(task_t * task, thread_t * thread);
 
 /**
  * Returns the address of the thread's kernel stack in the user's address
@@ -68,4 +157,17 @@ void * anscheduler_thread_interrupt_stack(thread_t * thread);
  */
 void * anscheduler_thread_user_stack(thread_t * thread);
 
+/**
+ * @return true if `page` is in one of the guard pages below the thread's user
+ * stack. A fault there means the thread overflowed its stack.
+ * @critical
+ */
+bool anscheduler_thread_in_guard(thread_t * thread, uint64_t page);
+
+/**
+ * @return true if `page` is the guard page below the thread's kernel stack.
+ * @critical
+ */
+bool anscheduler_thread_in_kernel_guard(thread_t * thread, uint64_t page);
+
 #endif
@@ -7,6 +7,10 @@ typedef struct socket_t socket_t;
 typedef struct socket_desc_t socket_desc_t;
 typedef struct socket_msg_t socket_msg_t;
 typedef struct page_fault_t page_fault_t;
+typedef struct task_group_t task_group_t;
+typedef struct futex_waiter_t futex_waiter_t;
+typedef struct socket_writer_t socket_writer_t;
+typedef struct stack_range_t stack_range_t;
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -17,9 +21,24 @@ typedef struct page_fault_t page_fault_t;
 #define ANSCHEDULER_MSG_TYPE_CONNECT 0
 #define ANSCHEDULER_MSG_TYPE_DATA 1
 #define ANSCHEDULER_MSG_TYPE_CLOSE 2
+#define ANSCHEDULER_MSG_TYPE_GRANT 3
 
 #define ANSCHEDULER_MAX_MSG_BUFFER 0x8
 
+// slots in each direction of a new socket; must be a power of two
+#define ANSCHEDULER_SOCKET_RING_SIZE 0x20
+
+/**
+ * Pages of memory which the scheduler has allocated on behalf of a task.
+ */
+typedef struct {
+  uint64_t user; // data pages allocated by page faults or copy-on-write
+  uint64_t stack; // user stack pages
+  uint64_t kernStack; // kernel stack pages
+  uint64_t messages; // socket messages waiting to be read by the task
+  uint64_t tables; // page tables; only filled in by anscheduler_task_mem()
+} __attribute__((packed)) task_mem_t;
+
 struct task_t {
   task_t * next, * last;
   
@@ -29,22 +48,45 @@ struct task_t {
   // virtual memory structure
   uint64_t vmLock;
   void * vm;
+  uint64_t hasSharedFrames; // set once a fork shares frames with this task
+  
+  // memory charged to this task, in pages
+  uint64_t memLock;
+  task_mem_t mem;
+  uint64_t memLimit; // 0 means unlimited
   
   // hash map of open sockets
   uint64_t socketsLock;
   socket_desc_t * sockets[0x10];
+  uint64_t socketCount;
   
   // list of sockets with pending messages
   uint64_t pendingLock;
   socket_desc_t * firstPending;
   
+  // threads in anscheduler_thread_poll(), oldest first; uses pendingLock
+  thread_t * firstWaiter, * lastWaiter;
+  
   // list of threads in this task
   uint64_t threadsLock;
   thread_t * firstThread;
+  uint64_t threadCount;
+  
+  // joinable threads which have exited but not been joined; uses threadsLock
+  thread_t * firstZombie;
+  
+  // exited threads kept with their stacks for reuse; uses threadsLock
+  thread_t * firstCached;
+  uint64_t cachedCount; // includes threads which are still exiting
+  
+  // time spent running this task's threads, summed across CPUs
+  uint64_t cpuTime;
   
-  // the stack indexes (for layout in virtual memory)
+  // the stack indexes (for kernel stack slots) and the user stacks region
   uint64_t stacksLock;
   anidxset_root_t stacks;
+  stack_range_t * firstFreeStack; // freed ranges, in address order
+  uint64_t stacksBreak; // pages at the bottom of the region handed out
   
   // the index set for allocating socket descriptors
   uint64_t descriptorsLock;
@@ -54,6 +96,9 @@ struct task_t {
   uint64_t refCount; // when this reaches 0 and isKilled = 1, kill this task
   uint64_t isKilled; // 0 or 1, starts at 0
   uint64_t killReason;
+  
+  // CPU bandwidth group, or NULL; set before the task is launched
+  task_group_t * group;
 
   // API user info for this task; should be declared in anscheduler_structs.h
   anscheduler_task_ui_t ui;
@@ -71,8 +116,79 @@ struct thread_t {
   char reserved[7]; // for alignment
     
   anscheduler_state state;
+  
+  // the thread's range of the user stacks region holds `guardPages` pages
+  // which are never mapped, followed by `stackPages` pages of user stack
+  stack_range_t * stackRange;
+  uint64_t stackPages;
+  uint64_t guardPages;
+  
+  // the kernel stack is the top `kernPages` pages of its slot
+  uint64_t kernPages;
+  
+  // link in the task's waiter queue
+  thread_t * waitNext, * waitLast;
+  
+  // the futex this thread is sleeping on, or NULL
+  futex_waiter_t * futex;
+  
+  // see anscheduler_thread_join(); these use the task's threadsLock
+  uint64_t isJoinable;
+  uint64_t hasExited;
+  uint64_t exitCode;
+  thread_t * joiner;
+  
+  // saved FPU/SIMD registers, allocated when the thread first uses them
+  void * fpuArea;
+  uint64_t fpuCpu; // the CPU which last loaded this thread's registers
+  
+  // 1 if the thread goes to its task's thread cache when it exits
+  uint64_t isCached;
+  
+  // a fault on this thread's stack also allocates the stack pages below the
+  // faulting one, up to `faultPages` pages in all
+  uint64_t faultPages;
 } __attribute__((packed));
 
+/**
+ * Options for creating a thread. Use anscheduler_thread_attr_init() to fill
+ * in the defaults before changing any fields.
+ */
+typedef struct {
+  uint64_t stackPages; // pages of lazily allocated user stack
+  uint64_t guardPages; // unmapped pages below the user stack
+  uint64_t kernPages; // pages of kernel stack, above one guard page
+  uint64_t isJoinable; // 1 if the thread will be joined, defaults to 0
+  uint64_t prefaultPages; // top stack pages allocated up front, defaults to 0
+  uint64_t faultPages; // most stack pages allocated by a single fault
+} __attribute__((packed)) thread_attr_t;
+
+/**
+ * The messages travelling in one direction of a socket. Only the sending side
+ * moves `tail` and only the receiving side moves `head`, and each side
+ * publishes its index with release ordering, so a sender and a reader don't
+ * share a lock. This is not a lock-free ring, since several threads of a
+ * task, as well as kernel threads sending CONNECT and CLOSE, may send on one
+ * endpoint: senders serialize on `producerLock` and readers on
+ * `consumerLock`, and resizing takes both. The indexes only ever grow; a
+ * message lives in slot `index & (size - 1)`.
+ */
+typedef struct {
+  uint64_t producerLock; // serializes senders, which may be several threads
+  uint64_t tail;
+  uint64_t consumerLock; // serializes readers
+  uint64_t head;
+  
+  // replaced only while both locks are held
+  socket_msg_t ** slots;
+  uint64_t size; // a power of two
+  uint64_t depth; // the most data messages which may be queued
+  
+  // senders waiting for the ring to drain
+  uint64_t writersLock;
+  socket_writer_t * firstWriter;
+} __attribute__((packed)) socket_ring_t;
+
 /**
  * An internal data structure which stores a message queue and points to the
  * two socket endpoints, the connector and the receiver.
@@ -83,15 +199,8 @@ struct socket_t {
   uint64_t connRecLock;
   socket_desc_t * connector, * receiver;
   
-  uint64_t forConnectorLock;
-  uint64_t forConnectorCount;
-  socket_msg_t * forConnectorFirst;
-  socket_msg_t * forConnectorLast;
-  
-  uint64_t forReceiverLock;
-  uint64_t forReceiverCount;
-  socket_msg_t * forReceiverFirst;
-  socket_msg_t * forReceiverLast;
+  socket_ring_t forConnector;
+  socket_ring_t forReceiver;
   
   uint64_t hasBeenConnected;
 } __attribute__((packed));
@@ -113,10 +222,37 @@ struct socket_desc_t {
 } __attribute__((packed));
 
 struct socket_msg_t {
-  socket_msg_t * next;
+  socket_msg_t * next; // not used by the socket queues
   uint64_t type;
   uint64_t len;
-  uint8_t message[0xfe8]; // 0x1000 - 0x18
+  uint8_t message[0xfe8]; // 0x1000 - 0x18, but only `len` bytes are allocated
+} __attribute__((packed));
+
+/**
+ * A snapshot of a task's vital statistics for monitoring. The fields are read
+ * without locks, so they may be slightly out of date.
+ */
+typedef struct {
+  uint64_t pid;
+  uint64_t threadCount;
+  uint64_t refCount;
+  uint64_t socketCount;
+  uint64_t cpuTime; // same units as anscheduler_get_time()
+} __attribute__((packed)) task_stats_t;
+
+/**
+ * A set of tasks which share a budget of CPU time. In every period, the
+ * threads of all the group's tasks together may run for `quota` time units;
+ * after that, they are not scheduled until the next period begins.
+ */
+struct task_group_t {
+  uint64_t lock; // applies to every field below
+  uint64_t refCount; // one for each task, plus any held by the creator
+  
+  uint64_t period; // same units as anscheduler_get_time()
+  uint64_t quota; // 0 means unlimited
+  uint64_t periodStart;
+  uint64_t used; // time consumed since periodStart
 } __attribute__((packed));
 
 struct page_fault_t {
@@ -0,0 +1,125 @@
+#include <anscheduler/fpu.h>
+#include <anscheduler/functions.h>
+#include <anscheduler/task.h>
+#include <anscheduler/loop.h>
+
+/**
+ * Only ever changed with `lock` held. Other CPUs take the lock to check
+ * whether a thread's newest registers are stuck here, or to forget a thread
+ * which is about to be freed.
+ */
+typedef struct {
+  uint64_t lock;
+  thread_t * owner; // the thread whose state is in the registers, or NULL
+  uint64_t isDirty; // 1 if the registers may be newer than the owner's area
+  uint64_t saveRequested; // 1 if the owner is waiting to run elsewhere
+} __attribute__((packed)) fpu_cpu_t;
+
+static fpu_cpu_t cpuFpus[ANSCHEDULER_MAX_CPUS] __attribute__((aligned(8)));
+
+static fpu_cpu_t * _cpu_fpu();
+
+/**
+ * @return true if the thread's newest registers are only held by another
+ * CPU, in which case that CPU is asked to save them.
+ * @critical
+ */
+static bool _request_remote_save(thread_t * thread);
+
+void anscheduler_fpu_fault() {
+  fpu_cpu_t * fpu = _cpu_fpu();
+  task_t * task = anscheduler_cpu_get_task();
+  thread_t * thread = anscheduler_cpu_get_thread();
+  
+  if (_request_remote_save(thread)) {
+    // try again once the other CPU has saved our registers
+    anscheduler_loop_resign();
+  }
+  
+  bool isNew = !thread->fpuArea;
+  if (isNew) {
+    thread->fpuArea = anscheduler_alloc(0x1000);
+    if (!thread->fpuArea) {
+      anscheduler_task_exit(ANSCHEDULER_TASK_KILL_REASON_MEMORY);
+    }
+  }
+  
+  anscheduler_fpu_enable();
+  anscheduler_lock(&fpu->lock);
+  
+  // this is the only time the previous owner's registers are saved
+  if (fpu->owner && fpu->owner != thread && fpu->isDirty) {
+    anscheduler_fpu_save(fpu->owner->fpuArea);
+  }
+  if (isNew) anscheduler_fpu_init();
+  else anscheduler_fpu_restore(thread->fpuArea);
+  
+  fpu->owner = thread;
+  fpu->isDirty = 1;
+  fpu->saveRequested = 0;
+  thread->fpuCpu = anscheduler_cpu_get_index();
+  anscheduler_unlock(&fpu->lock);
+  anscheduler_thread_run(task, thread);
+}
+
+void anscheduler_fpu_leave() {
+  // the registers stay put until another thread traps or this CPU idles
+  anscheduler_fpu_disable();
+}
+
+void anscheduler_fpu_enter(thread_t * next) {
+  fpu_cpu_t * fpu = _cpu_fpu();
+  uint64_t index = anscheduler_cpu_get_index();
+  
+  anscheduler_lock(&fpu->lock);
+  if (fpu->isDirty && (fpu->saveRequested || !next)) {
+    // nobody may trap here for a while, so don't keep the owner waiting
+    anscheduler_fpu_enable();
+    anscheduler_fpu_save(fpu->owner->fpuArea);
+    fpu->isDirty = 0;
+  }
+  fpu->saveRequested = 0;
+  
+  // if the thread used the FPU on another CPU since, our copy is stale
+  if (next && next == fpu->owner && next->fpuCpu == index) {
+    anscheduler_fpu_enable();
+    fpu->isDirty = 1;
+  } else {
+    anscheduler_fpu_disable();
+  }
+  anscheduler_unlock(&fpu->lock);
+}
+
+void anscheduler_fpu_release(thread_t * thread) {
+  if (!thread->fpuArea) return;
+  
+  // make sure no CPU saves into the area or hands the registers back to a
+  // new thread at this address
+  int i;
+  for (i = 0; i < ANSCHEDULER_MAX_CPUS; i++) {
+    anscheduler_lock(&cpuFpus[i].lock);
+    if (cpuFpus[i].owner == thread) {
+      cpuFpus[i].owner = NULL;
+      cpuFpus[i].isDirty = 0;
+    }
+    anscheduler_unlock(&cpuFpus[i].lock);
+  }
+  anscheduler_free(thread->fpuArea);
+  thread->fpuArea = NULL;
+}
+
+static fpu_cpu_t * _cpu_fpu() {
+  return &cpuFpus[anscheduler_cpu_get_index()];
+}
+
+static bool _request_remote_save(thread_t * thread) {
+  if (!thread->fpuArea || thread->fpuCpu == anscheduler_cpu_get_index()) {
+    return false;
+  }
+  fpu_cpu_t * fpu = &cpuFpus[thread->fpuCpu];
+  anscheduler_lock(&fpu->lock);
+  bool isStuck = fpu->owner == thread && fpu->isDirty;
+  if (isStuck) fpu->saveRequested = 1;
+  anscheduler_unlock(&fpu->lock);
+  return isStuck;
+}
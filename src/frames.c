@@ -0,0 +1,376 @@
+#include "frames.h"
+#include "slab.h"
+#include <anscheduler/functions.h>
+
+// Tracked frames live in a hash table with a lock per bucket. The table is
+// made of pages of buckets and doubles or halves with the number of tracked
+// frames, going back to the static table once few frames are tracked.
+#define FRAMES_PAGE_BUCKETS 0x100
+#define FRAMES_MAX_PAGES 0x100
+#define FRAMES_LOAD_MAX 2
+
+typedef struct frame_ref_t frame_ref_t;
+
+struct frame_ref_t {
+  frame_ref_t * next;
+  uint64_t phys;
+  uint64_t count; // the number of address spaces which map the frame
+  task_t * owner; // the task charged for the frame, if any
+  uint64_t isOrphaned; // the task charged for it no longer maps it
+} __attribute__((packed));
+
+typedef struct {
+  uint64_t lock; // applies to every reference in the bucket
+  frame_ref_t * first;
+} __attribute__((packed)) frame_bucket_t;
+
+typedef struct {
+  uint64_t bucketCount; // a power of two
+  uint64_t frameCount; // the number of frames in the table
+  uint64_t isRetired; // set once the table has been replaced
+  frame_bucket_t * pages[FRAMES_MAX_PAGES];
+} __attribute__((packed)) frames_table_t;
+
+/**
+ * A per-CPU sequence number which is odd while the CPU may be using a
+ * bucket. Each counter gets its own cache line.
+ */
+typedef struct {
+  uint64_t sequence;
+  char reserved[0x38];
+} __attribute__((packed)) frames_user_t;
+
+static frame_bucket_t initialBuckets[FRAMES_PAGE_BUCKETS]
+  __attribute__((aligned(8)));
+static frames_table_t initialTable __attribute__((aligned(8))) = {
+  FRAMES_PAGE_BUCKETS, 0, 0, {initialBuckets}
+};
+static frames_table_t * currentTable __attribute__((aligned(8)))
+  = &initialTable;
+static frames_user_t users[ANSCHEDULER_MAX_CPUS] __attribute__((aligned(0x40)));
+
+// held while the table is being replaced
+static uint64_t resizeLock __attribute__((aligned(8))) = 0;
+
+/**
+ * Finds and locks the bucket for a frame in the current table.
+ * @critical Pair this with _unlock_bucket().
+ */
+static frame_bucket_t * _lock_bucket(uint64_t phys, frames_table_t ** table);
+
+/**
+ * @critical
+ */
+static void _unlock_bucket(frame_bucket_t * bucket);
+
+/**
+ * @return The reference for `phys` in a locked bucket, or NULL.
+ * @critical
+ */
+static frame_ref_t * _find_ref(frame_bucket_t * bucket, uint64_t phys);
+
+/**
+ * Adds a reference to a locked bucket.
+ * @return NULL if memory ran out.
+ * @critical
+ */
+static frame_ref_t * _insert_ref(frame_bucket_t * bucket, uint64_t phys);
+
+/**
+ * Takes a reference out of a locked bucket, unlocks the bucket and frees the
+ * reference.
+ * @critical
+ */
+static void _remove_ref(frames_table_t * table,
+                        frame_bucket_t * bucket,
+                        frame_ref_t * ref);
+
+/**
+ * @return The bucket in `table` which holds `phys`.
+ */
+static frame_bucket_t * _bucket_in(frames_table_t * table, uint64_t phys);
+
+/**
+ * @return The bucket at `index` in `table`.
+ */
+static frame_bucket_t * _bucket_at(frames_table_t * table, uint64_t index);
+
+/**
+ * Adds `delta` to the number of frames in `table`.
+ * @return The number of buckets the table should be resized to, or 0 if its
+ * size is fine.
+ * @critical Call this with a bucket of `table` locked.
+ */
+static uint64_t _count_frames(frames_table_t * table, int64_t delta);
+
+/**
+ * Moves every frame into a new table with `bucketCount` buckets, unless the
+ * table has been replaced since `table` was read or memory runs out.
+ * @critical Call this with no bucket locked.
+ */
+static void _resize(frames_table_t * table, uint64_t bucketCount);
+
+/**
+ * @return A table with `bucketCount` empty buckets, or NULL on failure.
+ * @critical
+ */
+static frames_table_t * _table_alloc(uint64_t bucketCount);
+
+/**
+ * @critical
+ */
+static void _table_free(frames_table_t * table);
+
+bool anscheduler_frame_share(uint64_t phys, uint64_t count) {
+  frames_table_t * table;
+  frame_bucket_t * bucket = _lock_bucket(phys, &table);
+  frame_ref_t * ref = _find_ref(bucket, phys);
+  if (ref) {
+    ref->count += count;
+    _unlock_bucket(bucket);
+    return true;
+  }
+
+  ref = _insert_ref(bucket, phys);
+  if (!ref) {
+    _unlock_bucket(bucket);
+    return false;
+  }
+  ref->count = count + 1;
+  uint64_t size = _count_frames(table, 1);
+  _unlock_bucket(bucket);
+  if (size) _resize(table, size);
+  return true;
+}
+
+bool anscheduler_frame_is_shared(uint64_t phys) {
+  frames_table_t * table;
+  frame_bucket_t * bucket = _lock_bucket(phys, &table);
+  frame_ref_t * ref = _find_ref(bucket, phys);
+  bool result = ref && ref->count > 1;
+  _unlock_bucket(bucket);
+  return result;
+}
+
+bool anscheduler_frame_claim(uint64_t phys, task_t * task) {
+  frames_table_t * table;
+  frame_bucket_t * bucket = _lock_bucket(phys, &table);
+  frame_ref_t * ref = _find_ref(bucket, phys);
+  if (ref) {
+    ref->owner = task;
+    ref->isOrphaned = 0;
+    _unlock_bucket(bucket);
+    return true;
+  }
+
+  ref = _insert_ref(bucket, phys);
+  if (!ref) {
+    _unlock_bucket(bucket);
+    return false;
+  }
+  ref->count = 1;
+  ref->owner = task;
+  uint64_t size = _count_frames(table, 1);
+  _unlock_bucket(bucket);
+  if (size) _resize(table, size);
+  return true;
+}
+
+task_t * anscheduler_frame_owner(uint64_t phys) {
+  frames_table_t * table;
+  frame_bucket_t * bucket = _lock_bucket(phys, &table);
+  frame_ref_t * ref = _find_ref(bucket, phys);
+  task_t * owner = ref ? ref->owner : NULL;
+  _unlock_bucket(bucket);
+  return owner;
+}
+
+bool anscheduler_frame_is_orphaned(uint64_t phys) {
+  frames_table_t * table;
+  frame_bucket_t * bucket = _lock_bucket(phys, &table);
+  frame_ref_t * ref = _find_ref(bucket, phys);
+  bool result = ref && ref->isOrphaned;
+  _unlock_bucket(bucket);
+  return result;
+}
+
+bool anscheduler_frame_release(uint64_t phys, task_t * task) {
+  frames_table_t * table;
+  frame_bucket_t * bucket = _lock_bucket(phys, &table);
+  frame_ref_t * ref = _find_ref(bucket, phys);
+  if (!ref) {
+    _unlock_bucket(bucket);
+    return true;
+  }
+  
+  if (!(--ref->count)) {
+    _remove_ref(table, bucket, ref);
+    return true;
+  }
+  if (task && ref->owner == task) {
+    // the charge has to move to one of the tasks which still map the frame
+    ref->owner = NULL;
+    ref->isOrphaned = 1;
+  } else if (ref->count == 1 && !ref->owner && !ref->isOrphaned) {
+    _remove_ref(table, bucket, ref);
+    return false;
+  }
+  _unlock_bucket(bucket);
+  return false;
+}
+
+static frame_bucket_t * _lock_bucket(uint64_t phys, frames_table_t ** table) {
+  frames_user_t * user = &users[anscheduler_cpu_get_index()];
+  __atomic_fetch_add(&user->sequence, 1, __ATOMIC_SEQ_CST);
+  while (1) {
+    // a resize locks every bucket before it retires the table
+    frames_table_t * current = __atomic_load_n(&currentTable,
+                                               __ATOMIC_ACQUIRE);
+    frame_bucket_t * bucket = _bucket_in(current, phys);
+    anscheduler_lock(&bucket->lock);
+    if (!current->isRetired) {
+      (*table) = current;
+      return bucket;
+    }
+    anscheduler_unlock(&bucket->lock);
+  }
+}
+
+static void _unlock_bucket(frame_bucket_t * bucket) {
+  anscheduler_unlock(&bucket->lock);
+  frames_user_t * user = &users[anscheduler_cpu_get_index()];
+  __atomic_fetch_add(&user->sequence, 1, __ATOMIC_RELEASE);
+}
+
+static frame_ref_t * _find_ref(frame_bucket_t * bucket, uint64_t phys) {
+  frame_ref_t * ref = bucket->first;
+  while (ref && ref->phys != phys) ref = ref->next;
+  return ref;
+}
+
+static frame_ref_t * _insert_ref(frame_bucket_t * bucket, uint64_t phys) {
+  frame_ref_t * ref = anscheduler_slab_alloc(sizeof(frame_ref_t));
+  if (!ref) return NULL;
+  ref->phys = phys;
+  ref->next = bucket->first;
+  bucket->first = ref;
+  return ref;
+}
+
+static void _remove_ref(frames_table_t * table,
+                        frame_bucket_t * bucket,
+                        frame_ref_t * ref) {
+  frame_ref_t ** link = &bucket->first;
+  while (*link != ref) link = &(*link)->next;
+  (*link) = ref->next;
+  uint64_t size = _count_frames(table, -1);
+  _unlock_bucket(bucket);
+  anscheduler_slab_free(ref);
+  if (size) _resize(table, size);
+}
+
+static frame_bucket_t * _bucket_in(frames_table_t * table, uint64_t phys) {
+  return _bucket_at(table, (phys ^ (phys >> 16)) & (table->bucketCount - 1));
+}
+
+static frame_bucket_t * _bucket_at(frames_table_t * table, uint64_t index) {
+  return &table->pages[index / FRAMES_PAGE_BUCKETS]
+                      [index % FRAMES_PAGE_BUCKETS];
+}
+
+static uint64_t _count_frames(frames_table_t * table, int64_t delta) {
+  uint64_t count = __atomic_add_fetch(&table->frameCount, delta,
+                                      __ATOMIC_RELAXED);
+  uint64_t buckets = table->bucketCount;
+  if (delta > 0 && count > buckets * FRAMES_LOAD_MAX
+      && buckets < FRAMES_PAGE_BUCKETS * FRAMES_MAX_PAGES) {
+    return buckets * 2;
+  } else if (delta < 0 && count < buckets / 2
+             && buckets > FRAMES_PAGE_BUCKETS) {
+    return buckets / 2;
+  }
+  return 0;
+}
+
+static void _resize(frames_table_t * table, uint64_t bucketCount) {
+  // the table may be gone already, but it can't go while we hold resizeLock
+  anscheduler_lock(&resizeLock);
+  if (table != currentTable || table->bucketCount == bucketCount) {
+    anscheduler_unlock(&resizeLock);
+    return;
+  }
+  frames_table_t * newTable = _table_alloc(bucketCount);
+  if (!newTable) {
+    // the old table still works; it is only slower
+    anscheduler_unlock(&resizeLock);
+    return;
+  }
+
+  // nobody is in a bucket of the old table once we hold all of its locks
+  uint64_t i, count = 0;
+  for (i = 0; i < table->bucketCount; i++) {
+    anscheduler_lock(&_bucket_at(table, i)->lock);
+  }
+  for (i = 0; i < table->bucketCount; i++) {
+    frame_bucket_t * bucket = _bucket_at(table, i);
+    while (bucket->first) {
+      frame_ref_t * ref = bucket->first;
+      bucket->first = ref->next;
+      frame_bucket_t * dest = _bucket_in(newTable, ref->phys);
+      ref->next = dest->first;
+      dest->first = ref;
+      count++;
+    }
+  }
+  newTable->frameCount = count;
+  __atomic_store_n(&currentTable, newTable, __ATOMIC_RELEASE);
+  table->isRetired = 1;
+  for (i = 0; i < table->bucketCount; i++) {
+    anscheduler_unlock(&_bucket_at(table, i)->lock);
+  }
+
+  // wait for every CPU which may still be looking at the old table
+  __sync_synchronize();
+  uint64_t me = anscheduler_cpu_get_index();
+  for (i = 0; i < ANSCHEDULER_MAX_CPUS; i++) {
+    if (i == me) continue;
+    uint64_t seq = __atomic_load_n(&users[i].sequence, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) continue;
+    while (__atomic_load_n(&users[i].sequence, __ATOMIC_ACQUIRE) == seq);
+  }
+  _table_free(table);
+  anscheduler_unlock(&resizeLock);
+}
+
+static frames_table_t * _table_alloc(uint64_t bucketCount) {
+  if (bucketCount == FRAMES_PAGE_BUCKETS) {
+    // the static table is empty, since everything was moved out of it
+    initialTable.frameCount = 0;
+    initialTable.isRetired = 0;
+    return &initialTable;
+  }
+
+  frames_table_t * table = anscheduler_alloc(0x1000);
+  if (!table) return NULL;
+  anscheduler_zero(table, 0x1000);
+  table->bucketCount = bucketCount;
+  uint64_t i;
+  for (i = 0; i < bucketCount / FRAMES_PAGE_BUCKETS; i++) {
+    table->pages[i] = anscheduler_alloc(0x1000);
+    if (!table->pages[i]) {
+      _table_free(table);
+      return NULL;
+    }
+    anscheduler_zero(table->pages[i], 0x1000);
+  }
+  return table;
+}
+
+static void _table_free(frames_table_t * table) {
+  if (table == &initialTable) return;
+  uint64_t i;
+  for (i = 0; i < FRAMES_MAX_PAGES && table->pages[i]; i++) {
+    anscheduler_free(table->pages[i]);
+  }
+  anscheduler_free(table);
+}
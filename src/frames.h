@@ -0,0 +1,63 @@
+#ifndef __ANSCHEDULER_FRAMES_H__
+#define __ANSCHEDULER_FRAMES_H__
+
+#include <anscheduler/types.h>
+
+/**
+ * Physical frames which are mapped into more than one address space, or
+ * which a task has been charged for, have an entry in a reference count
+ * table. Any frame without an entry is owned by exactly one address space
+ * and charged to nobody, like the pages the platform maps itself.
+ *
+ * A shared frame stays charged to the one task which was charged for it
+ * before it was shared. If that task lets go of it first, the frame is
+ * orphaned, and the task which is left holding it alone is charged for it the
+ * next time it writes to it.
+ */
+
+/**
+ * Adds `count` references to a physical frame.
+ * @return false if the frame could not be tracked.
+ * @critical
+ */
+bool anscheduler_frame_share(uint64_t phys, uint64_t count);
+
+/**
+ * @return true if more than one address space maps the frame.
+ * @critical
+ */
+bool anscheduler_frame_is_shared(uint64_t phys);
+
+/**
+ * Records that `task` has been charged for a frame which it maps.
+ * @return false if the frame could not be tracked. This never fails for a
+ * frame which already has an entry.
+ * @critical
+ */
+bool anscheduler_frame_claim(uint64_t phys, task_t * task);
+
+/**
+ * @return The task which has been charged for the frame, or NULL.
+ * @critical
+ */
+task_t * anscheduler_frame_owner(uint64_t phys);
+
+/**
+ * @return true if the task which was charged for the frame no longer maps
+ * it, so that one of the tasks which still do should be charged instead.
+ * @critical
+ */
+bool anscheduler_frame_is_orphaned(uint64_t phys);
+
+/**
+ * Drops a reference to a physical frame. If `task` was charged for the frame,
+ * it no longer is; the caller should uncharge it.
+ * @param task The task which stops mapping the frame, or NULL if the
+ * reference was never mapped.
+ * @return true if the caller held the last reference and now owns the frame
+ * outright, false if other address spaces still map it.
+ * @critical
+ */
+bool anscheduler_frame_release(uint64_t phys, task_t * task);
+
+#endif
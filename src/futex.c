@@ -0,0 +1,206 @@
+#include <anscheduler/futex.h>
+#include <anscheduler/functions.h>
+#include <anscheduler/loop.h>
+
+#define FUTEX_BUCKET_COUNT 0x40
+
+/**
+ * Lives on the waiting thread's kernel stack for as long as it waits.
+ */
+struct futex_waiter_t {
+  futex_waiter_t * next, * last;
+  thread_t * thread;
+  void * vm;
+  uint64_t addr;
+  uint64_t deadline; // 0 means no timeout
+  uint64_t woken;
+} __attribute__((packed));
+
+typedef struct {
+  uint64_t lock; // applies to every waiter in the bucket
+  futex_waiter_t * first, * last;
+} __attribute__((packed)) futex_bucket_t;
+
+static futex_bucket_t buckets[FUTEX_BUCKET_COUNT] __attribute__((aligned(8)));
+
+static futex_bucket_t * _bucket_for(void * vm, uint64_t addr);
+
+/**
+ * Reads the 8-byte value at a virtual address in the task. A page which has
+ * not been allocated yet reads as zero.
+ * @return false if the address is not mapped for the user.
+ * @critical
+ */
+static bool _read_value(task_t * task, uint64_t addr, uint64_t * value);
+
+/**
+ * @critical Must be called with the bucket's lock held.
+ */
+static void _bucket_append(futex_bucket_t * bucket, futex_waiter_t * waiter);
+
+/**
+ * @critical Must be called with the bucket's lock held.
+ */
+static void _bucket_remove(futex_bucket_t * bucket, futex_waiter_t * waiter);
+
+/**
+ * Run right after the waiting thread's state has been saved.
+ * @critical
+ */
+static void _wait_continuation(futex_waiter_t * waiter);
+
+/**
+ * Puts the thread to sleep unless it has already been woken.
+ * @critical Run from the CPU dedicated stack.
+ */
+static void _wait_block(futex_waiter_t * waiter);
+
+int anscheduler_futex_wait(uint64_t * addr, uint64_t expected,
+                           uint64_t timeout) {
+  task_t * task = anscheduler_cpu_get_task();
+  thread_t * thread = anscheduler_cpu_get_thread();
+  if (((uint64_t)addr) & 7) return ANSCHEDULER_FUTEX_FAULT;
+  
+  futex_waiter_t waiter;
+  waiter.next = (waiter.last = NULL);
+  waiter.thread = thread;
+  waiter.vm = task->vm;
+  waiter.addr = (uint64_t)addr;
+  waiter.deadline = timeout ? anscheduler_get_time() + timeout : 0;
+  waiter.woken = 0;
+  futex_bucket_t * bucket = _bucket_for(waiter.vm, waiter.addr);
+  
+  anscheduler_lock(&bucket->lock);
+  uint64_t value;
+  if (!_read_value(task, waiter.addr, &value)) {
+    anscheduler_unlock(&bucket->lock);
+    return ANSCHEDULER_FUTEX_FAULT;
+  }
+  if (value != expected) {
+    anscheduler_unlock(&bucket->lock);
+    return ANSCHEDULER_FUTEX_MISMATCH;
+  }
+  _bucket_append(bucket, &waiter);
+  thread->futex = &waiter;
+  anscheduler_unlock(&bucket->lock);
+  
+  anscheduler_save_return_state(thread, &waiter,
+                                (void (*)(void *))_wait_continuation);
+  
+  // we were either woken or our deadline passed
+  anscheduler_lock(&bucket->lock);
+  thread->futex = NULL;
+  if (!waiter.woken) {
+    _bucket_remove(bucket, &waiter);
+    anscheduler_unlock(&bucket->lock);
+    return ANSCHEDULER_FUTEX_TIMEOUT;
+  }
+  anscheduler_unlock(&bucket->lock);
+  return ANSCHEDULER_FUTEX_WOKEN;
+}
+
+uint64_t anscheduler_futex_wake(uint64_t * addr, uint64_t count) {
+  void * vm = anscheduler_cpu_get_task()->vm;
+  futex_bucket_t * bucket = _bucket_for(vm, (uint64_t)addr);
+  
+  uint64_t woken = 0;
+  anscheduler_lock(&bucket->lock);
+  futex_waiter_t * waiter = bucket->first;
+  while (waiter && woken < count) {
+    futex_waiter_t * next = waiter->next;
+    if (waiter->vm == vm && waiter->addr == (uint64_t)addr) {
+      _bucket_remove(bucket, waiter);
+      waiter->woken = 1;
+      
+      // A timed waiter sits in the run queue until its deadline, so it just
+      // needs to become runnable. An untimed one has to be pushed.
+      thread_t * thread = waiter->thread;
+      thread->nextTimestamp = 0;
+      if (__sync_fetch_and_and(&thread->isPolling, 0)) {
+        anscheduler_loop_push(thread);
+      }
+      woken++;
+    }
+    waiter = next;
+  }
+  anscheduler_unlock(&bucket->lock);
+  return woken;
+}
+
+void anscheduler_futex_cancel(thread_t * thread) {
+  futex_waiter_t * waiter = thread->futex;
+  if (!waiter) return;
+  futex_bucket_t * bucket = _bucket_for(waiter->vm, waiter->addr);
+  anscheduler_lock(&bucket->lock);
+  if (!waiter->woken) _bucket_remove(bucket, waiter);
+  thread->futex = NULL;
+  anscheduler_unlock(&bucket->lock);
+}
+
+static futex_bucket_t * _bucket_for(void * vm, uint64_t addr) {
+  uint64_t key = (addr >> 3) ^ ((uint64_t)vm >> 12);
+  key ^= key >> 6;
+  return &buckets[key % FUTEX_BUCKET_COUNT];
+}
+
+static bool _read_value(task_t * task, uint64_t addr, uint64_t * value) {
+  // the frame can only be unmapped and freed under vmLock, so read it here
+  bool result = true;
+  anscheduler_lock(&task->vmLock);
+  uint16_t flags;
+  uint64_t entry = anscheduler_vm_lookup(task->vm, addr >> 12, &flags);
+  if (!(flags & ANSCHEDULER_PAGE_FLAG_USER)) {
+    result = false;
+  } else if (flags & ANSCHEDULER_PAGE_FLAG_PRESENT) {
+    uint64_t * page = (uint64_t *)(anscheduler_vm_virtual(entry) << 12);
+    (*value) = page[(addr & 0xfff) >> 3];
+  } else if ((flags & ANSCHEDULER_PAGE_FLAG_UNALLOC) && !entry) {
+    (*value) = 0;
+  } else {
+    result = false;
+  }
+  anscheduler_unlock(&task->vmLock);
+  return result;
+}
+
+static void _bucket_append(futex_bucket_t * bucket, futex_waiter_t * waiter) {
+  waiter->next = NULL;
+  waiter->last = bucket->last;
+  if (bucket->last) bucket->last->next = waiter;
+  else bucket->first = waiter;
+  bucket->last = waiter;
+}
+
+static void _bucket_remove(futex_bucket_t * bucket, futex_waiter_t * waiter) {
+  if (waiter->last) waiter->last->next = waiter->next;
+  else bucket->first = waiter->next;
+  if (waiter->next) waiter->next->last = waiter->last;
+  else bucket->last = waiter->last;
+  waiter->next = (waiter->last = NULL);
+}
+
+static void _wait_continuation(futex_waiter_t * waiter) {
+  // get off of the thread's stack before anybody can wake it up
+  anscheduler_cpu_stack_run(waiter, (void (*)(void *))_wait_block);
+}
+
+static void _wait_block(futex_waiter_t * waiter) {
+  thread_t * thread = waiter->thread;
+  futex_bucket_t * bucket = _bucket_for(waiter->vm, waiter->addr);
+  
+  anscheduler_lock(&bucket->lock);
+  if (waiter->woken) {
+    anscheduler_unlock(&bucket->lock);
+    anscheduler_thread_run(thread->task, thread);
+  }
+  if (waiter->deadline) {
+    // the loop runs us once the deadline passes, or as soon as we're woken
+    thread->nextTimestamp = waiter->deadline;
+    anscheduler_unlock(&bucket->lock);
+    anscheduler_loop_push_cur();
+  } else {
+    thread->isPolling = 1;
+    anscheduler_unlock(&bucket->lock);
+  }
+  anscheduler_loop_run();
+}
@@ -0,0 +1,87 @@
+#include <anscheduler/group.h>
+#include <anscheduler/functions.h>
+#include "slab.h"
+
+/**
+ * Starts a new period if the current one has ended.
+ * @critical Must be called with the group's lock held.
+ */
+static void _group_refill(task_group_t * group, uint64_t now);
+
+task_group_t * anscheduler_group_create(uint64_t period, uint64_t quota) {
+  if (!period) return NULL;
+  task_group_t * group = anscheduler_slab_alloc(sizeof(task_group_t));
+  if (!group) return NULL;
+  group->refCount = 1;
+  group->period = period;
+  group->quota = quota;
+  group->periodStart = anscheduler_get_time();
+  return group;
+}
+
+void anscheduler_group_reference(task_group_t * group) {
+  anscheduler_lock(&group->lock);
+  group->refCount++;
+  anscheduler_unlock(&group->lock);
+}
+
+void anscheduler_group_dereference(task_group_t * group) {
+  anscheduler_lock(&group->lock);
+  if (!(--group->refCount)) {
+    anscheduler_unlock(&group->lock);
+    anscheduler_slab_free(group);
+    return;
+  }
+  anscheduler_unlock(&group->lock);
+}
+
+void anscheduler_group_set_quota(task_group_t * group,
+                                 uint64_t period,
+                                 uint64_t quota) {
+  if (!period) return;
+  anscheduler_lock(&group->lock);
+  group->period = period;
+  group->quota = quota;
+  anscheduler_unlock(&group->lock);
+}
+
+void anscheduler_group_join(task_t * task, task_group_t * group) {
+  if (group) anscheduler_group_reference(group);
+  task_group_t * oldGroup = task->group;
+  task->group = group;
+  if (oldGroup) anscheduler_group_dereference(oldGroup);
+}
+
+void anscheduler_group_charge(task_group_t * group, uint64_t time) {
+  anscheduler_lock(&group->lock);
+  _group_refill(group, anscheduler_get_time());
+  group->used += time;
+  anscheduler_unlock(&group->lock);
+}
+
+uint64_t anscheduler_group_throttle(task_group_t * group,
+                                    uint64_t now,
+                                    uint64_t * remaining) {
+  anscheduler_lock(&group->lock);
+  if (!group->quota) {
+    anscheduler_unlock(&group->lock);
+    (*remaining) = ~0L;
+    return 0;
+  }
+  _group_refill(group, now);
+  if (group->used >= group->quota) {
+    uint64_t refill = group->periodStart + group->period;
+    anscheduler_unlock(&group->lock);
+    return refill;
+  }
+  (*remaining) = group->quota - group->used;
+  anscheduler_unlock(&group->lock);
+  return 0;
+}
+
+static void _group_refill(task_group_t * group, uint64_t now) {
+  if (now < group->periodStart + group->period) return;
+  uint64_t periods = (now - group->periodStart) / group->period;
+  group->periodStart += periods * group->period;
+  group->used = 0;
+}
@@ -1,15 +1,37 @@
 #include <anscheduler/loop.h>
 #include <anscheduler/functions.h>
 #include <anscheduler/task.h>
+#include <anscheduler/group.h>
+#include <anscheduler/fpu.h>
+#include "slab.h"
+#include "stackpool.h"
+
+/**
+ * Tracks which task is being charged for the time a CPU spends running a
+ * thread.
+ */
+typedef struct {
+  task_t * task; // referenced
+  uint64_t since;
+} __attribute__((packed)) cpu_usage_t;
 
 static uint64_t loopLock __attribute__((aligned(8))) = 0;
 static uint64_t queueCount __attribute__((aligned(8))) = 0;
 static thread_t * firstThread __attribute__((aligned(8))) = NULL;
 static thread_t * lastThread __attribute__((aligned(8))) = NULL;
+static cpu_usage_t cpuUsage[ANSCHEDULER_MAX_CPUS] __attribute__((aligned(8)));
 
 static thread_t * _next_thread(uint64_t * timeout);
 static thread_t * _shift_thread();
 static void _push_unconditional(thread_t * thread);
+
+/**
+ * Charges the time since the last call to the task (and group) of the thread
+ * which was running on this CPU, and starts timing `next`.
+ * @param next The thread about to run, or NULL if the CPU will go idle.
+ * @critical
+ */
+static void _account_switch(thread_t * next);
 static void _delete_cur_kernel(void * unused);
 static void _switch_to_thread(thread_t * thread);
 static void _run_loop_stub(void * unused);
@@ -85,7 +107,24 @@ void anscheduler_loop_push(thread_t * thread) {
   anscheduler_unlock(&loopLock);
 }
 
+void anscheduler_loop_push_chain(thread_t * first,
+                                 thread_t * last,
+                                 uint64_t count) {
+  anscheduler_lock(&loopLock);
+  first->queueLast = lastThread;
+  last->queueNext = NULL;
+  if (lastThread) {
+    lastThread->queueNext = first;
+  } else {
+    firstThread = first;
+  }
+  lastThread = last;
+  queueCount += count;
+  anscheduler_unlock(&loopLock);
+}
+
 void anscheduler_loop_run() {
+  anscheduler_fpu_leave();
   task_t * task = anscheduler_cpu_get_task();
   anscheduler_cpu_set_task(NULL);
   anscheduler_cpu_set_thread(NULL);
@@ -96,11 +135,16 @@ void anscheduler_loop_run() {
   uint64_t timeout = 0;
   thread_t * thread = _next_thread(&timeout);
   anscheduler_timer_set(timeout);
+  _account_switch(thread);
+  anscheduler_fpu_enter(thread);
   if (thread) {
     anscheduler_cpu_set_task(thread->task);
     anscheduler_cpu_set_thread(thread);
     anscheduler_thread_run(thread->task, thread);
   } else {
+    // nothing to do, so give cached objects back while we wait
+    anscheduler_slab_drain();
+    anscheduler_stackpool_drain();
     anscheduler_cpu_unlock();
     while (1) anscheduler_cpu_halt();
   }
@@ -119,22 +163,23 @@ void anscheduler_loop_save_and_resign() {
   anscheduler_save_return_state(thread, NULL, _save_resign_stub);
 }
 
-void anscheduler_loop_push_kernel(void * arg, void (* fn)(void * arg)) {
-  thread_t * thread = anscheduler_alloc(sizeof(thread_t));
+thread_t * anscheduler_loop_push_kernel(void * arg,
+                                       void (* fn)(void * arg)) {
+  thread_t * thread = anscheduler_slab_alloc(sizeof(thread_t));
   if (!thread) {
     anscheduler_abort("Failed to allocate kernel thread");
-    return;
+    return NULL;
   }
   void * stack = anscheduler_alloc(0x1000);
   if (!stack) {
-    anscheduler_free(thread);
+    anscheduler_slab_free(thread);
     anscheduler_abort("Failed to allocate kernel thread stack.");
-    return;
+    return NULL;
   }
-  anscheduler_zero(thread, sizeof(thread_t));
   thread->stack = (uint64_t)stack;
   anscheduler_set_state(thread, stack + 0x1000, fn, arg);
   anscheduler_loop_push(thread);
+  return thread;
 }
 
 void anscheduler_loop_delete_cur_kernel() {
@@ -153,7 +198,15 @@ static thread_t * _next_thread(uint64_t * timeout) {
   for (i = 0; i < max; i++) {
     thread_t * th = _shift_thread();
     
+    // a throttled group is treated like a sleeping thread until its refill
     uint64_t nextTs = th->nextTimestamp;
+    uint64_t budget = ~0L;
+    if (nextTs <= now && th->task && th->task->group) {
+      uint64_t refill = anscheduler_group_throttle(th->task->group, now,
+                                                   &budget);
+      if (refill) nextTs = refill;
+    }
+    
     if (nextTs > now) {
       _push_unconditional(th);
       if (nextTs - now < *timeout) {
@@ -169,6 +222,8 @@ static thread_t * _next_thread(uint64_t * timeout) {
       }
     }
     anscheduler_unlock(&loopLock);
+    // don't let the thread overrun its group's budget by a whole time slice
+    if (budget < *timeout) (*timeout) = budget;
     return th;
   }
   
@@ -202,13 +257,37 @@ static void _delete_cur_kernel(void * unused) {
   task_t * task = anscheduler_cpu_get_task();
   if (task) anscheduler_abort("_delete_cur_kernel in non-kernel thread!");
   anscheduler_cpu_set_thread(NULL);
+  anscheduler_fpu_release(thread);
   anscheduler_free((void *)thread->stack);
-  anscheduler_free(thread);
+  anscheduler_slab_free(thread);
   anscheduler_loop_run();
 }
 
+static void _account_switch(thread_t * next) {
+  cpu_usage_t * usage = &cpuUsage[anscheduler_cpu_get_index()];
+  uint64_t now = anscheduler_get_time();
+  if (usage->task) {
+    task_t * task = usage->task;
+    __sync_fetch_and_add(&task->cpuTime, now - usage->since);
+    if (task->group) {
+      anscheduler_group_charge(task->group, now - usage->since);
+    }
+    usage->task = NULL;
+    anscheduler_task_dereference(task);
+  }
+  if (next && next->task) {
+    if (anscheduler_task_reference(next->task)) {
+      usage->task = next->task;
+      usage->since = now;
+    }
+  }
+}
+
 static void _switch_to_thread(thread_t * thread) {
+  anscheduler_fpu_leave();
   anscheduler_loop_push_cur();
+  _account_switch(thread);
+  anscheduler_fpu_enter(thread);
   anscheduler_cpu_set_task(thread->task);
   anscheduler_cpu_set_thread(thread);
   anscheduler_thread_run(thread->task, thread);
@@ -1,7 +1,13 @@
 #include <anscheduler/paging.h>
 #include <anscheduler/loop.h>
 #include <anscheduler/task.h>
+#include <anscheduler/thread.h>
 #include <anscheduler/functions.h>
+#include "slab.h"
+#include "frames.h"
+
+// the most page table entries looked up at once while populating a range
+#define PAGING_POPULATE_BATCH 0x10
 
 static thread_t * pagerThread __attribute__((aligned(8))) = 0;
 static uint64_t lock __attribute__((aligned(8))) = 0;
@@ -16,14 +22,55 @@ typedef struct {
 static void _push_page_fault(fault_info_t * _info);
 static bool _push_page_fault_cont(fault_info_t info);
 
+/**
+ * Resolves a write fault on a copy-on-write page.
+ * @return true if the faulting access may be retried.
+ * @critical
+ */
+static bool _copy_on_write(task_t * task, fault_info_t * info);
+
+/**
+ * @return The memory counter which should be charged for a page that is
+ * allocated by a fault in `task`.
+ */
+static uint64_t * _fault_counter(task_t * task, uint64_t page);
+
+/**
+ * Allocates a zeroed frame for a lazily allocated page and charges it to the
+ * task.
+ * @return the physical frame, or 0 if the task reached its memory limit or
+ * memory ran out. `limit` is set in the first case.
+ * @critical Call this with the task's vmLock held.
+ */
+static uint64_t _alloc_frame(task_t * task, uint64_t page, bool * limit);
+
+/**
+ * Allocates the pages below a freshly allocated stack page, as many as the
+ * current thread's `faultPages` allows, without leaving its stack.
+ * @critical Call this with the task's vmLock held.
+ */
+static void _fault_around(task_t * task, uint64_t page);
+
 void anscheduler_page_fault(void * ptr, uint64_t _flags) {
   task_t * task = anscheduler_cpu_get_task();
   if (!task) anscheduler_abort("kernel thread caused page fault!");
+  if (!(_flags & ANSCHEDULER_PAGE_FAULT_USER)) {
+    thread_t * thread = anscheduler_cpu_get_thread();
+    if (anscheduler_thread_in_kernel_guard(thread, ((uint64_t)ptr) >> 12)) {
+      anscheduler_abort("kernel stack overflow");
+    }
+  }
   
   fault_info_t info;
   info.flags = _flags;
   info.ptr = ptr;
   
+  if (_flags & ANSCHEDULER_PAGE_FAULT_WRITE) {
+    if (_copy_on_write(task, &info)) {
+      anscheduler_thread_run(task, anscheduler_cpu_get_thread());
+    }
+  }
+  
   if (_flags & ANSCHEDULER_PAGE_FAULT_PRESENT) {
     // there is nothing we can do here; it's up to the system pager to choose.
     anscheduler_cpu_stack_run(&info, (void (*)(void *))_push_page_fault);
@@ -41,12 +88,10 @@ void anscheduler_page_fault(void * ptr, uint64_t _flags) {
   } else if (flags & ANSCHEDULER_PAGE_FLAG_PRESENT) {
     // it is possible that some other thread allocated this page and we
     // simply didn't have it in this CPUs TLB yet...
+    // Only a write to a read-only page is a real fault here.
     if (flags & ANSCHEDULER_PAGE_FLAG_USER) {
-      if (flags & ANSCHEDULER_PAGE_FLAG_WRITE) {
-        if (!(_flags & ANSCHEDULER_PAGE_FAULT_WRITE)) {
-          shouldFault = false;
-        }
-      } else {
+      if ((flags & ANSCHEDULER_PAGE_FLAG_WRITE)
+          || !(_flags & ANSCHEDULER_PAGE_FAULT_WRITE)) {
         shouldFault = false;
       }
     }
@@ -56,12 +101,23 @@ void anscheduler_page_fault(void * ptr, uint64_t _flags) {
     flags = ANSCHEDULER_PAGE_FLAG_USER
       | ANSCHEDULER_PAGE_FLAG_PRESENT
       | ANSCHEDULER_PAGE_FLAG_WRITE;
-    void * ptr = anscheduler_alloc(0x1000);
-    anscheduler_zero(ptr, 0x1000);
-    uint64_t physAlloc = anscheduler_vm_physical(((uint64_t)ptr) >> 12);
+    bool limit = false;
+    uint64_t physAlloc = _alloc_frame(task, faultPage, &limit);
+    if (!physAlloc) {
+      // let the pager decide; without one, the task dies
+      if (limit) info.flags |= ANSCHEDULER_PAGE_FAULT_LIMIT;
+      anscheduler_unlock(&task->vmLock);
+      anscheduler_cpu_stack_run(&info, (void (*)(void *))_push_page_fault);
+    }
     anscheduler_vm_map(task->vm, faultPage, physAlloc, flags);
+    _fault_around(task, faultPage);
   } else if (shouldFault) {
     anscheduler_unlock(&task->vmLock);
+    thread_t * thread = anscheduler_cpu_get_thread();
+    if (!flags && anscheduler_thread_in_guard(thread, faultPage)) {
+      // a stack overflow is fatal no matter what the pager would say
+      anscheduler_task_exit(ANSCHEDULER_TASK_KILL_REASON_STACK);
+    }
     anscheduler_cpu_stack_run(&info, (void (*)(void *))_push_page_fault);
   }
   
@@ -69,6 +125,59 @@ void anscheduler_page_fault(void * ptr, uint64_t _flags) {
   anscheduler_thread_run(task, anscheduler_cpu_get_thread());
 }
 
+uint64_t anscheduler_page_populate(task_t * task,
+                                   uint64_t page,
+                                   uint64_t count) {
+  uint16_t flags = ANSCHEDULER_PAGE_FLAG_USER
+    | ANSCHEDULER_PAGE_FLAG_PRESENT
+    | ANSCHEDULER_PAGE_FLAG_WRITE;
+  uint64_t entries[PAGING_POPULATE_BATCH];
+  uint16_t oldFlags[PAGING_POPULATE_BATCH];
+  uint64_t populated = 0;
+  
+  // work from the top down, the order in which a stack grows
+  while (count) {
+    uint64_t batch = count;
+    if (batch > PAGING_POPULATE_BATCH) batch = PAGING_POPULATE_BATCH;
+    count -= batch;
+    anscheduler_vm_lookup_range(task->vm, page + count, batch,
+                                entries, oldFlags);
+    uint64_t i;
+    for (i = batch; i > 0; i--) {
+      if (!(oldFlags[i - 1] & ANSCHEDULER_PAGE_FLAG_UNALLOC)
+          || entries[i - 1]) {
+        continue;
+      }
+      uint64_t vpage = page + count + i - 1;
+      bool limit;
+      uint64_t physAlloc = _alloc_frame(task, vpage, &limit);
+      if (!physAlloc) return populated;
+      anscheduler_vm_map(task->vm, vpage, physAlloc, flags);
+      populated++;
+    }
+  }
+  return populated;
+}
+
+void anscheduler_page_unmap(task_t * task, uint64_t vpage) {
+  uint16_t mask = ANSCHEDULER_PAGE_FLAG_PRESENT | ANSCHEDULER_PAGE_FLAG_USER;
+  anscheduler_lock(&task->vmLock);
+  uint16_t flags;
+  uint64_t entry = anscheduler_vm_lookup(task->vm, vpage, &flags);
+  if ((flags & mask) != mask) {
+    anscheduler_unlock(&task->vmLock);
+    return;
+  }
+  anscheduler_vm_unmap(task->vm, vpage);
+  bool wasCharged = anscheduler_frame_owner(entry) == task;
+  bool isLast = anscheduler_frame_release(entry, task);
+  anscheduler_unlock(&task->vmLock);
+  anscheduler_cpu_notify_invlpg(task);
+  
+  if (wasCharged) anscheduler_task_mem_uncharge(task, &task->mem.user, 1);
+  if (isLast) anscheduler_free((void *)(anscheduler_vm_virtual(entry) << 12));
+}
+
 thread_t * anscheduler_pager_get() {
   return pagerThread;
 }
@@ -107,6 +216,92 @@ bool anscheduler_pager_waiting() {
   return firstFault != NULL;
 }
 
+void anscheduler_pager_free(page_fault_t * fault) {
+  anscheduler_slab_free(fault);
+}
+
+static bool _copy_on_write(task_t * task, fault_info_t * info) {
+  uint64_t page = ((uint64_t)info->ptr) >> 12;
+  anscheduler_lock(&task->vmLock);
+  uint16_t flags;
+  uint64_t entry = anscheduler_vm_lookup(task->vm, page, &flags);
+  uint16_t mask = ANSCHEDULER_PAGE_FLAG_PRESENT | ANSCHEDULER_PAGE_FLAG_USER;
+  if ((flags & mask) != mask || !(flags & ANSCHEDULER_PAGE_FLAG_COW)) {
+    anscheduler_unlock(&task->vmLock);
+    // another thread may have broken the COW before we got the lock
+    return (flags & mask) == mask && (flags & ANSCHEDULER_PAGE_FLAG_WRITE);
+  }
+  
+  flags &= ~ANSCHEDULER_PAGE_FLAG_COW;
+  flags |= ANSCHEDULER_PAGE_FLAG_WRITE;
+  if (anscheduler_frame_is_shared(entry)) {
+    // if we were charged for the frame, the charge moves to our copy
+    bool wasCharged = anscheduler_frame_owner(entry) == task;
+    if (!wasCharged
+        && !anscheduler_task_mem_charge(task, &task->mem.user, 1, false)) {
+      anscheduler_unlock(&task->vmLock);
+      info->flags |= ANSCHEDULER_PAGE_FAULT_LIMIT;
+      return false;
+    }
+    uint64_t * copy = anscheduler_alloc(0x1000);
+    uint64_t copyEntry = 0;
+    if (copy) {
+      copyEntry = anscheduler_vm_physical(((uint64_t)copy) >> 12);
+      if (!anscheduler_frame_claim(copyEntry, task)) {
+        anscheduler_free(copy);
+        copy = NULL;
+      }
+    }
+    if (!copy) {
+      if (!wasCharged) {
+        anscheduler_task_mem_uncharge(task, &task->mem.user, 1);
+      }
+      anscheduler_unlock(&task->vmLock);
+      return false;
+    }
+    const void * source = (const void *)(anscheduler_vm_virtual(entry) << 12);
+    anscheduler_copy(copy, source, 0x1000);
+    
+    if (anscheduler_frame_release(entry, task)) {
+      // every other task let go of the frame while we were copying it
+      anscheduler_free((void *)source);
+    }
+    entry = copyEntry;
+  } else if (anscheduler_frame_is_orphaned(entry)) {
+    // the task which was charged for the frame let go of it first
+    if (!anscheduler_task_mem_charge(task, &task->mem.user, 1, false)) {
+      anscheduler_unlock(&task->vmLock);
+      info->flags |= ANSCHEDULER_PAGE_FAULT_LIMIT;
+      return false;
+    }
+    anscheduler_frame_claim(entry, task);
+  }
+  anscheduler_vm_map(task->vm, page, entry, flags);
+  anscheduler_unlock(&task->vmLock);
+  
+  anscheduler_cpu_notify_invlpg(task);
+  return true;
+}
+
+static uint64_t * _fault_counter(task_t * task, uint64_t page) {
+  if (page >= ANSCHEDULER_TASK_USER_STACKS_PAGE
+      && page < ANSCHEDULER_TASK_DATA_PAGE) {
+    return &task->mem.stack;
+  }
+  return &task->mem.user;
+}
+
+static void _fault_around(task_t * task, uint64_t page) {
+  thread_t * thread = anscheduler_cpu_get_thread();
+  uint64_t top = ((uint64_t)anscheduler_thread_user_stack(thread)) >> 12;
+  uint64_t bottom = top - thread->stackPages;
+  if (page < bottom || page >= top || thread->faultPages < 2) return;
+  
+  uint64_t count = thread->faultPages - 1;
+  if (count > page - bottom) count = page - bottom;
+  anscheduler_page_populate(task, page - count, count);
+}
+
 static void _push_page_fault(fault_info_t * _info) {
   bool result = _push_page_fault_cont(*_info);
 
@@ -128,13 +323,12 @@ static bool _push_page_fault_cont(fault_info_t info) {
     anscheduler_abort("a system thread caused a page fault");
   }
   
+  page_fault_t * fault = anscheduler_slab_alloc(sizeof(page_fault_t));
+  if (!fault) return false;
+  
   anscheduler_cpu_set_task(NULL);
   anscheduler_cpu_set_thread(NULL);
   
-  page_fault_t * fault = anscheduler_alloc(sizeof(page_fault_t));
-  if (!fault) {
-    anscheduler_abort("failed to allocate fault object");
-  }
   fault->task = curTask;
   fault->thread = curThread;
   fault->ptr = info.ptr;
@@ -161,3 +355,27 @@ static bool _push_page_fault_cont(fault_info_t info) {
   }
   return true;
 }
+
+static uint64_t _alloc_frame(task_t * task, uint64_t page, bool * limit) {
+  uint64_t * counter = _fault_counter(task, page);
+  (*limit) = false;
+  if (!anscheduler_task_mem_charge(task, counter, 1, false)) {
+    (*limit) = true;
+    return 0;
+  }
+  void * ptr = anscheduler_alloc(0x1000);
+  if (!ptr) {
+    anscheduler_task_mem_uncharge(task, counter, 1);
+    return 0;
+  }
+  anscheduler_zero(ptr, 0x1000);
+  uint64_t phys = anscheduler_vm_physical(((uint64_t)ptr) >> 12);
+  
+  // stack pages are never shared or granted, so only data pages are tracked
+  if (counter == &task->mem.user && !anscheduler_frame_claim(phys, task)) {
+    anscheduler_free(ptr);
+    anscheduler_task_mem_uncharge(task, counter, 1);
+    return 0;
+  }
+  return phys;
+}
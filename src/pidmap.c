@@ -3,28 +3,77 @@
 #include <anscheduler/functions.h>
 #include <anscheduler/task.h>
 
+// PIDs are looked up in a radix tree. Every node is a page: one word which
+// counts the node's non-NULL entries, followed by PIDMAP_FANOUT entries.
+#define PIDMAP_FANOUT 0x1ff
+#define PIDMAP_DEPTH 3
+
+typedef struct pidmap_node_t pidmap_node_t;
+
+struct pidmap_node_t {
+  // while the node is live, the number of non-NULL entries; once the node
+  // has been unlinked, the next node waiting to be freed
+  union {
+    uint64_t count;
+    pidmap_node_t * nextRetired;
+  };
+  void * entries[PIDMAP_FANOUT];
+} __attribute__((packed));
+
+/**
+ * A per-CPU sequence number which is odd while the CPU is in a lock-free
+ * lookup. Each counter gets its own cache line.
+ */
+typedef struct {
+  uint64_t sequence;
+  char reserved[0x38];
+} __attribute__((packed)) pidmap_reader_t;
+
+// writers hold pmLock; readers only use atomic loads
 static uint64_t pmLock __attribute__((aligned(8))) = 0;
-static task_t * pidHashmap[0x100] __attribute__((aligned(8)));
+static pidmap_node_t pidRoot __attribute__((aligned(8)));
+static pidmap_node_t * firstRetired __attribute__((aligned(8))) = NULL;
+static pidmap_reader_t readers[ANSCHEDULER_MAX_CPUS]
+  __attribute__((aligned(0x40)));
 
 static uint64_t ppLock __attribute__((aligned(8))) = 0;
 static anidxset_root_t pidPool __attribute__((aligned(8)));
 static bool ppInitialized __attribute__((aligned(8))) = 0;
 
-static uint8_t _hash_pid(uint64_t pid);
+/**
+ * Computes the entry index at each level of the tree for a PID.
+ * @return false if the PID is too large for the tree.
+ */
+static bool _pid_indices(uint64_t pid, uint64_t * indices);
+
+/**
+ * @critical Must be called with ppLock held.
+ */
+static void _init_pool();
+
+/**
+ * @critical Must be called with pmLock held.
+ */
+static void _set_locked(task_t * task);
 
 uint64_t anscheduler_pidmap_alloc_pid() {
   anscheduler_lock(&ppLock);
-  if (!ppInitialized) {
-    if (!anscheduler_idxset_init(&pidPool)) {
-      anscheduler_abort("failed to initialize PID pool");
-    }
-    ppInitialized = true;
-  }
+  _init_pool();
   uint64_t result = anidxset_get(&pidPool);
   anscheduler_unlock(&ppLock);
   return result;
 }
 
+void anscheduler_pidmap_alloc_pids(task_t ** tasks, uint64_t count) {
+  anscheduler_lock(&ppLock);
+  _init_pool();
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    tasks[i]->pid = anidxset_get(&pidPool);
+  }
+  anscheduler_unlock(&ppLock);
+}
+
 void anscheduler_pidmap_free_pid(uint64_t pid) {
   anscheduler_lock(&ppLock);
   if (!ppInitialized) {
@@ -34,53 +83,182 @@ void anscheduler_pidmap_free_pid(uint64_t pid) {
   anscheduler_unlock(&ppLock);
 }
 
+void anscheduler_pidmap_free_pids(task_t ** tasks, uint64_t count) {
+  anscheduler_lock(&ppLock);
+  if (!ppInitialized) {
+    anscheduler_abort("cannot free PID when not initialized");
+  }
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    anidxset_put(&pidPool, tasks[i]->pid);
+  }
+  anscheduler_unlock(&ppLock);
+}
+
 void anscheduler_pidmap_set(task_t * task) {
   anscheduler_lock(&pmLock);
-  uint8_t hash = _hash_pid(task->pid);
-  if (!pidHashmap[hash]) {
-    pidHashmap[hash] = task;
-    task->next = (task->last = NULL);
-  } else {
-    task->next = pidHashmap[hash];
-    task->last = NULL;
-    pidHashmap[hash]->last = task;
-    pidHashmap[hash] = task;
+  _set_locked(task);
+  anscheduler_unlock(&pmLock);
+}
+
+void anscheduler_pidmap_set_batch(task_t ** tasks, uint64_t count) {
+  anscheduler_lock(&pmLock);
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    _set_locked(tasks[i]);
   }
   anscheduler_unlock(&pmLock);
 }
 
 void anscheduler_pidmap_unset(task_t * task) {
+  uint64_t indices[PIDMAP_DEPTH];
+  if (!_pid_indices(task->pid, indices)) return;
+  
   anscheduler_lock(&pmLock);
-  if (!task->last) {
-    uint8_t hash = _hash_pid(task->pid);
-    pidHashmap[hash] = task->next;
-  } else {
-    task->last->next = task->next;
+  pidmap_node_t * path[PIDMAP_DEPTH];
+  pidmap_node_t * node = &pidRoot;
+  int i;
+  for (i = 0; i < PIDMAP_DEPTH; i++) {
+    if (!node) {
+      anscheduler_unlock(&pmLock);
+      return;
+    }
+    path[i] = node;
+    if (i < PIDMAP_DEPTH - 1) node = node->entries[indices[i]];
   }
-  if (task->next) {
-    task->next->last = task->last;
+  if (path[PIDMAP_DEPTH - 1]->entries[indices[PIDMAP_DEPTH - 1]] != task) {
+    anscheduler_unlock(&pmLock);
+    return;
+  }
+  
+  // clear the entry, then unlink and retire every node which became empty
+  for (i = PIDMAP_DEPTH - 1; i >= 0; i--) {
+    node = path[i];
+    __atomic_store_n(&node->entries[indices[i]], NULL, __ATOMIC_RELEASE);
+    if (--node->count || !i) break;
+    node->nextRetired = firstRetired;
+    firstRetired = node;
   }
-  task->next = NULL;
-  task->last = NULL;
   anscheduler_unlock(&pmLock);
 }
 
 task_t * anscheduler_pidmap_get(uint64_t pid) {
-  anscheduler_lock(&pmLock);
-  uint8_t hash = _hash_pid(pid);
-  task_t * task = pidHashmap[hash];
-  while (task) {
-    if (task->pid == pid) {
-      bool result = anscheduler_task_reference(task);
-      anscheduler_unlock(&pmLock);
-      return result ? task : NULL;
+  uint64_t indices[PIDMAP_DEPTH];
+  if (!_pid_indices(pid, indices)) return NULL;
+  
+  pidmap_reader_t * reader = &readers[anscheduler_cpu_get_index()];
+  __atomic_fetch_add(&reader->sequence, 1, __ATOMIC_SEQ_CST);
+  
+  void * entry = &pidRoot;
+  int i;
+  for (i = 0; i < PIDMAP_DEPTH && entry; i++) {
+    pidmap_node_t * node = entry;
+    entry = __atomic_load_n(&node->entries[indices[i]], __ATOMIC_ACQUIRE);
+  }
+  
+  // the task cannot be freed until we leave the read section, and once it
+  // has been killed, this reference will fail
+  task_t * task = entry;
+  if (task && !anscheduler_task_reference(task)) task = NULL;
+  
+  __atomic_fetch_add(&reader->sequence, 1, __ATOMIC_RELEASE);
+  return task;
+}
+
+uint64_t anscheduler_pidmap_walk(uint64_t firstPid,
+                                 uint64_t max,
+                                 void (* fn)(void * arg, task_t * task),
+                                 void * arg) {
+  pidmap_reader_t * reader = &readers[anscheduler_cpu_get_index()];
+  __atomic_fetch_add(&reader->sequence, 1, __ATOMIC_SEQ_CST);
+  
+  uint64_t count = 0, pid = firstPid;
+  uint64_t indices[PIDMAP_DEPTH];
+  while (count < max && _pid_indices(pid, indices)) {
+    void * entry = &pidRoot;
+    int i;
+    for (i = 0; i < PIDMAP_DEPTH; i++) {
+      pidmap_node_t * node = entry;
+      entry = __atomic_load_n(&node->entries[indices[i]], __ATOMIC_ACQUIRE);
+      if (!entry) break;
+    }
+    
+    if (entry) {
+      fn(arg, (task_t *)entry);
+      count++;
+      pid++;
+    } else {
+      // skip every PID under the missing entry
+      uint64_t span = 1;
+      for (i++; i < PIDMAP_DEPTH; i++) span *= PIDMAP_FANOUT;
+      pid = ((pid / span) + 1) * span;
     }
-    task = task->next;
   }
+  
+  __atomic_fetch_add(&reader->sequence, 1, __ATOMIC_RELEASE);
+  return count;
+}
+
+void anscheduler_pidmap_synchronize() {
+  anscheduler_lock(&pmLock);
+  pidmap_node_t * retired = firstRetired;
+  firstRetired = NULL;
   anscheduler_unlock(&pmLock);
-  return NULL;
+  
+  // wait for every lookup which may have seen an old link to finish
+  __sync_synchronize();
+  uint64_t i, me = anscheduler_cpu_get_index();
+  for (i = 0; i < ANSCHEDULER_MAX_CPUS; i++) {
+    if (i == me) continue;
+    uint64_t seq = __atomic_load_n(&readers[i].sequence, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) continue;
+    while (__atomic_load_n(&readers[i].sequence, __ATOMIC_ACQUIRE) == seq);
+  }
+  
+  while (retired) {
+    pidmap_node_t * next = retired->nextRetired;
+    anscheduler_free(retired);
+    retired = next;
+  }
+}
+
+static bool _pid_indices(uint64_t pid, uint64_t * indices) {
+  int i;
+  for (i = PIDMAP_DEPTH - 1; i >= 0; i--) {
+    indices[i] = pid % PIDMAP_FANOUT;
+    pid /= PIDMAP_FANOUT;
+  }
+  return pid == 0;
 }
 
-static uint8_t _hash_pid(uint64_t pid) {
-  return (uint8_t)(pid & 0xff);
+static void _init_pool() {
+  if (ppInitialized) return;
+  if (!anscheduler_idxset_init(&pidPool)) {
+    anscheduler_abort("failed to initialize PID pool");
+  }
+  ppInitialized = true;
+}
+
+static void _set_locked(task_t * task) {
+  uint64_t indices[PIDMAP_DEPTH];
+  if (!_pid_indices(task->pid, indices)) {
+    anscheduler_abort("PID is too large for the PID map");
+  }
+  
+  pidmap_node_t * node = &pidRoot;
+  int i;
+  for (i = 0; i < PIDMAP_DEPTH - 1; i++) {
+    pidmap_node_t * next = node->entries[indices[i]];
+    if (!next) {
+      next = anscheduler_alloc(0x1000);
+      if (!next) anscheduler_abort("failed to allocate PID map node");
+      anscheduler_zero(next, 0x1000);
+      // readers must see the zeroed node before they see the link to it
+      __atomic_store_n(&node->entries[indices[i]], next, __ATOMIC_RELEASE);
+      node->count++;
+    }
+    node = next;
+  }
+  __atomic_store_n(&node->entries[indices[i]], task, __ATOMIC_RELEASE);
+  node->count++;
 }
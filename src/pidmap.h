@@ -13,20 +13,63 @@ uint64_t anscheduler_pidmap_alloc_pid();
  */
 void anscheduler_pidmap_free_pid(uint64_t pid);
 
+/**
+ * Gives each task a new PID, taking the PID pool's lock only once.
+ * @critical O(count)
+ */
+void anscheduler_pidmap_alloc_pids(task_t ** tasks, uint64_t count);
+
+/**
+ * Returns the PIDs of tasks which were never added to the map, taking the PID
+ * pool's lock only once.
+ * @critical O(count)
+ */
+void anscheduler_pidmap_free_pids(task_t ** tasks, uint64_t count);
+
 /**
  * @critical O(1)
  */
 void anscheduler_pidmap_set(task_t * task);
 
 /**
+ * Adds a batch of tasks to the PID map, taking the map's lock only once.
+ * @critical O(count)
+ */
+void anscheduler_pidmap_set_batch(task_t ** tasks, uint64_t count);
+
+/**
+ * Removes a task from the PID map. Lookups which are already in progress may
+ * still see the task, so call anscheduler_pidmap_synchronize() before freeing
+ * it.
  * @critical O(1)
  */
 void anscheduler_pidmap_unset(task_t * task);
 
 /**
- * Returns a (referenced) task which was found for a certain PID.
- * @critical Best is O(1), worst is O(n)
+ * Returns a (referenced) task which was found for a certain PID. This takes
+ * no locks, so lookups on different CPUs never contend.
+ * @critical O(1)
  */
 task_t * anscheduler_pidmap_get(uint64_t pid);
 
+/**
+ * Calls `fn` for up to `max` tasks in the map whose PIDs are at least
+ * `firstPid`, in ascending PID order. This runs as a single lock-free lookup,
+ * so `fn` may read the task's fields but must not block or take references.
+ * @return The number of tasks passed to `fn`.
+ * @critical O(max), plus time for skipping over unused PIDs
+ */
+uint64_t anscheduler_pidmap_walk(uint64_t firstPid,
+                                 uint64_t max,
+                                 void (* fn)(void * arg, task_t * task),
+                                 void * arg);
+
+/**
+ * Waits until no CPU is in the middle of a lookup which started before this
+ * call, and then frees map nodes which were removed by earlier calls to
+ * anscheduler_pidmap_unset().
+ * @critical Lookups are short, so this will not wait long.
+ */
+void anscheduler_pidmap_synchronize();
+
 #endif
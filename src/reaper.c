@@ -0,0 +1,259 @@
+#include "reaper.h"
+#include "pidmap.h"
+#include <anscheduler/functions.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/socket.h>
+
+// the most tasks torn down in one critical section
+#define REAPER_BATCH_SIZE 0x40
+
+// applies to the queues and to reaperThread
+static uint64_t reaperLock __attribute__((aligned(8))) = 0;
+static task_t * firstDead __attribute__((aligned(8))) = NULL;
+static task_t * lastDead __attribute__((aligned(8))) = NULL;
+static thread_t * reaperThread __attribute__((aligned(8))) = NULL;
+
+// tasks whose sockets have been closed but are still held by their peers
+static task_t * firstClosing __attribute__((aligned(8))) = NULL;
+
+/**
+ * @noncritical Run from a kernel thread
+ */
+static void _reaper_main(void * unused);
+
+/**
+ * Takes up to REAPER_BATCH_SIZE tasks off the queue, linked through `next`.
+ * @return NULL if the queue is empty.
+ * @critical
+ */
+static task_t * _shift_batch();
+
+/**
+ * Closes every socket a task still has open.
+ * @critical
+ */
+static void _close_sockets(task_t * task);
+
+/**
+ * Adds a batch of tasks whose sockets have been closed to the closing list.
+ * @critical
+ */
+static void _push_closing(task_t * batch);
+
+/**
+ * Takes every task which has released all of its sockets off the closing
+ * list, linked through `next`.
+ * @critical
+ */
+static task_t * _shift_closed();
+
+/**
+ * @return true if a task is queued or a closing task has released all of its
+ * sockets.
+ * @critical Must be called with reaperLock held.
+ */
+static bool _has_work();
+
+/**
+ * Blocks the reaper until it has work to do. If there are neither queued nor
+ * closing tasks, the reaper is marked as stopped instead.
+ * @return false if the reaper was stopped.
+ * @critical
+ */
+static bool _wait_for_work();
+
+/**
+ * @critical
+ */
+static void _wait_continuation(void * unused);
+
+/**
+ * Puts the reaper to sleep unless it has work to do, in which case it is run
+ * again right away.
+ * @critical Run from the CPU dedicated stack.
+ */
+static void _wait_block(thread_t * thread);
+
+void anscheduler_reaper_push(task_t * task) {
+  anscheduler_lock(&reaperLock);
+  task->next = NULL;
+  if (lastDead) lastDead->next = task;
+  else firstDead = task;
+  lastDead = task;
+
+  if (!reaperThread) {
+    reaperThread = anscheduler_loop_push_kernel(NULL, _reaper_main);
+  } else if (__sync_fetch_and_and(&reaperThread->isPolling, 0)) {
+    // the reaper is waiting on some other task's sockets
+    thread_t * thread = reaperThread;
+    anscheduler_unlock(&reaperLock);
+    anscheduler_loop_push(thread);
+    return;
+  }
+  anscheduler_unlock(&reaperLock);
+}
+
+void anscheduler_reaper_notify() {
+  anscheduler_lock(&reaperLock);
+  thread_t * thread = reaperThread;
+  if (thread && __sync_fetch_and_and(&thread->isPolling, 0)) {
+    anscheduler_unlock(&reaperLock);
+    anscheduler_loop_push(thread);
+    return;
+  }
+  anscheduler_unlock(&reaperLock);
+}
+
+static void _reaper_main(void * unused) {
+  anscheduler_cpu_lock();
+  while (1) {
+    // one grace period covers the whole batch
+    task_t * batch = _shift_batch(), * task;
+    if (batch) {
+      for (task = batch; task; task = task->next) {
+        anscheduler_pidmap_unset(task);
+      }
+      anscheduler_pidmap_synchronize();
+      
+      for (task = batch; task; task = task->next) {
+        _close_sockets(task);
+      }
+      _push_closing(batch);
+    }
+    
+    // A peer may hold on to a task's socket for as long as it likes, so only
+    // the tasks whose sockets are all gone are freed; the rest wait without
+    // holding up later batches.
+    task_t * closed = _shift_closed();
+    while (closed) {
+      task = closed;
+      closed = task->next;
+      anscheduler_cpu_unlock();
+      anscheduler_task_free(task);
+      anscheduler_cpu_lock();
+    }
+    
+    if (!batch && !_wait_for_work()) break;
+  }
+  anscheduler_loop_delete_cur_kernel();
+}
+
+static task_t * _shift_batch() {
+  anscheduler_lock(&reaperLock);
+  task_t * batch = firstDead;
+  if (!batch) {
+    anscheduler_unlock(&reaperLock);
+    return NULL;
+  }
+
+  task_t * last = batch;
+  int i;
+  for (i = 1; i < REAPER_BATCH_SIZE && last->next; i++) {
+    last = last->next;
+  }
+  firstDead = last->next;
+  if (!firstDead) lastDead = NULL;
+  last->next = NULL;
+  anscheduler_unlock(&reaperLock);
+  return batch;
+}
+
+static void _close_sockets(task_t * task) {
+  int i;
+  for (i = 0; i < 0x10; i++) {
+    while (1) {
+      // find a socket in this bucket which hasn't been closed yet
+      anscheduler_lock(&task->socketsLock);
+      socket_desc_t * desc = task->sockets[i];
+      while (desc && !anscheduler_socket_reference(desc)) {
+        desc = desc->next;
+      }
+      anscheduler_unlock(&task->socketsLock);
+      if (!desc) break;
+
+      // once every reference is gone, the descriptor deletes itself and
+      // notifies us if it was the last one
+      anscheduler_socket_close(desc, 1 | (task->killReason << 1));
+      anscheduler_socket_dereference(desc);
+    }
+  }
+}
+
+static void _push_closing(task_t * batch) {
+  task_t * last = batch;
+  while (last->next) last = last->next;
+  anscheduler_lock(&reaperLock);
+  last->next = firstClosing;
+  firstClosing = batch;
+  anscheduler_unlock(&reaperLock);
+}
+
+static task_t * _shift_closed() {
+  task_t * closed = NULL;
+  anscheduler_lock(&reaperLock);
+  task_t ** link = &firstClosing;
+  while (*link) {
+    task_t * task = *link;
+    anscheduler_lock(&task->socketsLock);
+    uint64_t count = task->socketCount;
+    anscheduler_unlock(&task->socketsLock);
+    if (count) {
+      link = &task->next;
+      continue;
+    }
+    (*link) = task->next;
+    task->next = closed;
+    closed = task;
+  }
+  anscheduler_unlock(&reaperLock);
+  return closed;
+}
+
+static bool _has_work() {
+  if (firstDead) return true;
+  task_t * task;
+  for (task = firstClosing; task; task = task->next) {
+    anscheduler_lock(&task->socketsLock);
+    uint64_t count = task->socketCount;
+    anscheduler_unlock(&task->socketsLock);
+    if (!count) return true;
+  }
+  return false;
+}
+
+static bool _wait_for_work() {
+  anscheduler_lock(&reaperLock);
+  if (!firstDead && !firstClosing) {
+    // anybody who queues a task from now on will start a new reaper
+    reaperThread = NULL;
+    anscheduler_unlock(&reaperLock);
+    return false;
+  }
+  bool hasWork = _has_work();
+  anscheduler_unlock(&reaperLock);
+  
+  if (!hasWork) {
+    anscheduler_save_return_state(anscheduler_cpu_get_thread(), NULL,
+                                  _wait_continuation);
+  }
+  return true;
+}
+
+static void _wait_continuation(void * unused) {
+  // get off of the reaper's stack before anybody can wake it up
+  anscheduler_cpu_stack_run(anscheduler_cpu_get_thread(),
+                            (void (*)(void *))_wait_block);
+}
+
+static void _wait_block(thread_t * thread) {
+  // The check and the isPolling flag are both covered by reaperLock, so a
+  // notification can't slip in between them.
+  anscheduler_lock(&reaperLock);
+  if (_has_work()) {
+    anscheduler_unlock(&reaperLock);
+    anscheduler_thread_run(NULL, thread);
+  }
+  thread->isPolling = 1;
+  anscheduler_unlock(&reaperLock);
+  anscheduler_loop_run();
+}
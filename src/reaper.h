@@ -0,0 +1,33 @@
+#ifndef __ANSCHEDULER_REAPER_H__
+#define __ANSCHEDULER_REAPER_H__
+
+#include <anscheduler/types.h>
+
+/**
+ * Dead tasks are torn down by a single kernel thread, the reaper, which runs
+ * only while there are tasks to reap. It handles tasks in batches so that a
+ * mass kill costs one kernel thread rather than one per task.
+ */
+
+/**
+ * Queues a killed, unreferenced task to be torn down.
+ * @critical
+ */
+void anscheduler_reaper_push(task_t * task);
+
+/**
+ * Wakes the reaper if it is waiting for sockets to close. Call this when a
+ * killed task releases its last socket.
+ * @critical
+ */
+void anscheduler_reaper_notify();
+
+/**
+ * Frees everything a task owns. The reaper calls this once the task has been
+ * removed from the PID map and all of its sockets are gone. This is
+ * implemented in task.c.
+ * @noncritical
+ */
+void anscheduler_task_free(task_t * task);
+
+#endif
@@ -0,0 +1,177 @@
+#include "slab.h"
+#include <anscheduler/functions.h>
+
+#define SLAB_MAGAZINE_SIZE 0x10
+#define SLAB_CLASS_COUNT 5
+
+typedef struct slab_cache_t slab_cache_t;
+typedef struct slab_page_t slab_page_t;
+
+/**
+ * Every slab page begins with this header; objects are carved out of the rest
+ * of the page. Because of this, a slab object is never page-aligned.
+ */
+struct slab_page_t {
+  slab_cache_t * cache;
+  slab_page_t * next, * last; // in the cache's partial list
+  void * firstFree;
+  uint64_t used; // objects handed out, including those in magazines
+} __attribute__((packed));
+
+/**
+ * A small per-CPU stack of free objects. It is only ever touched by its own
+ * CPU from a critical section, so it needs no lock.
+ */
+typedef struct {
+  uint64_t count;
+  void * objects[SLAB_MAGAZINE_SIZE];
+} __attribute__((packed)) slab_magazine_t;
+
+struct slab_cache_t {
+  uint64_t lock; // applies to the partial list and every page's free list
+  uint64_t objectSize;
+  slab_page_t * firstPartial;
+  slab_magazine_t magazines[ANSCHEDULER_MAX_CPUS];
+} __attribute__((packed));
+
+static slab_cache_t caches[SLAB_CLASS_COUNT] __attribute__((aligned(8))) = {
+  {0, 0x20}, {0, 0x40}, {0, 0x80}, {0, 0x100}, {0, 0x200}
+};
+
+static slab_cache_t * _cache_for_size(uint64_t size);
+static slab_magazine_t * _cpu_magazine(slab_cache_t * cache);
+static void _magazine_refill(slab_cache_t * cache, slab_magazine_t * mag);
+static void _magazine_flush(slab_cache_t * cache,
+                            slab_magazine_t * mag,
+                            uint64_t count);
+static slab_page_t * _page_alloc(slab_cache_t * cache);
+static void _page_link(slab_cache_t * cache, slab_page_t * page);
+static void _page_unlink(slab_cache_t * cache, slab_page_t * page);
+
+void * anscheduler_slab_alloc(uint64_t size) {
+  slab_cache_t * cache = _cache_for_size(size);
+  if (!cache) {
+    void * buffer = anscheduler_alloc(size);
+    if (buffer) anscheduler_zero(buffer, (int)size);
+    return buffer;
+  }
+
+  slab_magazine_t * mag = _cpu_magazine(cache);
+  if (!mag->count) {
+    _magazine_refill(cache, mag);
+    if (!mag->count) return NULL;
+  }
+
+  // objects are zeroed when they are freed, so this one is ready to go
+  return mag->objects[--mag->count];
+}
+
+void anscheduler_slab_free(void * object) {
+  if (!(((uint64_t)object) & 0xfff)) {
+    anscheduler_free(object);
+    return;
+  }
+
+  slab_page_t * page = (slab_page_t *)(((uint64_t)object) & ~0xfffL);
+  slab_cache_t * cache = page->cache;
+  anscheduler_zero(object, (int)cache->objectSize);
+
+  slab_magazine_t * mag = _cpu_magazine(cache);
+  if (mag->count == SLAB_MAGAZINE_SIZE) {
+    _magazine_flush(cache, mag, SLAB_MAGAZINE_SIZE / 2);
+  }
+  mag->objects[mag->count++] = object;
+}
+
+void anscheduler_slab_drain() {
+  int i;
+  for (i = 0; i < SLAB_CLASS_COUNT; i++) {
+    slab_magazine_t * mag = _cpu_magazine(&caches[i]);
+    if (mag->count) _magazine_flush(&caches[i], mag, mag->count);
+  }
+}
+
+static slab_cache_t * _cache_for_size(uint64_t size) {
+  int i;
+  for (i = 0; i < SLAB_CLASS_COUNT; i++) {
+    if (caches[i].objectSize >= size) return &caches[i];
+  }
+  return NULL;
+}
+
+static slab_magazine_t * _cpu_magazine(slab_cache_t * cache) {
+  return &cache->magazines[anscheduler_cpu_get_index()];
+}
+
+static void _magazine_refill(slab_cache_t * cache, slab_magazine_t * mag) {
+  anscheduler_lock(&cache->lock);
+  while (mag->count < SLAB_MAGAZINE_SIZE / 2) {
+    slab_page_t * page = cache->firstPartial;
+    if (!page) {
+      if (!(page = _page_alloc(cache))) break;
+    }
+
+    void ** object = (void **)page->firstFree;
+    page->firstFree = *object;
+    page->used++;
+    if (!page->firstFree) _page_unlink(cache, page);
+
+    (*object) = NULL; // the link was the only non-zero word
+    mag->objects[mag->count++] = object;
+  }
+  anscheduler_unlock(&cache->lock);
+}
+
+static void _magazine_flush(slab_cache_t * cache,
+                            slab_magazine_t * mag,
+                            uint64_t count) {
+  anscheduler_lock(&cache->lock);
+  while (count--) {
+    void ** object = (void **)mag->objects[--mag->count];
+    slab_page_t * page = (slab_page_t *)(((uint64_t)object) & ~0xfffL);
+
+    if (!page->firstFree) _page_link(cache, page);
+    (*object) = page->firstFree;
+    page->firstFree = object;
+
+    if (!(--page->used)) {
+      _page_unlink(cache, page);
+      anscheduler_free(page);
+    }
+  }
+  anscheduler_unlock(&cache->lock);
+}
+
+static slab_page_t * _page_alloc(slab_cache_t * cache) {
+  slab_page_t * page = anscheduler_alloc(0x1000);
+  if (!page) return NULL;
+  anscheduler_zero(page, 0x1000);
+  page->cache = cache;
+
+  // the first object is aligned to the object size
+  uint64_t size = cache->objectSize;
+  uint64_t offset = (sizeof(slab_page_t) + size - 1) & ~(size - 1);
+  void ** link = &page->firstFree;
+  for (; offset + size <= 0x1000; offset += size) {
+    void ** object = (void **)(((uint64_t)page) + offset);
+    (*link) = object;
+    link = object;
+  }
+
+  _page_link(cache, page);
+  return page;
+}
+
+static void _page_link(slab_cache_t * cache, slab_page_t * page) {
+  page->last = NULL;
+  page->next = cache->firstPartial;
+  if (page->next) page->next->last = page;
+  cache->firstPartial = page;
+}
+
+static void _page_unlink(slab_cache_t * cache, slab_page_t * page) {
+  if (page->last) page->last->next = page->next;
+  else cache->firstPartial = page->next;
+  if (page->next) page->next->last = page->last;
+  page->next = (page->last = NULL);
+}
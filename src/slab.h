@@ -0,0 +1,29 @@
+#ifndef __ANSCHEDULER_SLAB_H__
+#define __ANSCHEDULER_SLAB_H__
+
+#include <anscheduler/types.h>
+
+/**
+ * Allocates a zeroed object of at least `size` bytes. Small objects are
+ * carved out of shared pages; anything larger than the biggest size class is
+ * given a whole page from anscheduler_alloc().
+ * @return The new object, or NULL on failure.
+ * @critical O(1) while this CPU's magazine has objects
+ */
+void * anscheduler_slab_alloc(uint64_t size);
+
+/**
+ * Frees an object returned by anscheduler_slab_alloc(). Page-aligned
+ * pointers are never slab objects, so they are passed to anscheduler_free().
+ * @critical O(1) while this CPU's magazine has room
+ */
+void anscheduler_slab_free(void * object);
+
+/**
+ * Returns every object cached in this CPU's magazines to its page, freeing
+ * pages which become empty. Call this when the CPU is about to go idle.
+ * @critical
+ */
+void anscheduler_slab_drain();
+
+#endif
@@ -2,13 +2,36 @@
 #include <anscheduler/functions.h>
 #include <anscheduler/loop.h>
 #include <anscheduler/task.h>
+#include <anscheduler/thread.h>
+#include "frames.h"
 #include "socketlist.h"
+#include "slab.h"
+
+// every direction carries at most one CONNECT and one CLOSE besides its data
+#define SOCKET_CONTROL_SLOTS 2
+
+#if ANSCHEDULER_SOCKET_MSG_MAX + SOCKET_CONTROL_SLOTS \
+  > ANSCHEDULER_SOCKET_RING_SIZE
+#error "socket rings are too small for ANSCHEDULER_SOCKET_MSG_MAX"
+#endif
 
 typedef struct {
   socket_msg_t * message;
   socket_desc_t * descriptor; // referenced
 } msginfo_t;
 
+/**
+ * Lives on a blocked sender's kernel stack for as long as it waits.
+ */
+struct socket_writer_t {
+  socket_writer_t * next;
+  thread_t * thread;
+  socket_ring_t * ring;
+  socket_desc_t * socket; // referenced until the sender is asleep
+  socket_desc_t * otherEnd; // likewise
+  uint64_t woken;
+} __attribute__((packed));
+
 /**
  * @critical
  */
@@ -22,13 +45,18 @@ static socket_desc_t * _create_descriptor(socket_t * socket,
 static void _socket_hangup(socket_desc_t * socket);
 
 /**
- * Send a socket message to the other end of a socket.
- * @param dest A referenced socket. When a socket is referenced, you °know*
+ * Send socket messages to the other end of a socket, all under one
+ * acquisition of its queue lock.
+ * @param dest A referenced socket. When a socket is referenced, you *know*
  * that the destination task will not be deallocated, although it may be
  * killed.
+ * @return The number of messages queued, which are always the first ones in
+ * `msgs`. Queuing stops at the first message which doesn't fit.
  * @critical
  */
-static bool _push_message(socket_desc_t * dest, socket_msg_t * msg);
+static uint64_t _push_messages(socket_desc_t * dest,
+                               socket_msg_t ** msgs,
+                               uint64_t count);
 
 /**
  * Wakes up the task for a socket descriptor. If the task has been killed,
@@ -48,16 +76,88 @@ static void _async_msg(msginfo_t * info);
  */
 static void _socket_free(socket_t * socket);
 
+/**
+ * Frees a socket whose rings are empty, along with their slots.
+ * @critical
+ */
+static void _socket_discard(socket_t * socket);
+
+/**
+ * Uncharges the messages which are still queued for a descriptor from its
+ * task. Nothing can be pushed to a closed, unreferenced descriptor, so this
+ * is called once its task lets go of it.
+ * @critical
+ */
+static void _uncharge_queue(socket_desc_t * desc);
+
 /**
  * @critical
  */
 static void _switch_continuation(void * th);
 
+/**
+ * @return The ring of messages which are sent to `desc`.
+ * @critical
+ */
+static socket_ring_t * _ring_for(socket_desc_t * desc);
+
+/**
+ * Gives a ring `size` slots, moving any queued messages over to them.
+ * @return false if the slots could not be allocated.
+ * @critical Call this with both of the ring's locks held, or before anybody
+ * else can see the ring.
+ */
+static bool _ring_resize(socket_ring_t * ring, uint64_t size);
+
+/**
+ * Wakes every sender waiting for a ring to drain.
+ * @critical
+ */
+static void _wake_writers(socket_ring_t * ring);
+
+/**
+ * Run right after the waiting sender's state has been saved.
+ * @critical
+ */
+static void _writer_continuation(socket_writer_t * writer);
+
+/**
+ * Puts the sender to sleep unless it has already been woken, then lets go of
+ * its references to the socket.
+ * @critical Run from the CPU dedicated stack.
+ */
+static void _writer_block(socket_writer_t * writer);
+
+/**
+ * Allocates a message with room for `len` bytes of body. Small messages come
+ * from the slab, so they cost no more than a magazine pop on this CPU; only
+ * messages with large bodies take a whole page.
+ * @critical
+ */
+static socket_msg_t * _msg_alloc(uint64_t len);
+
+/**
+ * @return true if `page` may be granted away or have a grant mapped at it.
+ * @critical
+ */
+static bool _is_data_page(uint64_t page);
+
 socket_desc_t * anscheduler_socket_new() {
-  socket_t * socket = anscheduler_alloc(sizeof(socket_t));
+  socket_t * socket = anscheduler_slab_alloc(sizeof(socket_t));
   if (!socket) return NULL;
-  anscheduler_zero(socket, sizeof(socket_t));
-  return _create_descriptor(socket, anscheduler_cpu_get_task(), true);
+  socket->forConnector.depth = ANSCHEDULER_SOCKET_MSG_MAX;
+  socket->forReceiver.depth = ANSCHEDULER_SOCKET_MSG_MAX;
+  if (!_ring_resize(&socket->forConnector, ANSCHEDULER_SOCKET_RING_SIZE)
+      || !_ring_resize(&socket->forReceiver, ANSCHEDULER_SOCKET_RING_SIZE)) {
+    _socket_discard(socket);
+    return NULL;
+  }
+  
+  socket_desc_t * desc = _create_descriptor(socket,
+                                            anscheduler_cpu_get_task(),
+                                            true);
+  if (!desc) _socket_discard(socket);
+  return desc;
 }
 
 socket_desc_t * anscheduler_socket_for_descriptor(uint64_t desc) {
@@ -90,9 +190,14 @@ void anscheduler_socket_dereference(socket_desc_t * socket) {
   if (!(--socket->refCount) && socket->isClosed) {
     anscheduler_unlock(&socket->closeLock);
     
+    // nobody can send in either direction anymore
+    _wake_writers(&socket->socket->forConnector);
+    _wake_writers(&socket->socket->forReceiver);
+    
     // we know the task is still alive because the socket is still in the
     // task's socket list as of now, and the task cannot die until
     // every socket it owns has died.
+    _uncharge_queue(socket);
     anscheduler_task_not_pending(socket->task, socket);
     anscheduler_descriptor_delete(socket->task, socket);
     
@@ -105,6 +210,12 @@ void anscheduler_socket_dereference(socket_desc_t * socket) {
 
 bool anscheduler_socket_msg(socket_desc_t * socket,
                             socket_msg_t * msg) {
+  return anscheduler_socket_msg_batch(socket, &msg, 1) == 1;
+}
+
+uint64_t anscheduler_socket_msg_batch(socket_desc_t * socket,
+                                      socket_msg_t ** msgs,
+                                      uint64_t count) {
   // gain a reference to the other end of the socket
   socket_desc_t * otherEnd = NULL;
   socket_t * sock = socket->socket;
@@ -119,14 +230,66 @@ bool anscheduler_socket_msg(socket_desc_t * socket,
   }
   anscheduler_unlock(&sock->connRecLock);
   
-  if (!otherEnd) return false;
-  if (!_push_message(otherEnd, msg)) {
+  if (!otherEnd) return 0;
+  uint64_t sent = _push_messages(otherEnd, msgs, count);
+  if (!sent) {
     anscheduler_socket_dereference(otherEnd);
-    return false;
+    return 0;
   }
   
   anscheduler_socket_dereference(socket); // cannot hold a ref across this
   _wakeup_endpoint(otherEnd);
+  return sent;
+}
+
+bool anscheduler_socket_wait_writable(socket_desc_t * socket) {
+  socket_desc_t * otherEnd = NULL;
+  socket_t * sock = socket->socket;
+  anscheduler_lock(&sock->connRecLock);
+  if (socket->isConnector) {
+    otherEnd = sock->receiver;
+  } else {
+    otherEnd = sock->connector;
+  }
+  if (otherEnd) {
+    otherEnd = anscheduler_socket_reference(otherEnd) ? otherEnd : NULL;
+  }
+  anscheduler_unlock(&sock->connRecLock);
+  if (!otherEnd) {
+    anscheduler_socket_dereference(socket);
+    return false;
+  }
+  
+  thread_t * thread = anscheduler_cpu_get_thread();
+  socket_writer_t writer;
+  writer.thread = thread;
+  writer.ring = _ring_for(otherEnd);
+  writer.socket = socket;
+  writer.otherEnd = otherEnd;
+  writer.woken = 0;
+  
+  socket_ring_t * ring = writer.ring;
+  anscheduler_lock(&ring->writersLock);
+  writer.next = ring->firstWriter;
+  ring->firstWriter = &writer;
+  
+  // a reader which drains the ring after this point is sure to see us
+  __sync_synchronize();
+  uint64_t used = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+    - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (used < ring->depth) {
+    socket_writer_t ** link = &ring->firstWriter;
+    while (*link != &writer) link = &(*link)->next;
+    (*link) = writer.next;
+    anscheduler_unlock(&ring->writersLock);
+    anscheduler_socket_dereference(otherEnd);
+    anscheduler_socket_dereference(socket);
+    return true;
+  }
+  anscheduler_unlock(&ring->writersLock);
+  
+  anscheduler_save_return_state(thread, &writer,
+                                (void (*)(void *))_writer_continuation);
   return true;
 }
 
@@ -134,13 +297,15 @@ void anscheduler_socket_msg_async(socket_desc_t * socket,
                                   socket_msg_t * msg) {
   // retain the socket until we send the message
   if (!anscheduler_socket_reference(socket)) {
-    anscheduler_free(msg);
+    anscheduler_socket_msg_free(msg);
     return;
   }
   
-  msginfo_t * info = anscheduler_alloc(sizeof(msginfo_t));
+  msginfo_t * info = anscheduler_slab_alloc(sizeof(msginfo_t));
   if (!info) {
-    anscheduler_abort("failed to allocate async message info");
+    anscheduler_socket_msg_free(msg);
+    anscheduler_socket_dereference(socket);
+    return;
   }
   
   info->message = msg;
@@ -150,70 +315,187 @@ void anscheduler_socket_msg_async(socket_desc_t * socket,
 
 socket_msg_t * anscheduler_socket_msg_data(const void * data, uint64_t len) {
   if (len >= 0xfe8) return NULL;
-  socket_msg_t * msg = anscheduler_alloc(sizeof(socket_msg_t));
+  socket_msg_t * msg = _msg_alloc(len);
   if (!msg) return NULL;
   
   msg->type = ANSCHEDULER_MSG_TYPE_DATA;
   msg->len = len;
-  const uint8_t * source = (const uint8_t *)data;
-  int i;
-  for (i = 0; i < len; i++) {
-    msg->message[i] = source[i];
+  anscheduler_copy(msg->message, data, (int)len);
+  return msg;
+}
+
+socket_msg_t * anscheduler_socket_msg_grant(uint64_t vpage) {
+  return anscheduler_socket_msg_grant_vector(&vpage, 1);
+}
+
+socket_msg_t * anscheduler_socket_msg_grant_vector(const uint64_t * vpages,
+                                                   uint64_t count) {
+  if (!count || count > ANSCHEDULER_SOCKET_GRANT_MAX) return NULL;
+  socket_msg_t * msg = _msg_alloc(count * sizeof(uint64_t));
+  if (!msg) return NULL;
+  
+  task_t * task = anscheduler_cpu_get_task();
+  uint64_t * entries = (uint64_t *)msg->message;
+  uint16_t oldFlags[ANSCHEDULER_SOCKET_GRANT_MAX];
+  uint16_t mask = ANSCHEDULER_PAGE_FLAG_PRESENT
+    | ANSCHEDULER_PAGE_FLAG_USER
+    | ANSCHEDULER_PAGE_FLAG_WRITE;
+  anscheduler_lock(&task->vmLock);
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    // unmapping as we go means a page listed twice fails the second time
+    uint16_t flags;
+    uint64_t entry = anscheduler_vm_lookup(task->vm, vpages[i], &flags);
+    if (!_is_data_page(vpages[i]) || (flags & mask) != mask
+        || (flags & ANSCHEDULER_PAGE_FLAG_COW)
+        || anscheduler_frame_is_shared(entry)) {
+      break;
+    }
+    anscheduler_vm_unmap(task->vm, vpages[i]);
+    entries[i] = entry;
+    oldFlags[i] = flags;
   }
+  if (i < count) {
+    // put back what we took; the page tables are all still there
+    while (i-- > 0) {
+      anscheduler_vm_map(task->vm, vpages[i], entries[i], oldFlags[i]);
+    }
+    anscheduler_unlock(&task->vmLock);
+    anscheduler_slab_free(msg);
+    return NULL;
+  }
+  // nobody is charged for the frames while they are in flight, but the
+  // platform may have mapped some of them without charging us at all
+  uint64_t charged = 0;
+  for (i = 0; i < count; i++) {
+    if (anscheduler_frame_owner(entries[i]) == task) charged++;
+    anscheduler_frame_release(entries[i], task);
+  }
+  anscheduler_unlock(&task->vmLock);
+  anscheduler_cpu_notify_invlpg(task);
+  anscheduler_task_mem_uncharge(task, &task->mem.user, charged);
   
+  msg->type = ANSCHEDULER_MSG_TYPE_GRANT;
+  msg->len = count * sizeof(uint64_t);
   return msg;
 }
 
-socket_msg_t * anscheduler_socket_read(socket_desc_t * dest) {
-  uint64_t * lock, * count;
-  socket_msg_t ** first, ** last;
-  if (dest->isConnector) {
-    lock = &dest->socket->forConnectorLock;
-    count = &dest->socket->forConnectorCount;
-    first = &dest->socket->forConnectorFirst;
-    last = &dest->socket->forConnectorLast;
-  } else {
-    lock = &dest->socket->forReceiverLock;
-    count = &dest->socket->forReceiverCount;
-    first = &dest->socket->forReceiverFirst;
-    last = &dest->socket->forReceiverLast;
+bool anscheduler_socket_msg_map(socket_msg_t * msg, uint64_t vpage) {
+  if (msg->type != ANSCHEDULER_MSG_TYPE_GRANT) return false;
+  uint64_t * entries = (uint64_t *)msg->message;
+  uint64_t count = msg->len / sizeof(uint64_t);
+  if (!count || !entries[0]) return false;
+  if (!_is_data_page(vpage) || !_is_data_page(vpage + count - 1)) {
+    return false;
   }
   
-  anscheduler_lock(lock);
-  if ((*count) == 0) {
-    anscheduler_unlock(lock);
-    return NULL;
+  task_t * task = anscheduler_cpu_get_task();
+  anscheduler_lock(&task->vmLock);
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    uint16_t flags;
+    anscheduler_vm_lookup(task->vm, vpage + i, &flags);
+    if (flags) {
+      anscheduler_unlock(&task->vmLock);
+      return false;
+    }
   }
-  socket_msg_t * res = *first;
-  if (!res->next) {
-    (*first) = ((*last) = NULL);
-  } else {
-    (*first) = res->next;
+  if (!anscheduler_task_mem_charge(task, &task->mem.user, count, false)) {
+    anscheduler_unlock(&task->vmLock);
+    return false;
+  }
+  for (i = 0; i < count; i++) {
+    if (anscheduler_frame_claim(entries[i], task)) continue;
+    while (i-- > 0) anscheduler_frame_release(entries[i], task);
+    anscheduler_task_mem_uncharge(task, &task->mem.user, count);
+    anscheduler_unlock(&task->vmLock);
+    return false;
+  }
+  
+  uint16_t flags = ANSCHEDULER_PAGE_FLAG_PRESENT
+    | ANSCHEDULER_PAGE_FLAG_USER
+    | ANSCHEDULER_PAGE_FLAG_WRITE;
+  for (i = 0; i < count; i++) {
+    anscheduler_vm_map(task->vm, vpage + i, entries[i], flags);
+    entries[i] = 0;
+  }
+  anscheduler_unlock(&task->vmLock);
+  return true;
+}
+
+uint64_t anscheduler_socket_msg_copy(socket_msg_t * msg,
+                                    void * buf,
+                                    uint64_t size) {
+  uint64_t len = msg->len < size ? msg->len : size;
+  anscheduler_copy(buf, msg->message, (int)len);
+  return len;
+}
+
+void anscheduler_socket_msg_free(socket_msg_t * msg) {
+  if (msg->type == ANSCHEDULER_MSG_TYPE_GRANT) {
+    uint64_t * entries = (uint64_t *)msg->message;
+    uint64_t i, count = msg->len / sizeof(uint64_t);
+    for (i = 0; i < count; i++) {
+      if (!entries[i]) continue;
+      anscheduler_free((void *)(anscheduler_vm_virtual(entries[i]) << 12));
+    }
+  }
+  anscheduler_slab_free(msg);
+}
+
+socket_msg_t * anscheduler_socket_read(socket_desc_t * dest) {
+  socket_msg_t * msg;
+  if (!anscheduler_socket_read_batch(dest, &msg, 1)) return NULL;
+  return msg;
+}
+
+uint64_t anscheduler_socket_read_batch(socket_desc_t * dest,
+                                       socket_msg_t ** msgs,
+                                       uint64_t max) {
+  socket_ring_t * ring = _ring_for(dest);
+  anscheduler_lock(&ring->consumerLock);
+  uint64_t head = ring->head;
+  uint64_t available = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+  uint64_t read = available < max ? available : max;
+  uint64_t i;
+  for (i = 0; i < read; i++) {
+    msgs[i] = ring->slots[(head + i) & (ring->size - 1)];
+  }
+  
+  // the slots may be reused as soon as the new head is visible
+  __atomic_store_n(&ring->head, head + read, __ATOMIC_RELEASE);
+  anscheduler_unlock(&ring->consumerLock);
+  
+  // pairs with the barrier in anscheduler_socket_wait_writable()
+  __sync_synchronize();
+  if (read && ring->firstWriter) _wake_writers(ring);
+  if (read) {
+    anscheduler_task_mem_uncharge(dest->task, &dest->task->mem.messages,
+                                  read);
   }
-  (*count)--;
-  res->next = NULL;
-  anscheduler_unlock(lock);
-  return res;
+  return read;
 }
 
 bool anscheduler_socket_connect(socket_desc_t * socket, task_t * task) {
+  // allocate the message first so that failing leaves nothing to undo
+  socket_msg_t * msg = _msg_alloc(0);
+  if (!msg) return false;
+  
   if (__sync_fetch_and_or(&socket->socket->hasBeenConnected, 1)) {
+    anscheduler_slab_free(msg);
     return false;
   }
   
   // generate another link
   socket_desc_t * link = _create_descriptor(socket->socket, task, false);
   if (!link) {
+    anscheduler_slab_free(msg);
     return false;
   }
   
   anscheduler_task_dereference(task);
   anscheduler_socket_dereference(link);
   
-  socket_msg_t * msg = anscheduler_alloc(sizeof(socket_msg_t));
-  if (!msg) {
-    anscheduler_abort("failed to allocate connect message");
-  }
   msg->type = ANSCHEDULER_MSG_TYPE_CONNECT;
   msg->len = 0;
   
@@ -231,6 +513,42 @@ void anscheduler_socket_close(socket_desc_t * socket, uint64_t code) {
   anscheduler_unlock(&socket->closeLock);
 }
 
+bool anscheduler_socket_set_depth(socket_desc_t * socket, uint64_t depth) {
+  if (!depth || depth > ANSCHEDULER_SOCKET_DEPTH_MAX) return false;
+  task_t * task = socket->task;
+  anscheduler_lock(&task->memLock);
+  uint64_t limit = task->memLimit;
+  anscheduler_unlock(&task->memLock);
+  if (limit && depth > limit) return false;
+  
+  socket_ring_t * ring = _ring_for(socket);
+  anscheduler_lock(&ring->producerLock);
+  anscheduler_lock(&ring->consumerLock);
+  // messages past a lowered depth stay queued, and the CLOSE still needs room
+  uint64_t needed = depth;
+  if (needed < ring->tail - ring->head) needed = ring->tail - ring->head;
+  needed += SOCKET_CONTROL_SLOTS;
+  // queued control messages were counted twice above, but data never goes
+  // past ANSCHEDULER_SOCKET_DEPTH_MAX, so no ring needs more than this
+  if (needed > ANSCHEDULER_SOCKET_DEPTH_MAX + SOCKET_CONTROL_SLOTS) {
+    needed = ANSCHEDULER_SOCKET_DEPTH_MAX + SOCKET_CONTROL_SLOTS;
+  }
+  uint64_t size = ANSCHEDULER_SOCKET_RING_SIZE;
+  while (size < needed) size <<= 1;
+  if (size != ring->size && !_ring_resize(ring, size)) {
+    anscheduler_unlock(&ring->consumerLock);
+    anscheduler_unlock(&ring->producerLock);
+    return false;
+  }
+  bool grew = depth > ring->depth;
+  ring->depth = depth;
+  anscheduler_unlock(&ring->consumerLock);
+  anscheduler_unlock(&ring->producerLock);
+  
+  if (grew) _wake_writers(ring);
+  return true;
+}
+
 task_t * anscheduler_socket_remote(socket_desc_t * socket) {
   socket_desc_t * otherEnd = NULL;
   socket_t * sock = socket->socket;
@@ -254,10 +572,9 @@ task_t * anscheduler_socket_remote(socket_desc_t * socket) {
 static socket_desc_t * _create_descriptor(socket_t * socket,
                                           task_t * task,
                                           bool isConnector) {
-  socket_desc_t * desc = anscheduler_alloc(sizeof(socket_desc_t));
+  socket_desc_t * desc = anscheduler_slab_alloc(sizeof(socket_desc_t));
   if (!desc) return NULL;
   
-  anscheduler_zero(desc, sizeof(socket_desc_t));
   desc->socket = socket;
   desc->task = task;
   desc->refCount = 1;
@@ -307,14 +624,14 @@ static void _socket_hangup(socket_desc_t * socket) {
   anscheduler_unlock(&sock->connRecLock);
   
   if (!otherEnd) {
-    anscheduler_free(socket);
+    anscheduler_slab_free(socket);
     if (shouldFree) {
       anscheduler_cpu_unlock();
       _socket_free(sock);
       anscheduler_cpu_lock();
     }
   } else {
-    socket_msg_t * msg = anscheduler_alloc(sizeof(socket_msg_t));
+    socket_msg_t * msg = _msg_alloc(sizeof(uint64_t));
     if (!msg) {
       anscheduler_abort("failed to allocate close message!");
     }
@@ -322,7 +639,12 @@ static void _socket_hangup(socket_desc_t * socket) {
     msg->len = 8;
     (*((uint64_t *)msg->message)) = socket->closeCode;
     
-    _push_message(otherEnd, msg);
+    if (!_push_messages(otherEnd, &msg, 1)) {
+      // set_depth() always leaves room for this. Should it not fit anyway,
+      // the other end is still woken below, its writers were woken when this
+      // end was dropped, and its next send will fail.
+      anscheduler_socket_msg_free(msg);
+    }
     _wakeup_endpoint(otherEnd);
     
     // by this point, the other end may have freed up everything
@@ -332,7 +654,7 @@ static void _socket_hangup(socket_desc_t * socket) {
     shouldFree = sock->receiver == sock->connector;
     anscheduler_unlock(&sock->connRecLock);
     
-    anscheduler_free(socket);
+    anscheduler_slab_free(socket);
     if (shouldFree) { 
       anscheduler_cpu_unlock();
       _socket_free(sock);
@@ -343,40 +665,37 @@ static void _socket_hangup(socket_desc_t * socket) {
   anscheduler_loop_delete_cur_kernel();
 }
 
-static bool _push_message(socket_desc_t * dest, socket_msg_t * msg) {
-  uint64_t * lock, * count;
-  socket_msg_t ** first, ** last;
-  if (dest->isConnector) {
-    lock = &dest->socket->forConnectorLock;
-    count = &dest->socket->forConnectorCount;
-    first = &dest->socket->forConnectorFirst;
-    last = &dest->socket->forConnectorLast;
-  } else {
-    lock = &dest->socket->forReceiverLock;
-    count = &dest->socket->forReceiverCount;
-    first = &dest->socket->forReceiverFirst;
-    last = &dest->socket->forReceiverLast;
-  }
-  
-  anscheduler_lock(lock);
-  if (msg->type == ANSCHEDULER_MSG_TYPE_DATA) {
-    if (*count >= ANSCHEDULER_SOCKET_MSG_MAX) {
-      anscheduler_unlock(lock);
-      return false;
+static uint64_t _push_messages(socket_desc_t * dest,
+                               socket_msg_t ** msgs,
+                               uint64_t count) {
+  socket_ring_t * ring = _ring_for(dest);
+  task_t * task = dest->task;
+  anscheduler_lock(&ring->producerLock);
+  uint64_t tail = ring->tail;
+  uint64_t used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t pushed;
+  for (pushed = 0; pushed < count; pushed++) {
+    socket_msg_t * msg = msgs[pushed];
+    bool isData = msg->type == ANSCHEDULER_MSG_TYPE_DATA
+      || msg->type == ANSCHEDULER_MSG_TYPE_GRANT;
+    if (isData && used >= ring->depth) break;
+    if (used >= ring->size) break;
+    
+    // control messages must always get through, so they ignore the limit
+    if (!anscheduler_task_mem_charge(task, &task->mem.messages, 1, !isData)) {
+      break;
     }
+    
+    msg->next = NULL;
+    ring->slots[tail & (ring->size - 1)] = msg;
+    tail++;
+    used++;
   }
   
-  // add it to the linked list
-  (*count)++;
-  msg->next = NULL;
-  if (!(*last)) {
-    (*last) = ((*first) = msg);
-  } else {
-    (*last)->next = msg;
-    (*last) = msg;
-  }
-  anscheduler_unlock(lock);
-  return true;
+  // the reader may see the new tail only once the slots are filled in
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  anscheduler_unlock(&ring->producerLock);
+  return pushed;
 }
 
 static void _wakeup_endpoint(socket_desc_t * dest) {
@@ -389,18 +708,12 @@ static void _wakeup_endpoint(socket_desc_t * dest) {
   anscheduler_task_pending(task, dest);
   anscheduler_socket_dereference(dest);
   
-  anscheduler_lock(&task->threadsLock);
-  thread_t * thread = task->firstThread;
-  while (thread) {
-    if (__sync_fetch_and_and(&thread->isPolling, 0)) {
-      anscheduler_unlock(&task->threadsLock);
-      thread_t * curThread = anscheduler_cpu_get_thread();
-      anscheduler_save_return_state(curThread, thread, _switch_continuation);
-      return;
-    }
-    thread = thread->next;
+  thread_t * thread = anscheduler_thread_pop_waiter(task);
+  if (thread) {
+    thread_t * curThread = anscheduler_cpu_get_thread();
+    anscheduler_save_return_state(curThread, thread, _switch_continuation);
+    return;
   }
-  anscheduler_unlock(&task->threadsLock);
   
   // no polling threads were found
   anscheduler_task_dereference(dest->task);
@@ -410,47 +723,123 @@ static void _async_msg(msginfo_t * _info) {
   anscheduler_cpu_lock();
   
   msginfo_t info = *_info;
-  anscheduler_free(_info);
+  anscheduler_slab_free(_info);
   if (!anscheduler_socket_msg(info.descriptor, info.message)) {
-    anscheduler_free(info.message);
+    anscheduler_socket_msg_free(info.message);
     anscheduler_socket_dereference(info.descriptor);
   }
   anscheduler_loop_delete_cur_kernel();
 }
 
 static void _socket_free(socket_t * socket) {
-  // free for connector messages
-  while (true) {
-    anscheduler_cpu_lock();
-    if (!socket->forConnectorFirst) {
-      anscheduler_cpu_unlock();
-      break;
-    }
-    socket_msg_t * msg = socket->forConnectorFirst;
-    socket->forConnectorFirst = msg->next;
-    anscheduler_free(msg);
-    anscheduler_cpu_unlock();
-  }
-  
-  // free for receiver messages
-  while (true) {
-    anscheduler_cpu_lock();
-    if (!socket->forReceiverFirst) {
+  // nobody else can touch the rings by now
+  socket_ring_t * rings[2] = {&socket->forConnector, &socket->forReceiver};
+  int i;
+  for (i = 0; i < 2; i++) {
+    socket_ring_t * ring = rings[i];
+    while (ring->head != ring->tail) {
+      anscheduler_cpu_lock();
+      uint64_t slot = (ring->head++) & (ring->size - 1);
+      anscheduler_socket_msg_free(ring->slots[slot]);
       anscheduler_cpu_unlock();
-      break;
     }
-    socket_msg_t * msg = socket->forReceiverFirst;
-    socket->forReceiverFirst = msg->next;
-    anscheduler_free(msg);
-    anscheduler_cpu_unlock();
   }
   
   anscheduler_cpu_lock();
-  anscheduler_free(socket);
+  _socket_discard(socket);
   anscheduler_cpu_unlock();
 }
 
+static void _socket_discard(socket_t * socket) {
+  if (socket->forConnector.slots) {
+    anscheduler_slab_free(socket->forConnector.slots);
+  }
+  if (socket->forReceiver.slots) {
+    anscheduler_slab_free(socket->forReceiver.slots);
+  }
+  anscheduler_slab_free(socket);
+}
+
+static void _uncharge_queue(socket_desc_t * desc) {
+  socket_ring_t * ring = _ring_for(desc);
+  anscheduler_lock(&ring->consumerLock);
+  uint64_t pages = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - ring->head;
+  anscheduler_unlock(&ring->consumerLock);
+  if (pages) {
+    anscheduler_task_mem_uncharge(desc->task, &desc->task->mem.messages,
+                                  pages);
+  }
+}
+
 static void _switch_continuation(void * th) {
   thread_t * thread = (thread_t *)th;
   anscheduler_loop_switch(thread->task, thread);
 }
+
+static socket_msg_t * _msg_alloc(uint64_t len) {
+  return anscheduler_slab_alloc(offsetof(socket_msg_t, message) + len);
+}
+
+static bool _is_data_page(uint64_t page) {
+  return page >= ANSCHEDULER_TASK_DATA_PAGE
+    && page < ANSCHEDULER_TASK_END_PAGE;
+}
+
+static socket_ring_t * _ring_for(socket_desc_t * desc) {
+  if (desc->isConnector) return &desc->socket->forConnector;
+  return &desc->socket->forReceiver;
+}
+
+static bool _ring_resize(socket_ring_t * ring, uint64_t size) {
+  socket_msg_t ** slots = anscheduler_slab_alloc(size * sizeof(socket_msg_t *));
+  if (!slots) return false;
+  uint64_t i;
+  for (i = ring->head; i != ring->tail; i++) {
+    slots[i & (size - 1)] = ring->slots[i & (ring->size - 1)];
+  }
+  if (ring->slots) anscheduler_slab_free(ring->slots);
+  ring->slots = slots;
+  ring->size = size;
+  return true;
+}
+
+static void _wake_writers(socket_ring_t * ring) {
+  anscheduler_lock(&ring->writersLock);
+  socket_writer_t * writer = ring->firstWriter;
+  ring->firstWriter = NULL;
+  while (writer) {
+    // the writer's stack may be gone as soon as it is marked woken
+    socket_writer_t * next = writer->next;
+    thread_t * thread = writer->thread;
+    writer->woken = 1;
+    if (__sync_fetch_and_and(&thread->isPolling, 0)) {
+      anscheduler_loop_push(thread);
+    }
+    writer = next;
+  }
+  anscheduler_unlock(&ring->writersLock);
+}
+
+static void _writer_continuation(socket_writer_t * writer) {
+  // get off of the thread's stack before anybody can wake it up
+  anscheduler_cpu_stack_run(writer, (void (*)(void *))_writer_block);
+}
+
+static void _writer_block(socket_writer_t * _writer) {
+  socket_writer_t writer = *_writer;
+  socket_ring_t * ring = writer.ring;
+  anscheduler_lock(&ring->writersLock);
+  if (_writer->woken) {
+    anscheduler_unlock(&ring->writersLock);
+    anscheduler_socket_dereference(writer.otherEnd);
+    anscheduler_socket_dereference(writer.socket);
+    anscheduler_thread_run(writer.thread->task, writer.thread);
+  }
+  writer.thread->isPolling = 1;
+  anscheduler_unlock(&ring->writersLock);
+  
+  // the socket can't go away while the ring is in use, so these come last
+  anscheduler_socket_dereference(writer.otherEnd);
+  anscheduler_socket_dereference(writer.socket);
+  anscheduler_loop_run();
+}
@@ -1,4 +1,5 @@
 #include "socketlist.h"
+#include "reaper.h"
 #include <anscheduler/functions.h>
 #include <anscheduler/socket.h>
 
@@ -16,6 +17,7 @@ void anscheduler_descriptor_set(task_t * task, socket_desc_t * desc) {
     desc->next = task->sockets[hash];
     task->sockets[hash] = desc;
   }
+  task->socketCount++;
   anscheduler_unlock(&task->socketsLock);
 }
 
@@ -33,13 +35,19 @@ void anscheduler_descriptor_delete(task_t * task,
   }
   if (desc->next) desc->next->last = desc->last;
   desc->next = (desc->last = NULL);
+  bool wasLast = !(--task->socketCount);
   
   // now, free the descriptor here before unlocking so that we know the task
   // cannot be freed yet
   anscheduler_lock(&task->descriptorsLock);
   anidxset_put(&task->descriptors, desc->descriptor);
   anscheduler_unlock(&task->descriptorsLock);
+  bool isReaping = wasLast && task->isKilled;
   anscheduler_unlock(&task->socketsLock);
+  
+  // the reaper may be waiting for this task's sockets to go away; after we
+  // tell it, the task may be freed at any time
+  if (isReaping) anscheduler_reaper_notify();
 }
 
 socket_desc_t * anscheduler_descriptor_find(task_t * task, uint64_t desc) {
@@ -0,0 +1,54 @@
+#include "stackpool.h"
+#include <anscheduler/functions.h>
+
+#define STACKPOOL_SIZE 0x20
+
+/**
+ * Only ever touched by its own CPU from a critical section, so it needs no
+ * lock.
+ */
+typedef struct {
+  uint64_t count;
+  void * pages[STACKPOOL_SIZE];
+} __attribute__((packed)) stackpool_t;
+
+static stackpool_t pools[ANSCHEDULER_MAX_CPUS] __attribute__((aligned(8)));
+
+static stackpool_t * _cpu_pool();
+
+bool anscheduler_stackpool_alloc(void ** pages, uint64_t count) {
+  stackpool_t * pool = _cpu_pool();
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    if (pool->count) {
+      pages[i] = pool->pages[--pool->count];
+    } else if (!(pages[i] = anscheduler_alloc(0x1000))) {
+      anscheduler_stackpool_free(pages, i);
+      return false;
+    }
+  }
+  return true;
+}
+
+void anscheduler_stackpool_free(void ** pages, uint64_t count) {
+  stackpool_t * pool = _cpu_pool();
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    if (pool->count == STACKPOOL_SIZE) {
+      anscheduler_free(pages[i]);
+    } else {
+      pool->pages[pool->count++] = pages[i];
+    }
+  }
+}
+
+void anscheduler_stackpool_drain() {
+  stackpool_t * pool = _cpu_pool();
+  while (pool->count) {
+    anscheduler_free(pool->pages[--pool->count]);
+  }
+}
+
+static stackpool_t * _cpu_pool() {
+  return &pools[anscheduler_cpu_get_index()];
+}
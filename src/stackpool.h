@@ -0,0 +1,32 @@
+#ifndef __ANSCHEDULER_STACKPOOL_H__
+#define __ANSCHEDULER_STACKPOOL_H__
+
+#include <anscheduler/types.h>
+
+/**
+ * Kernel stack pages are recycled through a small per-CPU pool so that
+ * creating and exiting threads rarely reaches anscheduler_alloc().
+ */
+
+/**
+ * Fills `pages` with `count` pages, taking them from this CPU's pool first.
+ * @return false if the pages could not all be allocated, in which case none
+ * are returned.
+ * @critical
+ */
+bool anscheduler_stackpool_alloc(void ** pages, uint64_t count);
+
+/**
+ * Returns pages to this CPU's pool. Pages which don't fit are freed.
+ * @critical
+ */
+void anscheduler_stackpool_free(void ** pages, uint64_t count);
+
+/**
+ * Frees every page in this CPU's pool. Call this when the CPU is about to go
+ * idle.
+ * @critical
+ */
+void anscheduler_stackpool_drain();
+
+#endif
@@ -0,0 +1,107 @@
+#include "stackrange.h"
+#include "slab.h"
+#include <anscheduler/task.h>
+#include <anscheduler/functions.h>
+
+#define STACKRANGE_REGION_SIZE (ANSCHEDULER_TASK_DATA_PAGE \
+  - ANSCHEDULER_TASK_USER_STACKS_PAGE)
+
+/**
+ * Takes `count` pages from the first freed range big enough for them.
+ * @return NULL if no freed range was big enough or memory ran out.
+ * @critical Must be called with the task's stacksLock held.
+ */
+static stack_range_t * _take_freed(task_t * task, uint64_t count);
+
+stack_range_t * anscheduler_stackrange_alloc(task_t * task, uint64_t count) {
+  anscheduler_lock(&task->stacksLock);
+  stack_range_t * range = _take_freed(task, count);
+  if (range || count > STACKRANGE_REGION_SIZE - task->stacksBreak) {
+    anscheduler_unlock(&task->stacksLock);
+    return range;
+  }
+  
+  range = anscheduler_slab_alloc(sizeof(stack_range_t));
+  if (range) {
+    range->page = ANSCHEDULER_TASK_USER_STACKS_PAGE + task->stacksBreak;
+    range->count = count;
+    task->stacksBreak += count;
+  }
+  anscheduler_unlock(&task->stacksLock);
+  return range;
+}
+
+void anscheduler_stackrange_free(task_t * task, stack_range_t * range) {
+  anscheduler_lock(&task->stacksLock);
+  stack_range_t * last = NULL, * next = task->firstFreeStack;
+  while (next && next->page < range->page) {
+    last = next;
+    next = next->next;
+  }
+  
+  if (next && range->page + range->count == next->page) {
+    range->count += next->count;
+    range->next = next->next;
+    anscheduler_slab_free(next);
+  } else {
+    range->next = next;
+  }
+  if (last && last->page + last->count == range->page) {
+    last->count += range->count;
+    last->next = range->next;
+    anscheduler_slab_free(range);
+    range = last;
+  } else if (last) {
+    last->next = range;
+  } else {
+    task->firstFreeStack = range;
+  }
+  
+  // a range at the top of the used part of the region just lowers it
+  uint64_t end = range->page + range->count;
+  if (!range->next
+      && end == ANSCHEDULER_TASK_USER_STACKS_PAGE + task->stacksBreak) {
+    task->stacksBreak -= range->count;
+    if (range == task->firstFreeStack) {
+      task->firstFreeStack = NULL;
+    } else {
+      last = task->firstFreeStack;
+      while (last->next != range) last = last->next;
+      last->next = NULL;
+    }
+    anscheduler_slab_free(range);
+  }
+  anscheduler_unlock(&task->stacksLock);
+}
+
+void anscheduler_stackrange_cleanup(task_t * task) {
+  while (task->firstFreeStack) {
+    stack_range_t * range = task->firstFreeStack;
+    task->firstFreeStack = range->next;
+    anscheduler_slab_free(range);
+  }
+  task->stacksBreak = 0;
+}
+
+static stack_range_t * _take_freed(task_t * task, uint64_t count) {
+  stack_range_t * last = NULL, * range = task->firstFreeStack;
+  while (range && range->count < count) {
+    last = range;
+    range = range->next;
+  }
+  if (!range) return NULL;
+  
+  if (range->count == count) {
+    if (last) last->next = range->next;
+    else task->firstFreeStack = range->next;
+    return range;
+  }
+  
+  // split the top off of the freed range
+  stack_range_t * piece = anscheduler_slab_alloc(sizeof(stack_range_t));
+  if (!piece) return NULL;
+  range->count -= count;
+  piece->page = range->page + range->count;
+  piece->count = count;
+  return piece;
+}
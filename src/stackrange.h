@@ -0,0 +1,41 @@
+#ifndef __ANSCHEDULER_STACKRANGE_H__
+#define __ANSCHEDULER_STACKRANGE_H__
+
+#include <anscheduler/types.h>
+
+/**
+ * Each task's user stacks region is handed out in ranges which are just big
+ * enough for a thread's guard and stack pages. Ranges come from the bottom
+ * of the region as it grows, or from a list of freed ranges kept in address
+ * order, in which neighbours are merged.
+ */
+
+struct stack_range_t {
+  stack_range_t * next;
+  uint64_t page;
+  uint64_t count;
+} __attribute__((packed));
+
+/**
+ * Reserves `count` consecutive pages of the task's user stacks region. This
+ * takes the task's stacksLock.
+ * @return The range, or NULL if the region is full or memory ran out.
+ * @critical O(n) in the number of freed ranges
+ */
+stack_range_t * anscheduler_stackrange_alloc(task_t * task, uint64_t count);
+
+/**
+ * Gives a range back to its task. This never allocates memory, so it can't
+ * fail. This takes the task's stacksLock.
+ * @critical O(n) in the number of freed ranges
+ */
+void anscheduler_stackrange_free(task_t * task, stack_range_t * range);
+
+/**
+ * Frees the task's list of freed ranges. Every range must have been given
+ * back first.
+ * @critical
+ */
+void anscheduler_stackrange_cleanup(task_t * task);
+
+#endif
@@ -1,11 +1,29 @@
 #include <anscheduler/task.h>
 #include <anscheduler/functions.h>
+#include <anscheduler/group.h>
 #include <anscheduler/loop.h> // for kernel threads
 #include <anscheduler/thread.h> // for deallocation
 #include <anscheduler/socket.h> // for socket closing
 #include <anscheduler/paging.h>
+#include <anscheduler/futex.h> // for futex teardown
+#include <anscheduler/fpu.h>
 #include "util.h" // for idxset
 #include "pidmap.h"
+#include "slab.h"
+#include "frames.h"
+#include "reaper.h"
+#include "stackrange.h"
+
+typedef struct {
+  task_t * parent;
+  task_t ** children;
+  uint64_t count;
+} fork_info_t;
+
+typedef struct {
+  task_stats_t * stats;
+  uint64_t count;
+} stats_info_t;
 
 /**
  * @critical
@@ -13,70 +31,166 @@
 static bool _map_first_4mb(task_t * task);
 
 /**
+ * Allocates a task structure and its address space without giving it a PID.
  * @critical
  */
-static void _generate_kill_job(task_t * task);
+static task_t * _task_alloc();
 
 /**
- * @noncritical
+ * Frees a task which was never launched, along with any threads which were
+ * linked to it.
+ * @critical
  */
-static void _free_task_method(task_t * task);
+static void _destroy_unlaunched(task_t * task);
 
 /**
- * @noncritical
+ * Like _destroy_unlaunched, but leaves the task's PID for the caller to
+ * return to the pool.
+ * @critical
  */
-static void _close_task_sockets_async(task_t * task);
+static void _free_unlaunched(task_t * task);
 
 /**
+ * Gives a new task the same group and memory limit as `parent`.
  * @critical
  */
-static void _task_exit(void * codeVal);
+static void _inherit_settings(task_t * parent, task_t * child);
+
+/**
+ * Shares the code and data regions of `parent` with every child,
+ * copy-on-write. The parent's address space is walked only once.
+ * @return false on failure, in which case the children may hold some of the
+ * parent's frames and must be released with _release_frames().
+ * @critical
+ */
+static bool _clone_address_space(task_t * parent,
+                                 task_t ** children,
+                                 uint64_t count);
+
+/**
+ * Shares one page of the parent with the children during a fork.
+ * @critical
+ */
+static bool _fork_page(fork_info_t * info,
+                       uint64_t vpage,
+                       uint64_t entry,
+                       uint16_t flags);
 
 /**
+ * Drops this task's references to tracked frames and unmaps every frame that
+ * is still mapped by another task, so that freeing the address space will
+ * only free frames which this task owns.
  * @critical
  */
-static void _resign_continuation(void * unused);
+static void _release_frames(task_t * task);
+
+/**
+ * @critical
+ */
+static bool _release_page(task_t * task,
+                          uint64_t vpage,
+                          uint64_t entry,
+                          uint16_t flags);
+
+/**
+ * Appends a task's statistics to a stats_info_t.
+ * @critical Called from inside a PID map walk.
+ */
+static void _collect_stats(stats_info_t * info, task_t * task);
+
+/**
+ * @critical
+ */
+static void _generate_kill_job(task_t * task);
+
+/**
+ * @critical
+ */
+static void _task_exit(void * codeVal);
 
 /******************
  * Implementation *
  ******************/
 
 task_t * anscheduler_task_create() {
-  // allocate memory for task structure
-  task_t * task = anscheduler_alloc(sizeof(task_t));
+  task_t * task = _task_alloc();
   if (!task) return NULL;
-  anscheduler_zero(task, sizeof(task_t));
-  
-  task->refCount = 1;
+  task->pid = anscheduler_pidmap_alloc_pid();
+  return task;
+}
+
+task_t * anscheduler_task_fork(task_t * task) {
+  task_t * child = anscheduler_task_create();
+  if (!child) return NULL;
+  _inherit_settings(task, child);
   
-  if (!(task->vm = anscheduler_vm_root_alloc())) {
-    anscheduler_free(task);
+  if (!_clone_address_space(task, &child, 1)) {
+    _release_frames(child);
+    _destroy_unlaunched(child);
     return NULL;
   }
-  
-  if (!anscheduler_idxset_init(&task->descriptors)) {
-    anscheduler_vm_root_free(task->vm);
-    anscheduler_free(task);
-    return NULL;
+  return child;
+}
+
+uint64_t anscheduler_task_spawn(task_t * template,
+                                task_t ** tasks,
+                                uint64_t count) {
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    // the platform can't share page tables between roots, so each instance
+    // builds its own address space and thread
+    task_t * task = _task_alloc();
+    if (!task) break;
+    _inherit_settings(template, task);
+    
+    thread_t * thread = anscheduler_thread_create(task);
+    if (!thread) {
+      _free_unlaunched(task);
+      break;
+    }
+    anscheduler_thread_link(task, thread);
+    tasks[i] = task;
   }
+  if (!i) return 0;
   
-  if (!anscheduler_idxset_init(&task->stacks)) {
-    anidxset_free(&task->descriptors);
-    anscheduler_vm_root_free(task->vm);
-    anscheduler_free(task);
-    return NULL;
-  }
+  // hand out every PID with a single trip through the pool's lock
+  anscheduler_pidmap_alloc_pids(tasks, i);
   
-  if (!_map_first_4mb(task)) {
-    anidxset_free(&task->descriptors);
-    anidxset_free(&task->stacks);
-    anscheduler_vm_root_free(task->vm);
-    anscheduler_free(task);
-    return NULL;
+  if (!_clone_address_space(template, tasks, i)) {
+    anscheduler_pidmap_free_pids(tasks, i);
+    uint64_t j;
+    for (j = 0; j < i; j++) {
+      _release_frames(tasks[j]);
+      _free_unlaunched(tasks[j]);
+    }
+    return 0;
+  }
+  return i;
+}
+
+void anscheduler_task_launch_batch(task_t ** tasks, uint64_t count) {
+  thread_t * first = NULL, * last = NULL;
+  uint64_t i, threadCount = 0;
+  anscheduler_pidmap_set_batch(tasks, count);
+  for (i = 0; i < count; i++) {
+    task_t * task = tasks[i];
+    
+    // chain every thread together so they can be queued all at once
+    anscheduler_lock(&task->threadsLock);
+    thread_t * thread = task->firstThread;
+    while (thread) {
+      thread->queueLast = last;
+      thread->queueNext = NULL;
+      if (last) last->queueNext = thread;
+      else first = thread;
+      last = thread;
+      threadCount++;
+      thread = thread->next;
+    }
+    anscheduler_unlock(&task->threadsLock);
   }
   
-  task->pid = anscheduler_pidmap_alloc_pid();
-  return task;
+  if (first) anscheduler_loop_push_chain(first, last, threadCount);
 }
 
 void anscheduler_task_launch(task_t * task) {
@@ -147,6 +261,59 @@ task_t * anscheduler_task_for_pid(uint64_t pid) {
   return anscheduler_pidmap_get(pid);
 }
 
+uint64_t anscheduler_task_stats(uint64_t firstPid,
+                                task_stats_t * stats,
+                                uint64_t max) {
+  stats_info_t info;
+  info.stats = stats;
+  info.count = 0;
+  void (* fn)(void *, task_t *);
+  fn = (void (*)(void *, task_t *))_collect_stats;
+  return anscheduler_pidmap_walk(firstPid, max, fn, &info);
+}
+
+bool anscheduler_task_mem_charge(task_t * task,
+                                 uint64_t * counter,
+                                 uint64_t pages,
+                                 bool force) {
+  anscheduler_lock(&task->memLock);
+  if (task->memLimit && !force) {
+    uint64_t total = task->mem.user + task->mem.stack
+      + task->mem.kernStack + task->mem.messages;
+    if (total + pages > task->memLimit) {
+      anscheduler_unlock(&task->memLock);
+      return false;
+    }
+  }
+  (*counter) += pages;
+  anscheduler_unlock(&task->memLock);
+  return true;
+}
+
+void anscheduler_task_mem_uncharge(task_t * task,
+                                   uint64_t * counter,
+                                   uint64_t pages) {
+  anscheduler_lock(&task->memLock);
+  (*counter) -= pages;
+  anscheduler_unlock(&task->memLock);
+}
+
+void anscheduler_task_mem_limit(task_t * task, uint64_t pages) {
+  anscheduler_lock(&task->memLock);
+  task->memLimit = pages;
+  anscheduler_unlock(&task->memLock);
+}
+
+void anscheduler_task_mem(task_t * task, task_mem_t * usage) {
+  anscheduler_lock(&task->memLock);
+  (*usage) = task->mem;
+  anscheduler_unlock(&task->memLock);
+  
+  anscheduler_lock(&task->vmLock);
+  usage->tables = anscheduler_vm_table_count(task->vm);
+  anscheduler_unlock(&task->vmLock);
+}
+
 void anscheduler_task_exit(uint8_t code) {
   anscheduler_cpu_stack_run((void *)((long)code), _task_exit);
 }
@@ -156,16 +323,178 @@ void anscheduler_task_exit(uint8_t code) {
  ******************/
 
 static bool _map_first_4mb(task_t * task) {
+  uint64_t flags = ANSCHEDULER_PAGE_FLAG_PRESENT
+    | ANSCHEDULER_PAGE_FLAG_WRITE
+    | ANSCHEDULER_PAGE_FLAG_GLOBAL;
+  return anscheduler_vm_map_range(task->vm, 0, 0x400, 0, 1, flags);
+}
+
+static task_t * _task_alloc() {
+  // allocate memory for task structure
+  task_t * task = anscheduler_slab_alloc(sizeof(task_t));
+  if (!task) return NULL;
+  
+  task->refCount = 1;
+  
+  if (!(task->vm = anscheduler_vm_root_alloc())) {
+    anscheduler_slab_free(task);
+    return NULL;
+  }
+  
+  if (!anscheduler_idxset_init(&task->descriptors)) {
+    anscheduler_vm_root_free(task->vm);
+    anscheduler_slab_free(task);
+    return NULL;
+  }
+  
+  if (!anscheduler_idxset_init(&task->stacks)) {
+    anidxset_free(&task->descriptors);
+    anscheduler_vm_root_free(task->vm);
+    anscheduler_slab_free(task);
+    return NULL;
+  }
+  
+  if (!_map_first_4mb(task)) {
+    anidxset_free(&task->descriptors);
+    anidxset_free(&task->stacks);
+    anscheduler_vm_root_free(task->vm);
+    anscheduler_slab_free(task);
+    return NULL;
+  }
+  
+  return task;
+}
+
+static void _destroy_unlaunched(task_t * task) {
+  uint64_t pid = task->pid;
+  _free_unlaunched(task);
+  anscheduler_pidmap_free_pid(pid);
+}
+
+static void _free_unlaunched(task_t * task) {
+  // the threads never ran, so their user stacks have no pages yet
+  while (task->firstThread) {
+    thread_t * thread = task->firstThread;
+    task->firstThread = thread->next;
+    anscheduler_thread_free_kernel_stack(task, thread);
+    anscheduler_stackrange_free(task, thread->stackRange);
+    anscheduler_slab_free(thread);
+  }
+  anscheduler_stackrange_cleanup(task);
+  if (task->group) anscheduler_group_dereference(task->group);
+  anidxset_free(&task->descriptors);
+  anidxset_free(&task->stacks);
+  anscheduler_vm_root_free(task->vm);
+  anscheduler_slab_free(task);
+}
+
+static void _inherit_settings(task_t * parent, task_t * child) {
+  if (parent->group) anscheduler_group_join(child, parent->group);
+  anscheduler_task_mem_limit(child, parent->memLimit);
+}
+
+static bool _clone_address_space(task_t * parent,
+                                 task_t ** children,
+                                 uint64_t count) {
+  fork_info_t info;
+  info.parent = parent;
+  info.children = children;
+  info.count = count;
+  bool (* fn)(void *, uint64_t, uint64_t, uint16_t);
+  fn = (bool (*)(void *, uint64_t, uint64_t, uint16_t))_fork_page;
+  
   uint64_t i;
-  for (i = 0; i < 0x400; i++) {
-    uint64_t flags = ANSCHEDULER_PAGE_FLAG_PRESENT
-      | ANSCHEDULER_PAGE_FLAG_WRITE
-      | ANSCHEDULER_PAGE_FLAG_GLOBAL;
-    if (!anscheduler_vm_map(task->vm, i, i, flags)) return false;
+  for (i = 0; i < count; i++) {
+    children[i]->hasSharedFrames = 1;
+  }
+  
+  anscheduler_lock(&parent->vmLock);
+  parent->hasSharedFrames = 1;
+  bool result = anscheduler_vm_walk(parent->vm,
+                                    ANSCHEDULER_TASK_CODE_PAGE,
+                                    ANSCHEDULER_TASK_KERN_STACKS_PAGE,
+                                    fn, &info);
+  if (result) {
+    result = anscheduler_vm_walk(parent->vm,
+                                 ANSCHEDULER_TASK_DATA_PAGE,
+                                 ANSCHEDULER_TASK_END_PAGE,
+                                 fn, &info);
+  }
+  anscheduler_unlock(&parent->vmLock);
+  
+  // the parent may have cached writable entries for pages which are now COW
+  anscheduler_cpu_notify_invlpg(parent);
+  return result;
+}
+
+static bool _fork_page(fork_info_t * info,
+                       uint64_t vpage,
+                       uint64_t entry,
+                       uint16_t flags) {
+  if (!(flags & ANSCHEDULER_PAGE_FLAG_USER)) return true;
+  
+  uint64_t i;
+  if (flags & ANSCHEDULER_PAGE_FLAG_PRESENT) {
+    if (flags & (ANSCHEDULER_PAGE_FLAG_WRITE | ANSCHEDULER_PAGE_FLAG_COW)) {
+      flags &= ~ANSCHEDULER_PAGE_FLAG_WRITE;
+      flags |= ANSCHEDULER_PAGE_FLAG_COW;
+      // the page table already exists, so this cannot fail
+      anscheduler_vm_map(info->parent->vm, vpage, entry, flags);
+    }
+    if (!anscheduler_frame_share(entry, info->count)) return false;
+    for (i = 0; i < info->count; i++) {
+      if (!anscheduler_vm_map(info->children[i]->vm, vpage, entry, flags)) {
+        // give back the references which no child took
+        for (; i < info->count; i++) anscheduler_frame_release(entry, NULL);
+        return false;
+      }
+    }
+  } else if ((flags & ANSCHEDULER_PAGE_FLAG_UNALLOC) && !entry) {
+    // lazily allocated pages are simply allocated lazily in every task
+    for (i = 0; i < info->count; i++) {
+      if (!anscheduler_vm_map(info->children[i]->vm, vpage, 0, flags)) {
+        return false;
+      }
+    }
   }
   return true;
 }
 
+static void _release_frames(task_t * task) {
+  // frames we were charged for are tracked even if they were never shared
+  if (!task->hasSharedFrames && !task->mem.user) return;
+  bool (* fn)(void *, uint64_t, uint64_t, uint16_t);
+  fn = (bool (*)(void *, uint64_t, uint64_t, uint16_t))_release_page;
+  
+  anscheduler_lock(&task->vmLock);
+  anscheduler_vm_walk(task->vm, ANSCHEDULER_TASK_CODE_PAGE,
+                      ANSCHEDULER_TASK_KERN_STACKS_PAGE, fn, task);
+  anscheduler_vm_walk(task->vm, ANSCHEDULER_TASK_DATA_PAGE,
+                      ANSCHEDULER_TASK_END_PAGE, fn, task);
+  anscheduler_unlock(&task->vmLock);
+}
+
+static bool _release_page(task_t * task,
+                          uint64_t vpage,
+                          uint64_t entry,
+                          uint16_t flags) {
+  uint16_t mask = ANSCHEDULER_PAGE_FLAG_PRESENT | ANSCHEDULER_PAGE_FLAG_USER;
+  if ((flags & mask) != mask) return true;
+  if (!anscheduler_frame_release(entry, task)) {
+    anscheduler_vm_unmap(task->vm, vpage);
+  }
+  return true;
+}
+
+static void _collect_stats(stats_info_t * info, task_t * task) {
+  task_stats_t * stats = &info->stats[info->count++];
+  stats->pid = task->pid;
+  stats->threadCount = task->threadCount;
+  stats->refCount = task->refCount;
+  stats->socketCount = task->socketCount;
+  stats->cpuTime = task->cpuTime;
+}
+
 static void _generate_kill_job(task_t * task) {
   // Note: By the time we get here, we know nothing is running our task and
   // nothing will ever run it again.  The loop may attempt to reference
@@ -181,31 +510,44 @@ static void _generate_kill_job(task_t * task) {
     thread = thread->next;
   }
   
-  // Generate a kernel thread and pass it our task.
-  anscheduler_loop_push_kernel(task, (void (*)(void *))_free_task_method);
+  // The reaper will close the task's sockets and then free it.
+  anscheduler_reaper_push(task);
 }
 
-static void _free_task_method(task_t * task) {
-  anscheduler_cpu_lock();
-  anscheduler_pidmap_unset(task);
-  anscheduler_cpu_unlock();
-  
-  // wait for each socket to die so that we know nothing references the task
-  _close_task_sockets_async(task);
-  
+void anscheduler_task_free(task_t * task) {
   // free each thread and all its resources
   while (task->firstThread) {
     thread_t * thread = task->firstThread;
     task->firstThread = thread->next;
+    anscheduler_cpu_lock();
+    anscheduler_futex_cancel(thread);
+    anscheduler_cpu_unlock();
     anscheduler_thread_deallocate(task, thread);
     anscheduler_cpu_lock();
-    void * stack = anscheduler_thread_kernel_stack(task, thread);
-    anscheduler_free(stack);
-    anscheduler_free(thread);
+    anscheduler_thread_free_kernel_stack(task, thread);
+    anscheduler_fpu_release(thread);
+    anscheduler_stackrange_free(task, thread->stackRange);
+    anscheduler_slab_free(thread);
     anscheduler_cpu_unlock();
   }
   
+  anscheduler_thread_free_cache(task);
+  
+  // joinable threads which exited only have their structures left
+  anscheduler_cpu_lock();
+  while (task->firstZombie) {
+    thread_t * thread = task->firstZombie;
+    task->firstZombie = thread->next;
+    anscheduler_stackrange_free(task, thread->stackRange);
+    anscheduler_slab_free(thread);
+  }
+  anscheduler_stackrange_cleanup(task);
+  anscheduler_cpu_unlock();
+  
   anscheduler_task_cleanup(task);
+  anscheduler_cpu_lock();
+  _release_frames(task);
+  anscheduler_cpu_unlock();
   anscheduler_vm_root_free_async(task->vm);
   
   anscheduler_cpu_lock();
@@ -215,47 +557,8 @@ static void _free_task_method(task_t * task) {
   anidxset_free(&task->descriptors);
   
   anscheduler_pidmap_free_pid(task->pid);
-  anscheduler_free(task);
-  
-  anscheduler_loop_delete_cur_kernel();
-}
-
-static void _close_task_sockets_async(task_t * task) {
-  anscheduler_cpu_lock();
-  thread_t * thread = anscheduler_cpu_get_thread();
-  
-  int i;
-  for (i = 0; i < 0x10; i++) {
-    // free each socket with this descriptor hash (i is the hash, btw)
-    while (1) {
-      // reference the first socket
-      anscheduler_lock(&task->socketsLock);
-      socket_desc_t * desc = task->sockets[i];
-      if (desc) {
-        desc = (anscheduler_socket_reference(desc) ? desc : NULL);
-      }
-      anscheduler_unlock(&task->socketsLock);
-      
-      // break if there *is* no first socket
-      if (!desc) break;
-      
-      // close the socket and wait for it to disappear from the list
-      anscheduler_socket_close(desc, 1 | (task->killReason << 1));
-      anscheduler_socket_dereference(desc);
-      while (1) {
-        // we know another socket in the sockets[] array won't be the address
-        // of desc even though desc may be free'd, because if it's re-used
-        // it'll have to be re-used for some *other* task! 
-        anscheduler_lock(&task->socketsLock);
-        if (task->sockets[i] != desc) {
-          anscheduler_unlock(&task->socketsLock);
-          break;
-        }
-        anscheduler_save_return_state(thread, NULL, _resign_continuation);
-      }
-    }
-  }
-  
+  if (task->group) anscheduler_group_dereference(task->group);
+  anscheduler_slab_free(task);
   anscheduler_cpu_unlock();
 }
 
@@ -267,7 +570,3 @@ static void _task_exit(void * codeVal) {
   anscheduler_task_dereference(task);
   anscheduler_loop_run();
 }
-
-static void _resign_continuation(void * unused) {
-  anscheduler_loop_resign();
-}
@@ -4,6 +4,28 @@
 #include <anscheduler/loop.h>
 #include <anscheduler/interrupts.h>
 #include <anscheduler/paging.h>
+#include <anscheduler/fpu.h>
+#include "slab.h"
+#include "stackpool.h"
+#include "stackrange.h"
+
+// stack pages looked up at a time while tearing down a user stack
+#define THREAD_GATHER_SIZE 0x40
+
+// frames held by one page of a frame list; the first entry links the pages
+#define THREAD_LIST_SIZE 0x1ff
+
+/**
+ * The frames of a user stack which are waiting for a TLB shootdown before
+ * they can be freed. The first THREAD_GATHER_SIZE frames are kept in
+ * `frames`, and the rest go in pages allocated as needed.
+ */
+typedef struct {
+  uint64_t count;
+  uint64_t frames[THREAD_GATHER_SIZE];
+  uint64_t * list; // the newest list page
+  uint64_t listCount; // frames in the newest list page
+} frame_list_t;
 
 /**
  * @critical
@@ -16,9 +38,41 @@ bool _alloc_kernel_stack(task_t * task, thread_t * thread);
 bool _map_user_stack(task_t * task, thread_t * thread);
 
 /**
+ * Unmaps the user stack pages from `offset` onward, stopping early if a
+ * frame list page cannot be allocated.
+ * @return The offset at which unmapping stopped.
+ * @critical Must be called with the task's vmLock held.
+ */
+static uint64_t _unmap_user_stack(task_t * task,
+                                  thread_t * thread,
+                                  uint64_t offset,
+                                  frame_list_t * list);
+
+/**
+ * Adds a frame to a frame list.
+ * @return false if a list page could not be allocated.
+ * @critical
+ */
+static bool _frame_list_push(frame_list_t * list, uint64_t frame);
+
+/**
+ * Frees every frame in a frame list and its list pages, uncharging the
+ * frames from the task's stack usage.
+ * @critical
+ */
+static void _frame_list_free(task_t * task, frame_list_t * list);
+
+/**
+ * @return The first page of the thread's user stack.
  * @critical
  */
-void _dealloc_kernel_stack(task_t * task, thread_t * thread);
+static uint64_t _user_stack_start(thread_t * thread);
+
+/**
+ * @return The first page of the thread's kernel stack.
+ * @critical
+ */
+static uint64_t _kernel_stack_start(thread_t * thread);
 
 /**
  * Call from the CPU dedicated stack while the CPU is registered as running
@@ -27,48 +81,108 @@ void _dealloc_kernel_stack(task_t * task, thread_t * thread);
  */
 void _finalize_thread_exit(thread_t * thread);
 
+/**
+ * Appends the thread to its task's waiter queue unless it is already in it.
+ * @critical Must be called with the task's pendingLock held.
+ */
+static void _push_waiter(task_t * task, thread_t * thread);
+
+/**
+ * Takes the thread out of its task's waiter queue if it is in it.
+ * @critical Must be called with the task's pendingLock held.
+ */
+static void _remove_waiter(task_t * task, thread_t * thread);
+
+/**
+ * Run right after the joining thread's state has been saved.
+ * @critical
+ */
+static void _join_continuation(thread_t * target);
+
+/**
+ * Puts the joining thread to sleep unless the target has exited already.
+ * @critical Run from the CPU dedicated stack.
+ */
+static void _join_block(thread_t * target);
+
+/**
+ * Takes a thread with matching stack sizes out of the task's thread cache and
+ * resets it.
+ * @return The thread, or NULL if none matched.
+ * @critical
+ */
+static thread_t * _take_cached(task_t * task, const thread_attr_t * attr);
+
+/**
+ * Gives back the thread's stack index and its range of the user stacks
+ * region.
+ * @critical
+ */
+static void _release_stacks(task_t * task, thread_t * thread);
+
+/**
+ * Allocates a new thread with its stack index and stacks.
+ * @return NULL if any allocation failed, in which case nothing is leaked.
+ * @critical
+ */
+static thread_t * _alloc_thread(task_t * task, const thread_attr_t * attr);
+
 thread_t * anscheduler_thread_create(task_t * task) {
-  thread_t * thread = anscheduler_alloc(sizeof(thread_t));
-  if (!thread) return NULL;
-  
-  // allocate a stack index and make sure we didn't go over the thread max
-  anscheduler_lock(&task->stacksLock);
-  uint64_t stack = anidxset_get(&task->stacks);
-  anscheduler_unlock(&task->stacksLock);
-  if (stack >= 0x100000) {
-    // we should not put it back in the idxset because that'll just
-    // contribute to the problem.
-    anscheduler_free(thread);
-    return NULL;
+  return anscheduler_thread_create_attr(task, NULL);
+}
+
+void anscheduler_thread_attr_init(thread_attr_t * attr) {
+  attr->stackPages = ANSCHEDULER_THREAD_STACK_PAGES;
+  attr->guardPages = ANSCHEDULER_THREAD_GUARD_PAGES;
+  attr->kernPages = ANSCHEDULER_THREAD_KERN_PAGES;
+  attr->isJoinable = 0;
+  attr->prefaultPages = 0;
+  attr->faultPages = ANSCHEDULER_THREAD_FAULT_PAGES;
+}
+
+thread_t * anscheduler_thread_create_attr(task_t * task,
+                                          const thread_attr_t * attr) {
+  thread_attr_t defaults;
+  if (!attr) {
+    anscheduler_thread_attr_init(&defaults);
+    attr = &defaults;
   }
-  
-  // setup the thread structure
-  anscheduler_zero(thread, sizeof(thread_t));
-  thread->task = task;
-  thread->stack = stack;
-  
-  if (!_alloc_kernel_stack(task, thread)) {
-    anscheduler_lock(&task->stacksLock);
-    anidxset_put(&task->stacks, stack);
-    anscheduler_unlock(&task->stacksLock);
-    anscheduler_free(thread);
+  uint64_t stackPages = attr->stackPages;
+  uint64_t guardPages = attr->guardPages;
+  if (!stackPages || stackPages > ANSCHEDULER_THREAD_STACK_MAX
+      || guardPages > ANSCHEDULER_THREAD_STACK_MAX - stackPages) {
     return NULL;
   }
-  
-  // map the user stack
-  if (!_map_user_stack(task, thread)) {
-    _dealloc_kernel_stack(task, thread);
-    anscheduler_lock(&task->stacksLock);
-    anidxset_put(&task->stacks, stack);
-    anscheduler_unlock(&task->stacksLock);
-    anscheduler_free(thread);
+  if (!attr->kernPages || attr->kernPages >= ANSCHEDULER_THREAD_KERN_SLOT) {
     return NULL;
   }
   
+  if (attr->prefaultPages > stackPages) return NULL;
+  
+  thread_t * thread = _take_cached(task, attr);
+  if (!thread) thread = _alloc_thread(task, attr);
+  if (!thread) return NULL;
+  thread->faultPages = attr->faultPages;
+  
+  if (attr->prefaultPages) {
+    // allocate the top of the stack now instead of faulting it in
+    uint64_t top = _user_stack_start(thread) + stackPages;
+    anscheduler_lock(&task->vmLock);
+    anscheduler_page_populate(task, top - attr->prefaultPages,
+                              attr->prefaultPages);
+    anscheduler_unlock(&task->vmLock);
+  }
   return thread;
 }
 
 void anscheduler_thread_add(task_t * task, thread_t * thread) {
+  anscheduler_thread_link(task, thread);
+  
+  // add the thread to the queue
+  anscheduler_loop_push(thread);
+}
+
+void anscheduler_thread_link(task_t * task, thread_t * thread) {
   // add the thread to the task's linked list
   anscheduler_lock(&task->threadsLock);
   thread_t * next = task->firstThread;
@@ -76,10 +190,8 @@ void anscheduler_thread_add(task_t * task, thread_t * thread) {
   task->firstThread = thread;
   thread->last = NULL;
   thread->next = next;
+  task->threadCount++;
   anscheduler_unlock(&task->threadsLock);
-  
-  // add the thread to the queue
-  anscheduler_loop_push(thread);
 }
 
 bool anscheduler_thread_poll() {
@@ -99,6 +211,7 @@ bool anscheduler_thread_poll() {
     anscheduler_intd_lock();
     if (!anscheduler_intd_waiting()) {
       thread->isPolling = 1;
+      _push_waiter(task, thread);
       anscheduler_intd_unlock();
       anscheduler_unlock(&task->pendingLock);
       return true;
@@ -108,6 +221,7 @@ bool anscheduler_thread_poll() {
     anscheduler_pager_lock();
     if (!anscheduler_pager_waiting()) {
       thread->isPolling = 1;
+      _push_waiter(task, thread);
       anscheduler_pager_unlock();
       anscheduler_unlock(&task->pendingLock);
       return true;
@@ -115,6 +229,7 @@ bool anscheduler_thread_poll() {
     anscheduler_pager_unlock();
   } else {
     thread->isPolling = 1;
+    _push_waiter(task, thread);
     anscheduler_unlock(&task->pendingLock);
     return true;
   }
@@ -123,13 +238,38 @@ bool anscheduler_thread_poll() {
   return false;
 }
 
-void anscheduler_thread_exit() {
+thread_t * anscheduler_thread_pop_waiter(task_t * task) {
+  anscheduler_lock(&task->pendingLock);
+  thread_t * thread = task->firstWaiter;
+  while (thread) {
+    _remove_waiter(task, thread);
+    if (__sync_fetch_and_and(&thread->isPolling, 0)) {
+      anscheduler_unlock(&task->pendingLock);
+      return thread;
+    }
+    thread = task->firstWaiter;
+  }
+  anscheduler_unlock(&task->pendingLock);
+  return NULL;
+}
+
+void anscheduler_thread_exit(uint64_t code) {
   anscheduler_cpu_lock();
   task_t * task = anscheduler_cpu_get_task();
   thread_t * thread = anscheduler_cpu_get_thread();
+  thread->exitCode = code;
+  
+  // reserve a place in the cache so that we can keep our user stack
+  anscheduler_lock(&task->threadsLock);
+  if (!thread->isJoinable
+      && task->cachedCount < ANSCHEDULER_THREAD_CACHE_SIZE) {
+    task->cachedCount++;
+    thread->isCached = 1;
+  }
+  anscheduler_unlock(&task->threadsLock);
   anscheduler_cpu_unlock();
   
-  anscheduler_thread_deallocate(task, thread);
+  if (!thread->isCached) anscheduler_thread_deallocate(task, thread);
   
   // jump to the CPU stack in order to schedule another task and push a
   // kernel thread for the final dealloc stages.
@@ -137,98 +277,151 @@ void anscheduler_thread_exit() {
   anscheduler_cpu_stack_run(thread, (void (*)(void *))_finalize_thread_exit);
 }
 
-void anscheduler_thread_deallocate(task_t * task, thread_t * thread) {
-  anscheduler_cpu_lock();
-  anscheduler_intd_cmpnull(thread);
-  anscheduler_cpu_unlock();
+bool anscheduler_thread_join(thread_t * target, uint64_t * code) {
+  task_t * task = anscheduler_cpu_get_task();
+  thread_t * thread = anscheduler_cpu_get_thread();
+  if (target == thread || target->task != task) return false;
   
-  uint64_t i;
-  uint64_t firstPage = ANSCHEDULER_TASK_USER_STACKS_PAGE
-    + (thread->stack << 8);
+  anscheduler_lock(&task->threadsLock);
+  if (!target->isJoinable || target->joiner) {
+    anscheduler_unlock(&task->threadsLock);
+    return false;
+  }
+  target->joiner = thread;
+  
+  // anything which clears isPolling can wake us, so check again every time
+  while (!target->hasExited) {
+    anscheduler_unlock(&task->threadsLock);
+    anscheduler_save_return_state(thread, target,
+                                  (void (*)(void *))_join_continuation);
+    anscheduler_lock(&task->threadsLock);
+  }
   
-  // unmap all the memory
-  for (i = 0; i < 0x100; i++) {
-    uint64_t page = firstPage + i;
+  // unlink the thread from the zombie list
+  if (!target->last) {
+    task->firstZombie = target->next;
+    if (target->next) target->next->last = NULL;
+  } else {
+    target->last->next = target->next;
+    if (target->next) target->next->last = target->last;
+  }
+  anscheduler_unlock(&task->threadsLock);
+  
+  (*code) = target->exitCode;
+  _release_stacks(task, target);
+  anscheduler_slab_free(target);
+  return true;
+}
+
+void anscheduler_thread_free_cache(task_t * task) {
+  while (task->firstCached) {
+    thread_t * thread = task->firstCached;
+    task->firstCached = thread->next;
+    anscheduler_thread_deallocate(task, thread);
     anscheduler_cpu_lock();
-    anscheduler_lock(&task->vmLock);
-    uint16_t flags;
-    uint64_t phyPage = anscheduler_vm_lookup(task->vm, page, &flags);
-    if (flags & ANSCHEDULER_PAGE_FLAG_PRESENT) {
-      flags ^= ANSCHEDULER_PAGE_FLAG_PRESENT;
-      flags |= ANSCHEDULER_PAGE_FLAG_UNALLOC;
-      // if UNALLOC is set but page != 0, then it needs to be free'd next
-      anscheduler_vm_map(task->vm, page, phyPage, flags);
-    } else if (flags && !page) {
-      // the memory was never allocated to begin with
-      anscheduler_vm_unmap(task->vm, page);
-    }
-    anscheduler_unlock(&task->vmLock);
+    anscheduler_thread_free_kernel_stack(task, thread);
+    anscheduler_stackrange_free(task, thread->stackRange);
+    anscheduler_slab_free(thread);
     anscheduler_cpu_unlock();
   }
-  
-  // make sure no running instance will be able to access the memory anymore
+}
+
+void anscheduler_thread_deallocate(task_t * task, thread_t * thread) {
   anscheduler_cpu_lock();
-  anscheduler_cpu_notify_invlpg(task);
-  anscheduler_cpu_unlock();
+  anscheduler_intd_cmpnull(thread);
   
-  // free all the memory
-  for (i = 0; i < 0x100; i++) {
-    uint64_t page = firstPage + i;
-    anscheduler_cpu_lock();
+  // The whole stack is unmapped before a single TLB shootdown, and only then
+  // are its frames freed. If memory for the frame list runs out, the part
+  // which has been unmapped so far gets its own shootdown.
+  uint64_t offset = 0;
+  while (offset < thread->stackPages) {
+    frame_list_t list;
+    list.count = 0;
+    list.list = NULL;
     anscheduler_lock(&task->vmLock);
-    uint16_t flags;
-    uint64_t phyPage = anscheduler_vm_lookup(task->vm, page, &flags);
-    if (phyPage || flags) {
-      anscheduler_vm_unmap(task->vm, page);
-    }
+    offset = _unmap_user_stack(task, thread, offset, &list);
     anscheduler_unlock(&task->vmLock);
-    if (phyPage && (flags & ANSCHEDULER_PAGE_FLAG_UNALLOC)) {
-      uint64_t virPage = anscheduler_vm_virtual(phyPage);
-      anscheduler_free((void *)(virPage << 12));
+    if (list.count) {
+      anscheduler_cpu_notify_invlpg(task);
+      _frame_list_free(task, &list);
     }
-    anscheduler_cpu_unlock();
   }
+  anscheduler_cpu_unlock();
 }
 
-void * anscheduler_thread_kernel_stack(task_t * task, thread_t * thread) {
-  uint64_t vPage = ANSCHEDULER_TASK_KERN_STACKS_PAGE + thread->stack;
+void anscheduler_thread_free_kernel_stack(task_t * task, thread_t * thread) {
+  uint64_t entries[ANSCHEDULER_THREAD_KERN_SLOT];
+  uint16_t flags[ANSCHEDULER_THREAD_KERN_SLOT];
+  void * pages[ANSCHEDULER_THREAD_KERN_SLOT];
+  uint64_t start = _kernel_stack_start(thread);
+  
   anscheduler_lock(&task->vmLock);
-  uint16_t flags;
-  uint64_t entry = anscheduler_vm_lookup(task->vm, vPage, &flags);
+  anscheduler_vm_lookup_range(task->vm, start, thread->kernPages,
+                              entries, flags);
+  anscheduler_vm_unmap_range(task->vm, start, thread->kernPages);
   anscheduler_unlock(&task->vmLock);
   
-  if (flags & ANSCHEDULER_PAGE_FLAG_PRESENT) {
-    return (void *)(anscheduler_vm_virtual(entry) << 12);
+  uint64_t i, count = 0;
+  for (i = 0; i < thread->kernPages; i++) {
+    if (!(flags[i] & ANSCHEDULER_PAGE_FLAG_PRESENT)) continue;
+    uint64_t virPage = anscheduler_vm_virtual(entries[i]);
+    pages[count++] = (void *)(virPage << 12);
   }
-  return NULL;
+  if (!count) return;
+  
+  // the pool may hand the pages to any task, so no TLB may still map them
+  anscheduler_cpu_notify_invlpg(task);
+  anscheduler_stackpool_free(pages, count);
+  anscheduler_task_mem_uncharge(task, &task->mem.kernStack, count);
 }
 
 void * anscheduler_thread_interrupt_stack(thread_t * thread) {
-  uint64_t page = thread->stack + ANSCHEDULER_TASK_KERN_STACKS_PAGE;
-  return (void *)((page + 1) << 12);
+  uint64_t page = _kernel_stack_start(thread) + thread->kernPages;
+  return (void *)(page << 12);
 }
 
 void * anscheduler_thread_user_stack(thread_t * thread) {
-  uint64_t page = (thread->stack << 8) + ANSCHEDULER_TASK_USER_STACKS_PAGE;
-  return (void *)((page + 0x100) << 12);
+  uint64_t page = _user_stack_start(thread) + thread->stackPages;
+  return (void *)(page << 12);
+}
+
+bool anscheduler_thread_in_guard(thread_t * thread, uint64_t page) {
+  uint64_t start = _user_stack_start(thread);
+  return page < start && page >= start - thread->guardPages;
+}
+
+bool anscheduler_thread_in_kernel_guard(thread_t * thread, uint64_t page) {
+  return page == _kernel_stack_start(thread) - 1;
 }
 
 bool _alloc_kernel_stack(task_t * task, thread_t * thread) {
-  // allocate the kernel stack
-  void * buffer = anscheduler_alloc(0x1000);
-  if (!buffer) return false;
+  uint64_t count = thread->kernPages;
+  if (!anscheduler_task_mem_charge(task, &task->mem.kernStack, count, false)) {
+    return false;
+  }
+  void * pages[ANSCHEDULER_THREAD_KERN_SLOT];
+  if (!anscheduler_stackpool_alloc(pages, count)) {
+    anscheduler_task_mem_uncharge(task, &task->mem.kernStack, count);
+    return false;
+  }
   
-  // map the kernel stack
-  uint64_t kPage = ANSCHEDULER_TASK_KERN_STACKS_PAGE + thread->stack;
-  uint64_t phyPage = anscheduler_vm_physical(((uint64_t)buffer) >> 12);
+  // map the kernel stack above its guard page
+  uint64_t start = _kernel_stack_start(thread);
   uint16_t flags = ANSCHEDULER_PAGE_FLAG_PRESENT
     | ANSCHEDULER_PAGE_FLAG_WRITE;
   
+  uint64_t i;
   anscheduler_lock(&task->vmLock);
-  if (!anscheduler_vm_map(task->vm, kPage, phyPage, flags)) {
-    anscheduler_unlock(&task->vmLock);
-    anscheduler_free(buffer);
-    return false;
+  for (i = 0; i < count; i++) {
+    uint64_t phyPage = anscheduler_vm_physical(((uint64_t)pages[i]) >> 12);
+    if (!anscheduler_vm_map(task->vm, start + i, phyPage, flags)) {
+      anscheduler_vm_unmap_range(task->vm, start, i);
+      anscheduler_unlock(&task->vmLock);
+      anscheduler_cpu_notify_invlpg(task);
+      anscheduler_stackpool_free(pages, count);
+      anscheduler_task_mem_uncharge(task, &task->mem.kernStack, count);
+      return false;
+    }
   }
   anscheduler_unlock(&task->vmLock);
   return true;
@@ -239,44 +432,95 @@ bool _map_user_stack(task_t * task, thread_t * thread) {
   uint64_t flags = ANSCHEDULER_PAGE_FLAG_UNALLOC
     | ANSCHEDULER_PAGE_FLAG_USER
     | ANSCHEDULER_PAGE_FLAG_WRITE;
-  uint64_t start = ANSCHEDULER_TASK_USER_STACKS_PAGE + (thread->stack << 8);
+  uint64_t start = _user_stack_start(thread);
   
-  uint64_t i;
+  // the guard pages are left unmapped so that touching them always faults
   anscheduler_lock(&task->vmLock);
-  
-  for (i = 0; i < 0x100; i++) {
-    uint64_t page = i + start;
-    if (!anscheduler_vm_map(task->vm, page, 0, flags)) {
-      // unmap all that we have mapped so far
-      uint64_t j = 0;
-      for (j = 0; j < i; j++) {
-        page = j + start;
-        anscheduler_vm_unmap(task->vm, page);
+  if (!anscheduler_vm_map_range(task->vm, start, thread->stackPages,
+                                0, 0, flags)) {
+    anscheduler_vm_unmap_range(task->vm, start, thread->stackPages);
+    anscheduler_unlock(&task->vmLock);
+    return false;
+  }
+  anscheduler_unlock(&task->vmLock);
+  return true;
+}
+
+static uint64_t _unmap_user_stack(task_t * task,
+                                  thread_t * thread,
+                                  uint64_t offset,
+                                  frame_list_t * list) {
+  uint64_t firstPage = _user_stack_start(thread);
+  uint64_t entries[THREAD_GATHER_SIZE];
+  uint16_t flags[THREAD_GATHER_SIZE];
+  uint64_t end = offset, i;
+  while (end < thread->stackPages) {
+    uint64_t count = thread->stackPages - end;
+    if (count > THREAD_GATHER_SIZE) count = THREAD_GATHER_SIZE;
+    anscheduler_vm_lookup_range(task->vm, firstPage + end, count,
+                                entries, flags);
+    for (i = 0; i < count; i++) {
+      if (!(flags[i] & ANSCHEDULER_PAGE_FLAG_PRESENT) || !entries[i]) {
+        continue;
       }
-      anscheduler_unlock(&task->vmLock);
-      return false;
+      if (!_frame_list_push(list, entries[i])) break;
     }
+    end += i;
+    if (i < count) break;
   }
-  
-  anscheduler_unlock(&task->vmLock);
+  anscheduler_vm_unmap_range(task->vm, firstPage + offset, end - offset);
+  return end;
+}
+
+static bool _frame_list_push(frame_list_t * list, uint64_t frame) {
+  if (list->count < THREAD_GATHER_SIZE) {
+    list->frames[list->count++] = frame;
+    return true;
+  }
+  if (!list->list || list->listCount == THREAD_LIST_SIZE) {
+    uint64_t * page = anscheduler_alloc(0x1000);
+    if (!page) return false;
+    page[0] = (uint64_t)list->list;
+    list->list = page;
+    list->listCount = 0;
+  }
+  list->list[1 + list->listCount++] = frame;
+  list->count++;
   return true;
 }
 
-void _dealloc_kernel_stack(task_t * task, thread_t * thread) {
-  // get the phyPage and unmap it
-  uint64_t page = ANSCHEDULER_TASK_KERN_STACKS_PAGE + thread->stack;
-  anscheduler_lock(&task->vmLock);
-  uint16_t flags;
-  uint64_t phyPage = anscheduler_vm_lookup(task->vm, page, &flags);
-  if (flags & ANSCHEDULER_PAGE_FLAG_PRESENT) {
-    anscheduler_vm_unmap(task->vm, page);
+static void _frame_list_free(task_t * task, frame_list_t * list) {
+  uint64_t i, count = list->count;
+  if (count > THREAD_GATHER_SIZE) count = THREAD_GATHER_SIZE;
+  for (i = 0; i < count; i++) {
+    uint64_t virPage = anscheduler_vm_virtual(list->frames[i]);
+    anscheduler_free((void *)(virPage << 12));
   }
-  anscheduler_unlock(&task->vmLock);
   
-  if (flags & ANSCHEDULER_PAGE_FLAG_PRESENT) {
-    uint64_t virPage = anscheduler_vm_virtual(phyPage);
-    anscheduler_free((void *)(virPage << 12));
+  // only the newest list page may be partly full
+  uint64_t * page = list->list;
+  count = list->listCount;
+  while (page) {
+    for (i = 0; i < count; i++) {
+      uint64_t virPage = anscheduler_vm_virtual(page[1 + i]);
+      anscheduler_free((void *)(virPage << 12));
+    }
+    uint64_t * next = (uint64_t *)page[0];
+    anscheduler_free(page);
+    page = next;
+    count = THREAD_LIST_SIZE;
   }
+  anscheduler_task_mem_uncharge(task, &task->mem.stack, list->count);
+}
+
+static uint64_t _user_stack_start(thread_t * thread) {
+  return thread->stackRange->page + thread->guardPages;
+}
+
+static uint64_t _kernel_stack_start(thread_t * thread) {
+  uint64_t slotEnd = ANSCHEDULER_TASK_KERN_STACKS_PAGE
+    + (thread->stack + 1) * ANSCHEDULER_THREAD_KERN_SLOT;
+  return slotEnd - thread->kernPages;
 }
 
 void _finalize_thread_exit(thread_t * thread) {
@@ -285,6 +529,13 @@ void _finalize_thread_exit(thread_t * thread) {
   
   task_t * task = thread->task;
   
+  // the thread may have been woken without being popped from the queue
+  anscheduler_lock(&task->pendingLock);
+  _remove_waiter(task, thread);
+  anscheduler_unlock(&task->pendingLock);
+  anscheduler_fpu_release(thread);
+  if (!thread->isCached) anscheduler_thread_free_kernel_stack(task, thread);
+  
   // unlink the thread
   anscheduler_lock(&task->threadsLock);
   if (!thread->last) {
@@ -294,15 +545,30 @@ void _finalize_thread_exit(thread_t * thread) {
     if (thread->last) thread->last->next = thread->next;
     if (thread->next) thread->next->last = thread->last;
   }
-  anscheduler_unlock(&task->threadsLock);
-  
-  anscheduler_lock(&task->stacksLock);
-  anidxset_put(&task->stacks, thread->stack);
-  anscheduler_unlock(&task->stacksLock);
+  task->threadCount--;
   
-  void * stack = anscheduler_thread_kernel_stack(task, thread);
-  anscheduler_free(stack);
-  anscheduler_free(thread);
+  if (thread->isJoinable) {
+    // keep the thread structure and its stack index around for the joiner
+    thread->hasExited = 1;
+    thread->last = NULL;
+    thread->next = task->firstZombie;
+    if (task->firstZombie) task->firstZombie->last = thread;
+    task->firstZombie = thread;
+    thread_t * joiner = thread->joiner;
+    anscheduler_unlock(&task->threadsLock);
+    if (joiner && __sync_fetch_and_and(&joiner->isPolling, 0)) {
+      anscheduler_loop_push(joiner);
+    }
+  } else if (thread->isCached) {
+    thread->last = NULL;
+    thread->next = task->firstCached;
+    task->firstCached = thread;
+    anscheduler_unlock(&task->threadsLock);
+  } else {
+    anscheduler_unlock(&task->threadsLock);
+    _release_stacks(task, thread);
+    anscheduler_slab_free(thread);
+  }
   
   anscheduler_task_dereference(task);
   
@@ -311,3 +577,130 @@ void _finalize_thread_exit(thread_t * thread) {
   // referenced, so that our kernel thread won't get screwed over.
   anscheduler_loop_run();
 }
+
+static void _push_waiter(task_t * task, thread_t * thread) {
+  if (thread->waitLast || task->firstWaiter == thread) return;
+  thread->waitNext = NULL;
+  thread->waitLast = task->lastWaiter;
+  if (task->lastWaiter) task->lastWaiter->waitNext = thread;
+  else task->firstWaiter = thread;
+  task->lastWaiter = thread;
+}
+
+static void _remove_waiter(task_t * task, thread_t * thread) {
+  if (!thread->waitLast && task->firstWaiter != thread) return;
+  if (thread->waitLast) thread->waitLast->waitNext = thread->waitNext;
+  else task->firstWaiter = thread->waitNext;
+  if (thread->waitNext) thread->waitNext->waitLast = thread->waitLast;
+  else task->lastWaiter = thread->waitLast;
+  thread->waitNext = (thread->waitLast = NULL);
+}
+
+static void _join_continuation(thread_t * target) {
+  // get off of the thread's stack before the target can wake it up
+  anscheduler_cpu_stack_run(target, (void (*)(void *))_join_block);
+}
+
+static void _join_block(thread_t * target) {
+  task_t * task = target->task;
+  thread_t * thread = anscheduler_cpu_get_thread();
+  anscheduler_lock(&task->threadsLock);
+  if (target->hasExited) {
+    anscheduler_unlock(&task->threadsLock);
+    anscheduler_thread_run(task, thread);
+  }
+  thread->isPolling = 1;
+  anscheduler_unlock(&task->threadsLock);
+  anscheduler_loop_run();
+}
+
+static thread_t * _take_cached(task_t * task, const thread_attr_t * attr) {
+  anscheduler_lock(&task->threadsLock);
+  thread_t * thread = task->firstCached, * last = NULL;
+  while (thread) {
+    if (thread->stackPages == attr->stackPages
+        && thread->guardPages == attr->guardPages
+        && thread->kernPages == attr->kernPages) {
+      if (last) last->next = thread->next;
+      else task->firstCached = thread->next;
+      task->cachedCount--;
+      break;
+    }
+    last = thread;
+    thread = thread->next;
+  }
+  anscheduler_unlock(&task->threadsLock);
+  if (!thread) return NULL;
+  
+  // everything but the stacks starts over
+  uint64_t stack = thread->stack;
+  stack_range_t * range = thread->stackRange;
+  anscheduler_zero(thread, sizeof(thread_t));
+  thread->task = task;
+  thread->stack = stack;
+  thread->stackRange = range;
+  thread->stackPages = attr->stackPages;
+  thread->guardPages = attr->guardPages;
+  thread->kernPages = attr->kernPages;
+  thread->isJoinable = attr->isJoinable;
+  return thread;
+}
+
+static thread_t * _alloc_thread(task_t * task, const thread_attr_t * attr) {
+  thread_t * thread = anscheduler_slab_alloc(sizeof(thread_t));
+  if (!thread) return NULL;
+  
+  // allocate a stack index and make sure we didn't go over the thread max
+  anscheduler_lock(&task->stacksLock);
+  uint64_t stack = anidxset_get(&task->stacks);
+  anscheduler_unlock(&task->stacksLock);
+  if (stack >= ANSCHEDULER_THREAD_MAX) {
+    // we should not put it back in the idxset because that'll just
+    // contribute to the problem.
+    anscheduler_slab_free(thread);
+    return NULL;
+  }
+  
+  // the guard pages and the stack get a range of their own
+  uint64_t pages = attr->stackPages + attr->guardPages;
+  stack_range_t * range = anscheduler_stackrange_alloc(task, pages);
+  if (!range) {
+    anscheduler_lock(&task->stacksLock);
+    anidxset_put(&task->stacks, stack);
+    anscheduler_unlock(&task->stacksLock);
+    anscheduler_slab_free(thread);
+    return NULL;
+  }
+  
+  // setup the thread structure
+  thread->task = task;
+  thread->stack = stack;
+  thread->stackRange = range;
+  thread->stackPages = attr->stackPages;
+  thread->guardPages = attr->guardPages;
+  thread->kernPages = attr->kernPages;
+  thread->isJoinable = attr->isJoinable;
+  
+  if (!_alloc_kernel_stack(task, thread)) {
+    _release_stacks(task, thread);
+    anscheduler_slab_free(thread);
+    return NULL;
+  }
+  
+  // map the user stack
+  if (!_map_user_stack(task, thread)) {
+    anscheduler_thread_free_kernel_stack(task, thread);
+    _release_stacks(task, thread);
+    anscheduler_slab_free(thread);
+    return NULL;
+  }
+  
+  return thread;
+}
+
+static void _release_stacks(task_t * task, thread_t * thread) {
+  anscheduler_lock(&task->stacksLock);
+  anidxset_put(&task->stacks, thread->stack);
+  anscheduler_unlock(&task->stacksLock);
+  anscheduler_stackrange_free(task, thread->stackRange);
+}
@@ -2,8 +2,18 @@
 #include "threading.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+
+// freed pages are filled with this so that reading one after it was freed
+// yields pointers which crash instead of data which looks valid
+#define FREED_POISON 0xa5
+
+// freed pages stay poisoned for this many frees before they can be reused
+#define QUARANTINE_SIZE 0x40
 
 static uint64_t allocedPieces __attribute__((aligned(8))) = 0;
+static uint64_t quarantineNext __attribute__((aligned(8))) = 0;
+static void * quarantine[QUARANTINE_SIZE];
 
 void * anscheduler_alloc(uint64_t size) {
   assert(antest_get_current_cpu_info()->isLocked);
@@ -12,15 +22,23 @@ void * anscheduler_alloc(uint64_t size) {
   
   if (size > 0x1000) return NULL;
   
+  // always a whole page, so that anscheduler_free() can poison all of it
   void * buf;
-  posix_memalign(&buf, 0x1000, size);
+  posix_memalign(&buf, 0x1000, 0x1000);
   return buf;
 }
 
 void anscheduler_free(void * buffer) {
   assert(antest_get_current_cpu_info()->isLocked);
   __asm__ __volatile__("lock decq (%0)" : : "r" (&allocedPieces));
-  free(buffer);
+  // emulated user threads exit on the user stack which they are freeing
+  uint64_t rsp;
+  __asm__("mov %%rsp, %0" : "=r" (rsp));
+  if ((rsp & ~0xfffL) != (uint64_t)buffer) {
+    memset(buffer, FREED_POISON, 0x1000);
+  }
+  uint64_t slot = __sync_fetch_and_add(&quarantineNext, 1) % QUARANTINE_SIZE;
+  free(__sync_lock_test_and_set(&quarantine[slot], buffer));
 }
 
 uint64_t antest_pages_alloced() {
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <anlock.h>
 #include <stdlib.h>
+#include <emmintrin.h>
 
 void anscheduler_lock(uint64_t * ptr) {
   anlock_lock(ptr);
@@ -21,6 +22,34 @@ void anscheduler_zero(void * buf, int len) {
   bzero(buf, len);
 }
 
+void anscheduler_copy(void * dest, const void * source, int len) {
+  // 64 bytes per iteration with SSE2, then whatever is left a byte at a time
+  __m128i * d = (__m128i *)dest;
+  const __m128i * s = (const __m128i *)source;
+  while (len >= 0x40) {
+    __m128i a = _mm_loadu_si128(s);
+    __m128i b = _mm_loadu_si128(s + 1);
+    __m128i c = _mm_loadu_si128(s + 2);
+    __m128i e = _mm_loadu_si128(s + 3);
+    _mm_storeu_si128(d, a);
+    _mm_storeu_si128(d + 1, b);
+    _mm_storeu_si128(d + 2, c);
+    _mm_storeu_si128(d + 3, e);
+    d += 4;
+    s += 4;
+    len -= 0x40;
+  }
+  while (len >= 0x10) {
+    _mm_storeu_si128(d++, _mm_loadu_si128(s++));
+    len -= 0x10;
+  }
+  uint8_t * db = (uint8_t *)d;
+  const uint8_t * sb = (const uint8_t *)s;
+  while (len-- > 0) {
+    *(db++) = *(sb++);
+  }
+}
+
 void anscheduler_inc(uint64_t * ptr) {
   __asm__("incq (%0)" : : "r" (ptr) : "memory");
 }
@@ -48,6 +48,10 @@ void anscheduler_cpu_unlock() {
   }
 }
 
+uint64_t anscheduler_cpu_get_index() {
+  return (uint64_t)(antest_get_current_cpu_info() - cpus);
+}
+
 task_t * anscheduler_cpu_get_task() {
   return antest_get_current_cpu_info()->task;
 }
@@ -93,6 +97,32 @@ void anscheduler_cpu_halt() {
   antest_handle_timer_interrupt();
 }
 
+void anscheduler_fpu_enable() {
+  cpu->fpuEnabled = true;
+}
+
+void anscheduler_fpu_disable() {
+  // we can't make the FPU trap in user space, so tests check this flag
+  cpu->fpuEnabled = false;
+}
+
+void anscheduler_fpu_save(void * area) {
+  assert(cpu->fpuEnabled);
+  cpu->fpuSaves++;
+  __asm__ __volatile__("fxsave64 (%0)" : : "r" (area) : "memory");
+}
+
+void anscheduler_fpu_restore(const void * area) {
+  assert(cpu->fpuEnabled);
+  cpu->fpuRestores++;
+  __asm__ __volatile__("fxrstor64 (%0)" : : "r" (area) : "memory");
+}
+
+void anscheduler_fpu_init() {
+  assert(cpu->fpuEnabled);
+  __asm__ __volatile__("fninit");
+}
+
 static void * thread_enter(newthread_args * _args) {
   newthread_args args = *_args;
   free(_args);
@@ -106,6 +136,9 @@ static void * thread_enter(newthread_args * _args) {
   cpu->thread = NULL;
   cpu->nextInterrupt = 0xffffffffffffffffL;
   cpu->cpuStack = anscheduler_alloc(0x1000);
+  cpu->fpuEnabled = false;
+  cpu->fpuSaves = 0;
+  cpu->fpuRestores = 0;
   
   args.method(args.arg);
   
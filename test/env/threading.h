@@ -11,6 +11,10 @@ typedef struct {
   bool isLocked;
   uint64_t nextInterrupt;
   void * cpuStack;
+  
+  bool fpuEnabled;
+  uint64_t fpuSaves;
+  uint64_t fpuRestores;
 } cpu_info;
 
 cpu_info * antest_get_current_cpu_info();
@@ -18,6 +22,7 @@ void antest_launch_thread(void * arg, void (* method)(void *));
 
 void anscheduler_cpu_lock();
 void anscheduler_cpu_unlock();
+uint64_t anscheduler_cpu_get_index();
 task_t * anscheduler_cpu_get_task();
 thread_t * anscheduler_cpu_get_thread();
 void anscheduler_cpu_set_task(task_t * task);
@@ -26,3 +31,8 @@ void anscheduler_cpu_notify_invlpg(task_t * task);
 void anscheduler_cpu_notify_dead(task_t * task);
 void anscheduler_cpu_stack_run(void * arg, void (* fn)(void * a));
 void anscheduler_cpu_halt();
+void anscheduler_fpu_enable();
+void anscheduler_fpu_disable();
+void anscheduler_fpu_save(void * area);
+void anscheduler_fpu_restore(const void * area);
+void anscheduler_fpu_init();
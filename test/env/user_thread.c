@@ -7,6 +7,7 @@
 #include <anscheduler/interrupts.h>
 #include <anscheduler/paging.h>
 #include <anscheduler/thread.h>
+#include <anscheduler/fpu.h>
 #include <assert.h>
 
 typedef struct {
@@ -17,6 +18,7 @@ typedef struct {
 static void _user_thread_entry(void * rip);
 static void _free_old_stack(void * oldStack, void (* fn)());
 static void _page_fault_cont(void * faultInfo);
+static void _fpu_fault_cont(void * unused);
 
 void antest_configure_user_thread(thread_t * thread, void (* rip)()) {
   __asm__("pushfq\npop %0" : "=r" (thread->state.flags));
@@ -42,6 +44,11 @@ void antest_user_thread_page_fault(void * addr, bool write) {
   anscheduler_save_return_state(thread, &info, _page_fault_cont);
 }
 
+void antest_user_thread_fpu_fault() {
+  thread_t * thread = anscheduler_cpu_get_thread();
+  anscheduler_save_return_state(thread, NULL, _fpu_fault_cont);
+}
+
 void * antest_user_thread_stack_addr() {
   thread_t * thread = anscheduler_cpu_get_thread();
   return anscheduler_thread_user_stack(thread);
@@ -85,3 +92,7 @@ static void _page_fault_cont(void * faultInfo) {
   page_fault_info info = *((page_fault_info *)faultInfo);
   anscheduler_page_fault(info.addr, info.flags);
 }
+
+static void _fpu_fault_cont(void * unused) {
+  anscheduler_fpu_fault();
+}
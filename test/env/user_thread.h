@@ -16,3 +16,9 @@ void antest_user_thread_page_fault(void * addr, bool write);
  * current thread's stack.
  */
 void * antest_user_thread_stack_addr();
+
+/**
+ * Simulates the trap taken when the current thread uses the FPU while it is
+ * disabled.
+ */
+void antest_user_thread_fpu_fault();
@@ -3,8 +3,22 @@
 #include "threading.h"
 #include <string.h> // bzero
 
+static uint64_t * _leaf_table(void * root,
+                              uint64_t vpage,
+                              uint16_t flags,
+                              bool create);
 static void _table_free(uint64_t * table, int depth);
 static void _table_free_async(uint64_t * table, int depth);
+static bool _table_walk(uint64_t * table,
+                        int depth,
+                        uint64_t base,
+                        uint64_t start,
+                        uint64_t end,
+                        bool (* fn)(void *, uint64_t, uint64_t, uint16_t),
+                        void * arg);
+static uint64_t _table_count(uint64_t * table, int depth);
+
+static uint64_t failTables __attribute__((aligned(8))) = 0;
 
 uint64_t anscheduler_vm_physical(uint64_t virt) {
   return virt;
@@ -82,6 +96,75 @@ uint64_t anscheduler_vm_lookup(void * root,
   return table[indices[3]] >> 12;
 }
 
+bool anscheduler_vm_map_range(void * root,
+                              uint64_t vpage,
+                              uint64_t count,
+                              uint64_t dpage,
+                              uint64_t stride,
+                              uint16_t flags) {
+  uint64_t * table = NULL;
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    uint64_t page = vpage + i;
+    // only walk the tables again when we cross into a new page table
+    if (!table || !(page & 0x1ff)) {
+      table = _leaf_table(root, page, flags, true);
+      if (!table) return false;
+    }
+    table[page & 0x1ff] = ((dpage + (i * stride)) << 12) | flags;
+  }
+  return true;
+}
+
+void anscheduler_vm_unmap_range(void * root, uint64_t vpage, uint64_t count) {
+  uint64_t * table = NULL;
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    uint64_t page = vpage + i;
+    if (!table || !(page & 0x1ff)) {
+      table = _leaf_table(root, page, 0, false);
+    }
+    if (table) table[page & 0x1ff] = 0;
+  }
+}
+
+void anscheduler_vm_lookup_range(void * root,
+                                 uint64_t vpage,
+                                 uint64_t count,
+                                 uint64_t * entries,
+                                 uint16_t * flags) {
+  uint64_t * table = NULL;
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    uint64_t page = vpage + i;
+    if (!table || !(page & 0x1ff)) {
+      table = _leaf_table(root, page, 0, false);
+    }
+    uint64_t value = table ? table[page & 0x1ff] : 0;
+    entries[i] = value >> 12;
+    flags[i] = (uint16_t)(value & 0xfff);
+  }
+}
+
+bool anscheduler_vm_walk(void * root,
+                         uint64_t start,
+                         uint64_t end,
+                         bool (* fn)(void * arg,
+                                     uint64_t vpage,
+                                     uint64_t entry,
+                                     uint16_t flags),
+                         void * arg) {
+  return _table_walk((uint64_t *)root, 0, 0, start, end, fn, arg);
+}
+
+void antest_vm_fail_tables(bool flag) {
+  failTables = flag;
+}
+
+uint64_t anscheduler_vm_table_count(void * root) {
+  return _table_count((uint64_t *)root, 0);
+}
+
 void anscheduler_vm_root_free(void * root) {
   // recursive table free
   _table_free((uint64_t *)root, 0);
@@ -92,6 +175,29 @@ void anscheduler_vm_root_free_async(void * root) {
   _table_free_async((uint64_t *)root, 0);
 }
 
+static uint64_t * _leaf_table(void * root,
+                              uint64_t vpage,
+                              uint16_t flags,
+                              bool create) {
+  uint64_t indices[3] = {
+    (vpage >> 27) & 0x1ff, (vpage >> 18) & 0x1ff, (vpage >> 9) & 0x1ff
+  };
+  uint64_t * table = (uint64_t *)root;
+  int i;
+  for (i = 0; i < 3; i++) {
+    uint64_t idx = indices[i];
+    if (!(table[idx] & 1)) {
+      if (!create || failTables) return NULL;
+      void * nextTable = anscheduler_alloc(0x1000);
+      bzero(nextTable, 0x1000);
+      table[idx] = 3 | ((uint64_t)nextTable);
+    }
+    if (flags & 4) table[idx] |= 4;
+    table = (uint64_t *)((table[idx] >> 12) << 12);
+  }
+  return table;
+}
+
 static void _table_free(uint64_t * table, int depth) {
   if (depth == 3) {
     return anscheduler_free(table);
@@ -106,6 +212,47 @@ static void _table_free(uint64_t * table, int depth) {
   anscheduler_free(table);
 }
 
+static bool _table_walk(uint64_t * table,
+                        int depth,
+                        uint64_t base,
+                        uint64_t start,
+                        uint64_t end,
+                        bool (* fn)(void *, uint64_t, uint64_t, uint16_t),
+                        void * arg) {
+  // each entry at this depth covers this many pages
+  uint64_t span = 1L << (9 * (3 - depth));
+  int i;
+  for (i = 0; i < 0x200; i++) {
+    uint64_t first = base + (span * i);
+    if (first >= end) break;
+    if (first + span <= start) continue;
+    if (depth == 3) {
+      uint16_t flags = (uint16_t)(table[i] & 0xfff);
+      if (!flags) continue;
+      if (!fn(arg, first, table[i] >> 12, flags)) return false;
+    } else if (table[i] & 1) {
+      uint64_t * nTable = (uint64_t *)((table[i] >> 12) << 12);
+      if (!_table_walk(nTable, depth + 1, first, start, end, fn, arg)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static uint64_t _table_count(uint64_t * table, int depth) {
+  if (depth == 3) return 1;
+  uint64_t count = 1;
+  int i;
+  for (i = 0; i < 0x200; i++) {
+    if (table[i] & 1) {
+      uint64_t * nTable = (uint64_t *)((table[i] >> 12) << 12);
+      count += _table_count(nTable, depth + 1);
+    }
+  }
+  return count;
+}
+
 static void _table_free_async(uint64_t * table, int depth) {
   if (depth == 3) {
     anscheduler_cpu_lock();
@@ -15,5 +15,32 @@ void anscheduler_vm_unmap(void * root, uint64_t vpage);
 uint64_t anscheduler_vm_lookup(void * root,
                                uint64_t vpage,
                                uint16_t * flags);
+bool anscheduler_vm_map_range(void * root,
+                              uint64_t vpage,
+                              uint64_t count,
+                              uint64_t dpage,
+                              uint64_t stride,
+                              uint16_t flags);
+void anscheduler_vm_unmap_range(void * root, uint64_t vpage, uint64_t count);
+void anscheduler_vm_lookup_range(void * root,
+                                 uint64_t vpage,
+                                 uint64_t count,
+                                 uint64_t * entries,
+                                 uint16_t * flags);
+bool anscheduler_vm_walk(void * root,
+                         uint64_t start,
+                         uint64_t end,
+                         bool (* fn)(void * arg,
+                                     uint64_t vpage,
+                                     uint64_t entry,
+                                     uint16_t flags),
+                         void * arg);
+uint64_t anscheduler_vm_table_count(void * root);
+
+/**
+ * While set, anscheduler_vm_map_range() fails whenever it needs a new page
+ * table, so that callers' rollback paths can be tested.
+ */
+void antest_vm_fail_tables(bool flag);
 void anscheduler_vm_root_free(void * root);
 void anscheduler_vm_root_free_async(void * root);
@@ -0,0 +1,191 @@
+/**
+ * Tests that a batch of messages is queued in order up to the socket's limit,
+ * that the receiver can read them back in batches, and that a sender blocked
+ * on the full socket is woken once the receiver drains it. Also checks the
+ * bounds on a socket's queue depth.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/socket.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define BATCH_SIZE (ANSCHEDULER_SOCKET_MSG_MAX + 4)
+
+static uint64_t senderWaiting __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * unused);
+void create_task(void (* method)());
+void receiver_main();
+void sender_main();
+void wait_for_message();
+void wait_cont(void * unused);
+void wait_poll(void * unused);
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * unused) {
+  create_task(receiver_main);
+  create_task(sender_main);
+  anscheduler_loop_run();
+}
+
+void create_task(void (* method)()) {
+  task_t * task = anscheduler_task_create();
+  anscheduler_task_launch(task);
+  thread_t * thread = anscheduler_thread_create(task);
+  antest_configure_user_thread(thread, method);
+  anscheduler_thread_add(task, thread);
+  anscheduler_task_dereference(task);
+}
+
+void receiver_main() {
+  anscheduler_cpu_lock();
+  uint64_t received = 0;
+  uint64_t biggestBatch = 0;
+  bool closed = false;
+  
+  while (!closed) {
+    wait_for_message();
+    
+    // leave the socket full until the sender has to block on it
+    while (!senderWaiting) {
+      anscheduler_cpu_unlock();
+      anscheduler_cpu_halt();
+      anscheduler_cpu_lock();
+    }
+    
+    socket_desc_t * desc;
+    while ((desc = anscheduler_socket_next_pending())) {
+      socket_msg_t * msgs[BATCH_SIZE];
+      uint64_t i, count;
+      while ((count = anscheduler_socket_read_batch(desc, msgs, BATCH_SIZE))) {
+        if (count > biggestBatch) biggestBatch = count;
+        for (i = 0; i < count; i++) {
+          if (msgs[i]->type == ANSCHEDULER_MSG_TYPE_CLOSE) {
+            closed = true;
+          } else if (msgs[i]->type == ANSCHEDULER_MSG_TYPE_DATA) {
+            assert(msgs[i]->len == 1);
+            assert(msgs[i]->message[0] == received++);
+          }
+          anscheduler_socket_msg_free(msgs[i]);
+        }
+      }
+      if (closed) anscheduler_socket_close(desc, 0);
+      anscheduler_socket_dereference(desc);
+    }
+  }
+  
+  // one message past the limit was sent after the sender woke up
+  assert(received == ANSCHEDULER_SOCKET_MSG_MAX);
+  assert(biggestBatch >= ANSCHEDULER_SOCKET_MSG_MAX);
+  printf("batch was received!\n");
+  
+  pthread_t thread;
+  pthread_create(&thread, NULL, check_for_leaks, NULL);
+  anscheduler_task_exit(0);
+}
+
+void sender_main() {
+  anscheduler_cpu_lock();
+  socket_msg_t * msgs[BATCH_SIZE];
+  uint8_t i;
+  for (i = 0; i < BATCH_SIZE; i++) {
+    msgs[i] = anscheduler_socket_msg_data(&i, 1);
+    assert(msgs[i] != NULL);
+  }
+  
+  socket_desc_t * desc = anscheduler_socket_new();
+  uint64_t fd = desc->descriptor;
+  
+  // a deeper queue gets a bigger ring, within the task's memory limit
+  task_t * task = anscheduler_cpu_get_task();
+  socket_ring_t * ring = &desc->socket->forConnector;
+  assert(ring->size == ANSCHEDULER_SOCKET_RING_SIZE);
+  assert(!anscheduler_socket_set_depth(desc, 0));
+  assert(!anscheduler_socket_set_depth(desc, ANSCHEDULER_SOCKET_DEPTH_MAX + 1));
+  assert(anscheduler_socket_set_depth(desc, ANSCHEDULER_SOCKET_DEPTH_MAX));
+  assert(ring->size == 0x200);
+  anscheduler_task_mem_limit(task, 0x40);
+  assert(!anscheduler_socket_set_depth(desc, 0x41));
+  assert(anscheduler_socket_set_depth(desc, 4));
+  assert(ring->size == ANSCHEDULER_SOCKET_RING_SIZE && ring->depth == 4);
+  anscheduler_task_mem_limit(task, 0);
+  
+  task_t * target = anscheduler_task_for_pid(0);
+  assert(target != NULL);
+  assert(anscheduler_socket_connect(desc, target));
+  
+  // the whole batch goes out with a single wakeup
+  desc = anscheduler_socket_for_descriptor(fd);
+  uint64_t sent = anscheduler_socket_msg_batch(desc, msgs, BATCH_SIZE);
+  // the receiver hasn't read the CONNECT message, which takes up a slot
+  assert(sent == ANSCHEDULER_SOCKET_MSG_MAX - 1);
+  
+  desc = anscheduler_socket_for_descriptor(fd);
+  assert(!anscheduler_socket_msg(desc, msgs[sent]));
+  senderWaiting = 1;
+  assert(anscheduler_socket_wait_writable(desc));
+  desc = anscheduler_socket_for_descriptor(fd);
+  assert(anscheduler_socket_msg(desc, msgs[sent]));
+  for (i = sent + 1; i < BATCH_SIZE; i++) {
+    anscheduler_socket_msg_free(msgs[i]);
+  }
+  
+  desc = anscheduler_socket_for_descriptor(fd);
+  anscheduler_socket_close(desc, 0);
+  anscheduler_socket_dereference(desc);
+  anscheduler_task_exit(0);
+}
+
+void wait_for_message() {
+  thread_t * thread = anscheduler_cpu_get_thread();
+  anscheduler_save_return_state(thread, NULL, wait_cont);
+}
+
+void wait_cont(void * unused) {
+  anscheduler_cpu_stack_run(NULL, wait_poll);
+}
+
+void wait_poll(void * unused) {
+  task_t * task = anscheduler_cpu_get_task();
+  if (!anscheduler_thread_poll()) {
+    anscheduler_thread_run(task, anscheduler_cpu_get_thread());
+  } else {
+    anscheduler_cpu_set_task(NULL);
+    anscheduler_cpu_set_thread(NULL);
+    anscheduler_task_dereference(task);
+    anscheduler_loop_run();
+  }
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 1 CPU stack = 2 pages!
+  if (antest_pages_alloced() != 2) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 2);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
@@ -0,0 +1,195 @@
+/**
+ * Tests that a forked task shares its parent's data pages until one of them
+ * writes to a page, at which point the writer gets its own copy.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include "env/vm.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/paging.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define DATA_ADDR ((void *)((uint64_t)ANSCHEDULER_TASK_DATA_PAGE << 12))
+#define CHARGED_PAGE (ANSCHEDULER_TASK_DATA_PAGE + 1)
+#define CHARGED_ADDR ((void *)((uint64_t)CHARGED_PAGE << 12))
+
+static uint64_t childDone __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * flag);
+void parent_main();
+void child_main();
+uint64_t lookup_data_page(uint16_t * flags);
+uint64_t lookup_page(uint64_t vpage, uint16_t * flags);
+void unmap_data_page();
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+  antest_launch_thread((void *)1, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * flag) {
+  if (flag) {
+    task_t * task = anscheduler_task_create();
+    anscheduler_task_launch(task);
+
+    thread_t * thread = anscheduler_thread_create(task);
+    antest_configure_user_thread(thread, parent_main);
+
+    anscheduler_thread_add(task, thread);
+    anscheduler_task_dereference(task);
+  }
+  anscheduler_loop_run();
+}
+
+void parent_main() {
+  anscheduler_cpu_lock();
+  task_t * task = anscheduler_cpu_get_task();
+
+  // map a data page with a known value in it
+  uint64_t * page = anscheduler_alloc(0x1000);
+  page[0] = 0x1337;
+  uint16_t flags = ANSCHEDULER_PAGE_FLAG_PRESENT
+    | ANSCHEDULER_PAGE_FLAG_WRITE
+    | ANSCHEDULER_PAGE_FLAG_USER;
+  anscheduler_lock(&task->vmLock);
+  anscheduler_vm_map(task->vm, ANSCHEDULER_TASK_DATA_PAGE,
+                     anscheduler_vm_physical(((uint64_t)page) >> 12), flags);
+
+  // and a page which we are charged for
+  anscheduler_vm_map(task->vm, CHARGED_PAGE, 0, ANSCHEDULER_PAGE_FLAG_UNALLOC
+                     | ANSCHEDULER_PAGE_FLAG_USER
+                     | ANSCHEDULER_PAGE_FLAG_WRITE);
+  anscheduler_unlock(&task->vmLock);
+  antest_user_thread_page_fault(CHARGED_ADDR, true);
+  assert(task->mem.user == 1);
+
+  task_t * child = anscheduler_task_fork(task);
+  assert(child != NULL);
+  assert(!child->mem.user);
+
+  // our copy of the charged page takes over the charge
+  uint64_t charged = lookup_page(CHARGED_PAGE, &flags);
+  antest_user_thread_page_fault(CHARGED_ADDR, true);
+  assert(lookup_page(CHARGED_PAGE, &flags) != charged);
+  assert(task->mem.user == 1);
+
+  // both tasks should map the same frame read-only now
+  uint64_t entry = lookup_data_page(&flags);
+  assert(flags & ANSCHEDULER_PAGE_FLAG_COW);
+  assert(!(flags & ANSCHEDULER_PAGE_FLAG_WRITE));
+  uint16_t childFlags;
+  anscheduler_lock(&child->vmLock);
+  uint64_t childEntry = anscheduler_vm_lookup(child->vm,
+                                              ANSCHEDULER_TASK_DATA_PAGE,
+                                              &childFlags);
+  anscheduler_unlock(&child->vmLock);
+  assert(childEntry == entry);
+  assert(childFlags == flags);
+
+  anscheduler_task_launch(child);
+  thread_t * thread = anscheduler_thread_create(child);
+  antest_configure_user_thread(thread, child_main);
+  anscheduler_thread_add(child, thread);
+  
+  // both tasks should show up in a snapshot, in PID order
+  task_stats_t stats[4];
+  assert(anscheduler_task_stats(0, stats, 4) == 2);
+  assert(stats[0].pid == task->pid && stats[1].pid == child->pid);
+  assert(stats[0].threadCount == 1 && stats[1].threadCount == 1);
+  assert(anscheduler_task_stats(child->pid, stats, 4) == 1);
+  anscheduler_task_dereference(child);
+  anscheduler_cpu_unlock();
+
+  volatile uint64_t * done = &childDone;
+  while (!*done) anscheduler_cpu_halt();
+
+  // the child took a copy, so our write should not need one
+  anscheduler_cpu_lock();
+  antest_user_thread_page_fault(DATA_ADDR, true);
+  assert(lookup_data_page(&flags) == entry);
+  assert(flags & ANSCHEDULER_PAGE_FLAG_WRITE);
+  assert(!(flags & ANSCHEDULER_PAGE_FLAG_COW));
+  anscheduler_page_unmap(task, CHARGED_PAGE);
+  unmap_data_page();
+
+  pthread_t athread;
+  pthread_create(&athread, NULL, check_for_leaks, NULL);
+  printf("parent done.\n");
+  anscheduler_task_exit(0);
+}
+
+void child_main() {
+  anscheduler_cpu_lock();
+  uint16_t flags;
+  uint64_t shared = lookup_data_page(&flags);
+  antest_user_thread_page_fault(DATA_ADDR, true);
+
+  uint64_t entry = lookup_data_page(&flags);
+  assert(entry != shared);
+  assert(flags & ANSCHEDULER_PAGE_FLAG_WRITE);
+  assert(!(flags & ANSCHEDULER_PAGE_FLAG_COW));
+  uint64_t * copy = (uint64_t *)(anscheduler_vm_virtual(entry) << 12);
+  assert(copy[0] == 0x1337);
+  assert(anscheduler_cpu_get_task()->mem.user == 1);
+
+  // we are left alone with the charged page, so we adopt it
+  uint64_t orphan = lookup_page(CHARGED_PAGE, &flags);
+  assert(flags & ANSCHEDULER_PAGE_FLAG_COW);
+  antest_user_thread_page_fault(CHARGED_ADDR, true);
+  assert(lookup_page(CHARGED_PAGE, &flags) == orphan);
+  assert(flags & ANSCHEDULER_PAGE_FLAG_WRITE);
+  assert(anscheduler_cpu_get_task()->mem.user == 2);
+  anscheduler_page_unmap(anscheduler_cpu_get_task(), CHARGED_PAGE);
+  unmap_data_page();
+
+  printf("child done.\n");
+  __sync_fetch_and_add(&childDone, 1);
+  anscheduler_task_exit(0);
+}
+
+uint64_t lookup_data_page(uint16_t * flags) {
+  return lookup_page(ANSCHEDULER_TASK_DATA_PAGE, flags);
+}
+
+uint64_t lookup_page(uint64_t vpage, uint16_t * flags) {
+  task_t * task = anscheduler_cpu_get_task();
+  anscheduler_lock(&task->vmLock);
+  uint64_t entry = anscheduler_vm_lookup(task->vm, vpage, flags);
+  anscheduler_unlock(&task->vmLock);
+  return entry;
+}
+
+void unmap_data_page() {
+  task_t * task = anscheduler_cpu_get_task();
+  anscheduler_page_unmap(task, ANSCHEDULER_TASK_DATA_PAGE);
+  assert(!task->mem.user);
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 2 CPU stacks = 3 pages!
+  if (antest_pages_alloced() != 3) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 3);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
@@ -0,0 +1,115 @@
+/**
+ * Tests that FPU state is only loaded when a thread traps, that the previous
+ * owner's state is only saved then, and that a thread which gets back to its
+ * CPU before anybody else used the FPU finds it enabled without a save.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+static uint64_t firstUsed __attribute__((aligned(8))) = 0;
+static uint64_t secondUsed __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * unused);
+void first_body();
+void second_body();
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * unused) {
+  task_t * task = anscheduler_task_create();
+  anscheduler_task_launch(task);
+
+  thread_t * first = anscheduler_thread_create(task);
+  antest_configure_user_thread(first, first_body);
+  thread_t * second = anscheduler_thread_create(task);
+  antest_configure_user_thread(second, second_body);
+
+  anscheduler_thread_add(task, first);
+  anscheduler_thread_add(task, second);
+  anscheduler_task_dereference(task);
+  anscheduler_loop_run();
+}
+
+void first_body() {
+  cpu_info * cpu = antest_get_current_cpu_info();
+  assert(!cpu->fpuEnabled);
+  anscheduler_cpu_lock();
+  antest_user_thread_fpu_fault();
+  assert(cpu->fpuEnabled);
+  assert(cpu->fpuRestores == 0);
+  firstUsed = 1;
+  anscheduler_cpu_unlock();
+  
+  while (!secondUsed) anscheduler_cpu_halt();
+  
+  // the other thread took the registers, so ours have to be loaded again
+  assert(!cpu->fpuEnabled);
+  anscheduler_cpu_lock();
+  antest_user_thread_fpu_fault();
+  assert(cpu->fpuEnabled);
+  assert(cpu->fpuRestores == 1);
+  anscheduler_cpu_unlock();
+  
+  // nobody else uses the FPU now, so we keep it without a save
+  uint64_t saves = cpu->fpuSaves;
+  anscheduler_cpu_halt();
+  assert(cpu->fpuEnabled);
+  assert(cpu->fpuRestores == 1);
+  assert(cpu->fpuSaves == saves);
+  printf("FPU was switched lazily!\n");
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, check_for_leaks, NULL);
+  anscheduler_cpu_lock();
+  anscheduler_task_exit(0);
+}
+
+void second_body() {
+  cpu_info * cpu = antest_get_current_cpu_info();
+  while (!firstUsed) anscheduler_cpu_halt();
+  
+  assert(!cpu->fpuEnabled);
+  anscheduler_cpu_lock();
+  antest_user_thread_fpu_fault();
+  assert(cpu->fpuEnabled);
+  
+  // the first thread's registers were saved when we trapped
+  assert(cpu->fpuSaves == 1);
+  assert(cpu->fpuRestores == 0);
+  secondUsed = 1;
+  anscheduler_cpu_unlock();
+  anscheduler_thread_exit(0);
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 1 CPU stack = 2 pages!
+  if (antest_pages_alloced() != 2) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 2);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
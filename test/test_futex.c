@@ -0,0 +1,123 @@
+/**
+ * Tests that a thread can sleep on a futex, that it times out when nobody
+ * wakes it, and that another thread in its task can wake it.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/futex.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+static uint64_t * futexPage = NULL;
+static uint64_t waiterReady __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * flag);
+void create_task();
+void waiter_body();
+void waker_body();
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+  antest_launch_thread((void *)1, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * flag) {
+  if (flag) create_task();
+  anscheduler_loop_run();
+}
+
+void create_task() {
+  task_t * task = anscheduler_task_create();
+  
+  futexPage = anscheduler_alloc(0x1000);
+  futexPage[0] = 0;
+  uint16_t flags = ANSCHEDULER_PAGE_FLAG_PRESENT
+    | ANSCHEDULER_PAGE_FLAG_WRITE
+    | ANSCHEDULER_PAGE_FLAG_USER;
+  uint64_t entry = anscheduler_vm_physical(((uint64_t)futexPage) >> 12);
+  anscheduler_vm_map(task->vm, ANSCHEDULER_TASK_DATA_PAGE, entry, flags);
+  anscheduler_task_launch(task);
+
+  thread_t * waiter = anscheduler_thread_create(task);
+  antest_configure_user_thread(waiter, waiter_body);
+  thread_t * waker = anscheduler_thread_create(task);
+  antest_configure_user_thread(waker, waker_body);
+
+  anscheduler_thread_add(task, waiter);
+  anscheduler_thread_add(task, waker);
+  anscheduler_task_dereference(task);
+}
+
+void waiter_body() {
+  anscheduler_cpu_lock();
+  uint64_t * addr = (uint64_t *)((uint64_t)ANSCHEDULER_TASK_DATA_PAGE << 12);
+  
+  assert(anscheduler_futex_wait(addr, 1, 0) == ANSCHEDULER_FUTEX_MISMATCH);
+  assert(anscheduler_futex_wait(addr + 0x200, 0, 0)
+         == ANSCHEDULER_FUTEX_FAULT);
+  
+  // nobody wakes us yet
+  uint64_t timeout = anscheduler_second_length() / 20;
+  uint64_t start = anscheduler_get_time();
+  assert(anscheduler_futex_wait(addr, 0, timeout)
+         == ANSCHEDULER_FUTEX_TIMEOUT);
+  assert(anscheduler_get_time() - start >= timeout);
+  
+  waiterReady = 1;
+  assert(anscheduler_futex_wait(addr, 0, 0) == ANSCHEDULER_FUTEX_WOKEN);
+  printf("waiter woken!\n");
+  
+  task_t * task = anscheduler_cpu_get_task();
+  anscheduler_lock(&task->vmLock);
+  anscheduler_vm_unmap(task->vm, ANSCHEDULER_TASK_DATA_PAGE);
+  anscheduler_unlock(&task->vmLock);
+  anscheduler_free(futexPage);
+  
+  pthread_t thread;
+  pthread_create(&thread, NULL, check_for_leaks, NULL);
+  anscheduler_task_exit(0);
+}
+
+void waker_body() {
+  uint64_t * addr = (uint64_t *)((uint64_t)ANSCHEDULER_TASK_DATA_PAGE << 12);
+  while (1) {
+    anscheduler_cpu_lock();
+    // the waiter may not have gone to sleep yet
+    if (waiterReady && anscheduler_futex_wake(addr, 1) == 1) {
+      anscheduler_cpu_unlock();
+      break;
+    }
+    anscheduler_cpu_unlock();
+    anscheduler_cpu_halt();
+  }
+  anscheduler_thread_exit(0);
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 2 CPU stacks = 3 pages!
+  if (antest_pages_alloced() != 3) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 3);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
@@ -0,0 +1,244 @@
+/**
+ * Tests that a vector of pages granted over a socket moves from the sender's
+ * address space to the receiver's in one message without being copied, and
+ * that a grant which is never mapped is freed along with its message. A page
+ * the sender was never charged for can be granted without its usage going
+ * below zero. Also checks that small data messages don't take a whole page
+ * and can be copied out.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/paging.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/socket.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define VECTOR_SIZE 3
+
+static uint64_t grantedEntries[VECTOR_SIZE];
+
+void proc_enter(void * unused);
+void create_task(void (* method)());
+void receiver_main();
+void sender_main();
+uint64_t * fault_in_page(uint64_t vpage);
+void wait_for_message();
+void wait_cont(void * unused);
+void wait_poll(void * unused);
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * unused) {
+  create_task(receiver_main);
+  create_task(sender_main);
+  anscheduler_loop_run();
+}
+
+void create_task(void (* method)()) {
+  task_t * task = anscheduler_task_create();
+  anscheduler_task_launch(task);
+  thread_t * thread = anscheduler_thread_create(task);
+  antest_configure_user_thread(thread, method);
+  anscheduler_thread_add(task, thread);
+  anscheduler_task_dereference(task);
+}
+
+void receiver_main() {
+  anscheduler_cpu_lock();
+  task_t * task = anscheduler_cpu_get_task();
+  uint64_t vpage = ANSCHEDULER_TASK_DATA_PAGE + 0x10;
+  int grants = 0;
+  bool closed = false;
+  
+  while (!closed) {
+    wait_for_message();
+    socket_desc_t * desc;
+    while ((desc = anscheduler_socket_next_pending())) {
+      socket_msg_t * msg;
+      while ((msg = anscheduler_socket_read(desc))) {
+        if (msg->type == ANSCHEDULER_MSG_TYPE_CLOSE) {
+          closed = true;
+        } else if (msg->type == ANSCHEDULER_MSG_TYPE_GRANT) {
+          if (!grants++) {
+            // the first grant is mapped, the second is just dropped
+            assert(msg->len == VECTOR_SIZE * sizeof(uint64_t));
+            assert(anscheduler_socket_msg_map(msg, vpage));
+            assert(!anscheduler_socket_msg_map(msg, vpage + VECTOR_SIZE));
+          }
+        }
+        anscheduler_socket_msg_free(msg);
+      }
+      if (closed) anscheduler_socket_close(desc, 0);
+      anscheduler_socket_dereference(desc);
+    }
+  }
+  assert(grants == 2);
+  
+  // the very same frames showed up here in order, contents and all
+  assert(task->mem.user == VECTOR_SIZE);
+  int i;
+  for (i = 0; i < VECTOR_SIZE; i++) {
+    uint16_t flags;
+    anscheduler_lock(&task->vmLock);
+    uint64_t entry = anscheduler_vm_lookup(task->vm, vpage + i, &flags);
+    anscheduler_unlock(&task->vmLock);
+    assert(entry == grantedEntries[i]);
+    assert(flags & ANSCHEDULER_PAGE_FLAG_WRITE);
+    uint64_t * page = (uint64_t *)(anscheduler_vm_virtual(entry) << 12);
+    assert(page[0] == 0x1337 + i);
+    anscheduler_page_unmap(task, vpage + i);
+  }
+  assert(!task->mem.user);
+  printf("pages were granted!\n");
+  
+  pthread_t thread;
+  pthread_create(&thread, NULL, check_for_leaks, NULL);
+  anscheduler_task_exit(0);
+}
+
+void sender_main() {
+  anscheduler_cpu_lock();
+  task_t * task = anscheduler_cpu_get_task();
+  uint64_t vpage = ANSCHEDULER_TASK_DATA_PAGE;
+  
+  // a page which is not mapped can't be granted
+  assert(anscheduler_socket_msg_grant(vpage) == NULL);
+  
+  // small messages come from the slab, not from a page of their own
+  socket_msg_t * msg = anscheduler_socket_msg_data("marry me", 8);
+  assert(((uint64_t)msg) & 0xfff);
+  char buf[0x10];
+  assert(anscheduler_socket_msg_copy(msg, buf, 5) == 5);
+  assert(anscheduler_socket_msg_copy(msg, buf, sizeof(buf)) == 8);
+  assert(!memcmp("marry me", buf, 8));
+  anscheduler_socket_msg_free(msg);
+  
+  // the pages are scattered, and sent in reverse
+  uint64_t vpages[VECTOR_SIZE];
+  int i;
+  for (i = 0; i < VECTOR_SIZE; i++) {
+    vpages[i] = vpage + (VECTOR_SIZE - i) * 2;
+    uint64_t * page = fault_in_page(vpages[i]);
+    page[0] = 0x1337 + i;
+  }
+  
+  // a page listed twice fails the whole vector without losing any pages
+  uint64_t twice[2] = {vpages[0], vpages[0]};
+  assert(anscheduler_socket_msg_grant_vector(twice, 2) == NULL);
+  assert(task->mem.user == VECTOR_SIZE);
+  
+  msg = anscheduler_socket_msg_grant_vector(vpages, VECTOR_SIZE);
+  assert(msg != NULL);
+  assert(task->mem.user == 0);
+  for (i = 0; i < VECTOR_SIZE; i++) {
+    grantedEntries[i] = ((uint64_t *)msg->message)[i];
+    uint16_t flags;
+    anscheduler_lock(&task->vmLock);
+    anscheduler_vm_lookup(task->vm, vpages[i], &flags);
+    anscheduler_unlock(&task->vmLock);
+    assert(!flags);
+  }
+  
+  socket_desc_t * desc = anscheduler_socket_new();
+  uint64_t fd = desc->descriptor;
+  task_t * target = anscheduler_task_for_pid(0);
+  assert(target != NULL);
+  assert(anscheduler_socket_connect(desc, target));
+  desc = anscheduler_socket_for_descriptor(fd);
+  assert(anscheduler_socket_msg(desc, msg));
+  
+  // a page the platform mapped was never charged, so granting it leaves
+  // the charge for our own page alone
+  fault_in_page(vpage);
+  assert(task->mem.user == 1);
+  void * frame = anscheduler_alloc(0x1000);
+  uint64_t phyPage = anscheduler_vm_physical(((uint64_t)frame) >> 12);
+  anscheduler_lock(&task->vmLock);
+  anscheduler_vm_map(task->vm, vpage + 1, phyPage,
+                     ANSCHEDULER_PAGE_FLAG_PRESENT
+                     | ANSCHEDULER_PAGE_FLAG_USER
+                     | ANSCHEDULER_PAGE_FLAG_WRITE);
+  anscheduler_unlock(&task->vmLock);
+  msg = anscheduler_socket_msg_grant(vpage + 1);
+  assert(msg != NULL);
+  assert(task->mem.user == 1);
+  anscheduler_page_unmap(task, vpage);
+  assert(task->mem.user == 0);
+  desc = anscheduler_socket_for_descriptor(fd);
+  assert(anscheduler_socket_msg(desc, msg));
+  
+  desc = anscheduler_socket_for_descriptor(fd);
+  anscheduler_socket_close(desc, 0);
+  anscheduler_socket_dereference(desc);
+  anscheduler_task_exit(0);
+}
+
+uint64_t * fault_in_page(uint64_t vpage) {
+  task_t * task = anscheduler_cpu_get_task();
+  anscheduler_lock(&task->vmLock);
+  anscheduler_vm_map(task->vm, vpage, 0, ANSCHEDULER_PAGE_FLAG_UNALLOC
+                     | ANSCHEDULER_PAGE_FLAG_USER
+                     | ANSCHEDULER_PAGE_FLAG_WRITE);
+  anscheduler_unlock(&task->vmLock);
+  antest_user_thread_page_fault((void *)(vpage << 12), true);
+  
+  uint16_t flags;
+  anscheduler_lock(&task->vmLock);
+  uint64_t entry = anscheduler_vm_lookup(task->vm, vpage, &flags);
+  anscheduler_unlock(&task->vmLock);
+  assert(flags & ANSCHEDULER_PAGE_FLAG_PRESENT);
+  return (uint64_t *)(anscheduler_vm_virtual(entry) << 12);
+}
+
+void wait_for_message() {
+  thread_t * thread = anscheduler_cpu_get_thread();
+  anscheduler_save_return_state(thread, NULL, wait_cont);
+}
+
+void wait_cont(void * unused) {
+  anscheduler_cpu_stack_run(NULL, wait_poll);
+}
+
+void wait_poll(void * unused) {
+  task_t * task = anscheduler_cpu_get_task();
+  if (!anscheduler_thread_poll()) {
+    anscheduler_thread_run(task, anscheduler_cpu_get_thread());
+  } else {
+    anscheduler_cpu_set_task(NULL);
+    anscheduler_cpu_set_thread(NULL);
+    anscheduler_task_dereference(task);
+    anscheduler_loop_run();
+  }
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 1 CPU stack = 2 pages!
+  if (antest_pages_alloced() != 2) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 2);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
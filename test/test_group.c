@@ -0,0 +1,110 @@
+/**
+ * Tests that a task group with a small CPU quota gets throttled while an
+ * unrestricted task on the same CPU keeps running.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/group.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define GROUP_PERIOD 0x20000
+#define GROUP_QUOTA 0x4000
+
+static uint64_t startTime __attribute__((aligned(8))) = 0;
+static uint64_t throttledSlices __attribute__((aligned(8))) = 0;
+static uint64_t freeSlices __attribute__((aligned(8))) = 0;
+static uint64_t tasksDone __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * unused);
+void create_task(task_group_t * group, void (* fn)());
+void throttled_body();
+void free_body();
+void finish();
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * unused) {
+  task_group_t * group = anscheduler_group_create(GROUP_PERIOD, GROUP_QUOTA);
+  startTime = anscheduler_get_time();
+  create_task(group, throttled_body);
+  create_task(NULL, free_body);
+  anscheduler_group_dereference(group);
+
+  anscheduler_loop_run();
+}
+
+void create_task(task_group_t * group, void (* fn)()) {
+  task_t * task = anscheduler_task_create();
+  if (group) anscheduler_group_join(task, group);
+  anscheduler_task_launch(task);
+
+  thread_t * thread = anscheduler_thread_create(task);
+  antest_configure_user_thread(thread, fn);
+
+  anscheduler_thread_add(task, thread);
+  anscheduler_task_dereference(task);
+}
+
+void throttled_body() {
+  // each halt lasts until the end of a time slice
+  while (anscheduler_get_time() < startTime + 1000000) {
+    anscheduler_cpu_halt();
+    throttledSlices++;
+  }
+  finish();
+}
+
+void free_body() {
+  while (anscheduler_get_time() < startTime + 1000000) {
+    anscheduler_cpu_halt();
+    freeSlices++;
+  }
+  finish();
+}
+
+void finish() {
+  if (__sync_add_and_fetch(&tasksDone, 1) == 2) {
+    printf("throttled slices: %lld, free slices: %lld\n",
+           (long long)throttledSlices, (long long)freeSlices);
+    if (throttledSlices * 2 >= freeSlices) {
+      fprintf(stderr, "group was not throttled\n");
+      exit(1);
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, check_for_leaks, NULL);
+  }
+
+  anscheduler_cpu_lock();
+  anscheduler_task_exit(0);
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 1 CPU stack = 2 pages!
+  if (antest_pages_alloced() != 2) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 2);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
@@ -0,0 +1,119 @@
+/**
+ * Tests that a thread can join joinable threads, whether they exit before or
+ * after it starts waiting, and that it gets their exit codes.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+void proc_enter(void * flag);
+void parent_body();
+void slow_body();
+void quick_body();
+thread_t * create_joinable(task_t * task, void (* fn)());
+bool has_exited(task_t * task, thread_t * thread);
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+  antest_launch_thread((void *)1, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * flag) {
+  if (flag) {
+    task_t * task = anscheduler_task_create();
+    anscheduler_task_launch(task);
+    thread_t * thread = anscheduler_thread_create(task);
+    antest_configure_user_thread(thread, parent_body);
+    anscheduler_thread_add(task, thread);
+    anscheduler_task_dereference(task);
+  }
+  anscheduler_loop_run();
+}
+
+void parent_body() {
+  anscheduler_cpu_lock();
+  task_t * task = anscheduler_cpu_get_task();
+  uint64_t code;
+  assert(!anscheduler_thread_join(anscheduler_cpu_get_thread(), &code));
+  
+  // this one is still running when we start waiting
+  thread_t * slow = create_joinable(task, slow_body);
+  assert(anscheduler_thread_join(slow, &code));
+  assert(code == 0x1337);
+  
+  // this one is gone before we start waiting
+  thread_t * quick = create_joinable(task, quick_body);
+  while (!has_exited(task, quick)) {
+    anscheduler_cpu_unlock();
+    anscheduler_cpu_halt();
+    anscheduler_cpu_lock();
+  }
+  assert(anscheduler_thread_join(quick, &code));
+  assert(code == 0x31337);
+  assert(task->threadCount == 1);
+  printf("joined both threads!\n");
+  
+  pthread_t thread;
+  pthread_create(&thread, NULL, check_for_leaks, NULL);
+  anscheduler_task_exit(0);
+}
+
+void slow_body() {
+  int i;
+  for (i = 0; i < 3; i++) {
+    anscheduler_cpu_halt();
+  }
+  anscheduler_thread_exit(0x1337);
+}
+
+void quick_body() {
+  anscheduler_thread_exit(0x31337);
+}
+
+thread_t * create_joinable(task_t * task, void (* fn)()) {
+  thread_attr_t attr;
+  anscheduler_thread_attr_init(&attr);
+  attr.isJoinable = 1;
+  thread_t * thread = anscheduler_thread_create_attr(task, &attr);
+  assert(thread != NULL);
+  antest_configure_user_thread(thread, fn);
+  anscheduler_thread_add(task, thread);
+  return thread;
+}
+
+bool has_exited(task_t * task, thread_t * thread) {
+  anscheduler_lock(&task->threadsLock);
+  bool result = thread->hasExited;
+  anscheduler_unlock(&task->threadsLock);
+  return result;
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 2 CPU stacks = 3 pages!
+  if (antest_pages_alloced() != 3) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 3);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
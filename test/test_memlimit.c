@@ -0,0 +1,91 @@
+/**
+ * Tests that a task which faults in more memory than its limit allows is
+ * killed, and that the memory it was charged for is accounted correctly.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+// the kernel stack + the first page of user stack
+#define MEMORY_LIMIT (ANSCHEDULER_THREAD_KERN_PAGES + 1)
+
+static uint64_t passedLimit __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * unused);
+void thread_body();
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * unused) {
+  task_t * task = anscheduler_task_create();
+  anscheduler_task_mem_limit(task, MEMORY_LIMIT);
+  anscheduler_task_launch(task);
+
+  thread_t * thread = anscheduler_thread_create(task);
+  assert(thread != NULL);
+  assert(task->mem.kernStack == ANSCHEDULER_THREAD_KERN_PAGES);
+  antest_configure_user_thread(thread, thread_body);
+
+  anscheduler_thread_add(task, thread);
+  anscheduler_task_dereference(task);
+
+  pthread_t athread;
+  pthread_create(&athread, NULL, check_for_leaks, NULL);
+  anscheduler_loop_run();
+}
+
+void thread_body() {
+  anscheduler_cpu_lock();
+  task_t * task = anscheduler_cpu_get_task();
+  task_mem_t usage;
+  anscheduler_task_mem(task, &usage);
+  assert(usage.kernStack == ANSCHEDULER_THREAD_KERN_PAGES);
+  assert(usage.stack == 1);
+  assert(usage.tables > 0);
+
+  // a second thread would need another kernel stack
+  assert(anscheduler_thread_create(task) == NULL);
+
+  // this stack page puts us over the limit, and there is no pager to save us
+  void * addr = antest_user_thread_stack_addr() - 0x1008;
+  antest_user_thread_page_fault(addr, true);
+
+  passedLimit = 1;
+  anscheduler_task_exit(0);
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  if (passedLimit) {
+    fprintf(stderr, "task was not killed\n");
+    exit(1);
+  }
+  // one PID pool + 1 CPU stack = 2 pages!
+  if (antest_pages_alloced() != 2) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 2);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
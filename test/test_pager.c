@@ -91,7 +91,7 @@ void pager_thread() {
       anscheduler_cpu_lock();
       anscheduler_task_kill(fault->task, ANSCHEDULER_TASK_KILL_REASON_MEMORY);
       anscheduler_task_dereference(fault->task);
-      anscheduler_free(fault);
+      anscheduler_pager_free(fault);
       anscheduler_cpu_unlock();
       if (!__sync_sub_and_fetch(&taskCount, 1)) {
         mayDie = true;
@@ -0,0 +1,190 @@
+/**
+ * Tests that PIDs can be looked up on every CPU while tasks are dying and
+ * being reaped. Idle tasks fill the first leaf of the PID map, so every
+ * short-lived task lands in a leaf of its own which is freed once the task
+ * has been reaped. Freed pages are poisoned, so a lookup which reads a leaf
+ * after it was freed will crash.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/loop.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define CPU_COUNT 4
+#define VICTIM_COUNT 0x200
+#define STATS_BATCH 0x10
+
+// the number of PIDs in a leaf of the PID map
+#define LEAF_PIDS 0x1ff
+#define FILLER_COUNT (LEAF_PIDS - CPU_COUNT)
+#define MAX_PID (LEAF_PIDS * 2)
+
+// the PID pool keeps a page for every POOL_PAGE_PIDS PIDs it ever handed out
+#define POOL_PAGE_PIDS 0x1fe
+
+static task_t * fillers[FILLER_COUNT];
+static uint64_t victimsDone __attribute__((aligned(8))) = 0;
+static uint64_t spawnerDone __attribute__((aligned(8))) = 0;
+static uint64_t lookersDone __attribute__((aligned(8))) = 0;
+static uint64_t hits __attribute__((aligned(8))) = 0;
+static uint64_t highestPid __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * flag);
+task_t * create_task(void (* fn)());
+void spawner_main();
+void looker_main();
+void victim_main();
+void look_up_all();
+void walk_all();
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread((void *)1, proc_enter);
+  int i;
+  for (i = 1; i < CPU_COUNT; i++) {
+    antest_launch_thread(NULL, proc_enter);
+  }
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * flag) {
+  if (flag) {
+    // these get the lowest PIDs, right before the fillers
+    int i;
+    for (i = 1; i < CPU_COUNT; i++) {
+      anscheduler_task_dereference(create_task(looker_main));
+    }
+    anscheduler_task_dereference(create_task(spawner_main));
+  }
+  anscheduler_loop_run();
+}
+
+task_t * create_task(void (* fn)()) {
+  task_t * task = anscheduler_task_create();
+  uint64_t pid = task->pid, highest = highestPid;
+  while (pid > highest) {
+    if (__sync_bool_compare_and_swap(&highestPid, highest, pid)) break;
+    highest = highestPid;
+  }
+
+  if (fn) {
+    thread_t * thread = anscheduler_thread_create(task);
+    antest_configure_user_thread(thread, fn);
+    anscheduler_thread_link(task, thread);
+  }
+  anscheduler_task_launch(task);
+  return task;
+}
+
+void spawner_main() {
+  // fillers have no threads; they just take up the rest of the first leaf
+  anscheduler_cpu_lock();
+  int i;
+  for (i = 0; i < FILLER_COUNT; i++) {
+    fillers[i] = create_task(NULL);
+  }
+  assert(highestPid == LEAF_PIDS - 1);
+  anscheduler_cpu_unlock();
+
+  volatile uint64_t * done = &victimsDone;
+  for (i = 1; i <= VICTIM_COUNT; i++) {
+    anscheduler_cpu_lock();
+    anscheduler_task_dereference(create_task(victim_main));
+    anscheduler_cpu_unlock();
+    while (*done < i) {
+      look_up_all();
+      anscheduler_cpu_halt();
+    }
+  }
+
+  anscheduler_cpu_lock();
+  for (i = 0; i < FILLER_COUNT; i++) {
+    anscheduler_task_kill(fillers[i], ANSCHEDULER_TASK_KILL_REASON_EXTERNAL);
+    anscheduler_task_dereference(fillers[i]);
+  }
+  anscheduler_cpu_unlock();
+  __sync_fetch_and_add(&spawnerDone, 1);
+  looker_main();
+}
+
+void looker_main() {
+  volatile uint64_t * done = &spawnerDone;
+  while (!*done) {
+    look_up_all();
+    anscheduler_cpu_halt();
+  }
+
+  if (__sync_add_and_fetch(&lookersDone, 1) == CPU_COUNT) {
+    printf("looked up 0x%llx live tasks\n", (unsigned long long)hits);
+    pthread_t thread;
+    pthread_create(&thread, NULL, check_for_leaks, NULL);
+  }
+  anscheduler_cpu_lock();
+  anscheduler_task_exit(0);
+}
+
+void victim_main() {
+  __sync_fetch_and_add(&victimsDone, 1);
+  anscheduler_cpu_lock();
+  anscheduler_task_exit(0);
+}
+
+void look_up_all() {
+  uint64_t pid;
+  for (pid = LEAF_PIDS - CPU_COUNT; pid < MAX_PID; pid++) {
+    anscheduler_cpu_lock();
+    task_t * task = anscheduler_task_for_pid(pid);
+    if (task) {
+      // a task which was freed and reused would have some other PID
+      assert(task->pid == pid);
+      anscheduler_task_dereference(task);
+      __sync_fetch_and_add(&hits, 1);
+    }
+    anscheduler_cpu_unlock();
+  }
+  walk_all();
+}
+
+void walk_all() {
+  // a walk stays in one lookup for a whole batch, so it is far more likely
+  // than a single lookup to be reading a leaf when it is retired
+  task_stats_t stats[STATS_BATCH];
+  uint64_t firstPid = LEAF_PIDS - STATS_BATCH, count;
+  do {
+    anscheduler_cpu_lock();
+    count = anscheduler_task_stats(firstPid, stats, STATS_BATCH);
+    anscheduler_cpu_unlock();
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+      assert(stats[i].pid >= firstPid && stats[i].pid < MAX_PID);
+      firstPid = stats[i].pid + 1;
+    }
+  } while (count == STATS_BATCH);
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // the PID pool + 4 CPU stacks
+  uint64_t expected = 4 + (highestPid + POOL_PAGE_PIDS) / POOL_PAGE_PIDS;
+  if (antest_pages_alloced() != expected) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)(antest_pages_alloced() - expected));
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
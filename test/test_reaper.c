@@ -0,0 +1,192 @@
+/**
+ * Tests that the reaper keeps up with tasks being killed on several CPUs.
+ * One task's socket is held open while whole batches of tasks are killed, so
+ * the reaper has to be woken for them while it waits on that socket, and
+ * again when the socket goes away. Then the reaper runs out of work and has
+ * to be started again for the last batch.
+ *
+ * Every victim joins one group, so the group's reference count tells how
+ * many of them have not been freed yet.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/group.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/socket.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define CPU_COUNT 4
+#define WAVE_SIZE 0x90
+
+static task_group_t * group = NULL;
+static socket_desc_t * heldDesc __attribute__((aligned(8))) = NULL;
+static uint64_t victimsRunning __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * flag);
+task_t * create_victim(void (* fn)());
+void controller_main();
+void holder_main();
+void victim_main();
+void kill_wave();
+void wait_for_refs(uint64_t count);
+void wait_a_while();
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread((void *)1, proc_enter);
+  int i;
+  for (i = 1; i < CPU_COUNT; i++) {
+    antest_launch_thread(NULL, proc_enter);
+  }
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * flag) {
+  if (flag) {
+    task_t * task = anscheduler_task_create();
+    thread_t * thread = anscheduler_thread_create(task);
+    antest_configure_user_thread(thread, controller_main);
+    anscheduler_thread_link(task, thread);
+    anscheduler_task_launch(task);
+    anscheduler_task_dereference(task);
+  }
+  anscheduler_loop_run();
+}
+
+task_t * create_victim(void (* fn)()) {
+  task_t * task = anscheduler_task_create();
+  anscheduler_group_join(task, group);
+  thread_t * thread = anscheduler_thread_create(task);
+  antest_configure_user_thread(thread, fn);
+  anscheduler_thread_link(task, thread);
+  anscheduler_task_launch(task);
+  return task;
+}
+
+void controller_main() {
+  anscheduler_cpu_lock();
+  group = anscheduler_group_create(1, 0);
+  assert(group != NULL);
+
+  // the holder dies, but we keep a reference to its socket
+  task_t * holder = create_victim(holder_main);
+  anscheduler_cpu_unlock();
+  volatile socket_desc_t ** held = (volatile socket_desc_t **)&heldDesc;
+  while (!*held) anscheduler_cpu_halt();
+  anscheduler_cpu_lock();
+  anscheduler_task_kill(holder, ANSCHEDULER_TASK_KILL_REASON_EXTERNAL);
+  anscheduler_task_dereference(holder);
+  anscheduler_cpu_unlock();
+  wait_a_while();
+
+  // the reaper is waiting on the socket, so a new batch has to wake it
+  kill_wave();
+  wait_for_refs(2);
+  wait_a_while();
+  wait_for_refs(2);
+  printf("reaped 0x%x tasks around a held socket\n", WAVE_SIZE);
+
+  // letting go of the socket wakes the reaper through a notification
+  anscheduler_cpu_lock();
+  anscheduler_socket_dereference(heldDesc);
+  anscheduler_cpu_unlock();
+  wait_for_refs(1);
+  printf("reaped the holder\n");
+
+  // the reaper has nothing left to do, so it goes away and comes back
+  wait_a_while();
+  kill_wave();
+  wait_for_refs(1);
+  printf("reaped 0x%x tasks with a new reaper\n", WAVE_SIZE);
+
+  anscheduler_cpu_lock();
+  anscheduler_group_dereference(group);
+  pthread_t thread;
+  pthread_create(&thread, NULL, check_for_leaks, NULL);
+  anscheduler_task_exit(0);
+}
+
+void holder_main() {
+  // the reference from creating the socket is the controller's to drop
+  anscheduler_cpu_lock();
+  socket_desc_t * desc = anscheduler_socket_new();
+  assert(desc != NULL);
+  __sync_synchronize();
+  heldDesc = desc;
+  anscheduler_cpu_unlock();
+  victim_main();
+}
+
+void victim_main() {
+  __sync_fetch_and_add(&victimsRunning, 1);
+  while (1) {
+    anscheduler_cpu_halt();
+  }
+}
+
+void kill_wave() {
+  static task_t * tasks[WAVE_SIZE];
+  uint64_t i, running = victimsRunning;
+  anscheduler_cpu_lock();
+  for (i = 0; i < WAVE_SIZE; i++) {
+    tasks[i] = create_victim(victim_main);
+  }
+  anscheduler_cpu_unlock();
+
+  // kill them while they are running all over the place
+  volatile uint64_t * count = &victimsRunning;
+  while (*count < running + WAVE_SIZE) anscheduler_cpu_halt();
+  anscheduler_cpu_lock();
+  for (i = 0; i < WAVE_SIZE; i++) {
+    anscheduler_task_kill(tasks[i], ANSCHEDULER_TASK_KILL_REASON_EXTERNAL);
+    anscheduler_task_dereference(tasks[i]);
+  }
+  anscheduler_cpu_unlock();
+}
+
+void wait_for_refs(uint64_t count) {
+  while (1) {
+    anscheduler_cpu_lock();
+    anscheduler_lock(&group->lock);
+    uint64_t refs = group->refCount;
+    anscheduler_unlock(&group->lock);
+    anscheduler_cpu_unlock();
+    assert(refs >= count);
+    if (refs == count) break;
+    anscheduler_cpu_halt();
+  }
+}
+
+void wait_a_while() {
+  int i;
+  for (i = 0; i < 0x20; i++) {
+    anscheduler_cpu_halt();
+  }
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 4 CPU stacks = 5 pages!
+  if (antest_pages_alloced() != 5) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 5);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
@@ -0,0 +1,110 @@
+/**
+ * Tests that a thread which exits is cached with its stacks, and that the
+ * next thread created in its task reuses it.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+static uint64_t childRuns __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * flag);
+void parent_body();
+void child_body();
+thread_t * wait_for_cached(task_t * task);
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+  antest_launch_thread((void *)1, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * flag) {
+  if (flag) {
+    task_t * task = anscheduler_task_create();
+    anscheduler_task_launch(task);
+    thread_t * thread = anscheduler_thread_create(task);
+    antest_configure_user_thread(thread, parent_body);
+    anscheduler_thread_add(task, thread);
+    anscheduler_task_dereference(task);
+  }
+  anscheduler_loop_run();
+}
+
+void parent_body() {
+  anscheduler_cpu_lock();
+  task_t * task = anscheduler_cpu_get_task();
+  
+  thread_t * child = anscheduler_thread_create(task);
+  antest_configure_user_thread(child, child_body);
+  anscheduler_thread_add(task, child);
+  assert(wait_for_cached(task) == child);
+  
+  // the child kept the stack pages it faulted in
+  task_mem_t usage;
+  anscheduler_task_mem(task, &usage);
+  assert(usage.stack == 2 * ANSCHEDULER_THREAD_FAULT_PAGES);
+  assert(usage.kernStack == ANSCHEDULER_THREAD_KERN_PAGES * 2);
+  
+  thread_t * again = anscheduler_thread_create(task);
+  assert(again == child);
+  assert(task->cachedCount == 0);
+  antest_configure_user_thread(again, child_body);
+  anscheduler_thread_add(task, again);
+  assert(wait_for_cached(task) == again);
+  
+  anscheduler_task_mem(task, &usage);
+  assert(usage.stack == 2 * ANSCHEDULER_THREAD_FAULT_PAGES);
+  assert(childRuns == 2);
+  printf("thread was recycled!\n");
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, check_for_leaks, NULL);
+  anscheduler_task_exit(0);
+}
+
+void child_body() {
+  __sync_fetch_and_add(&childRuns, 1);
+  anscheduler_thread_exit(0);
+}
+
+thread_t * wait_for_cached(task_t * task) {
+  while (1) {
+    anscheduler_lock(&task->threadsLock);
+    thread_t * thread = task->firstCached;
+    anscheduler_unlock(&task->threadsLock);
+    if (thread) return thread;
+    anscheduler_cpu_unlock();
+    anscheduler_cpu_halt();
+    anscheduler_cpu_lock();
+  }
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 2 CPU stacks = 3 pages!
+  if (antest_pages_alloced() != 3) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 3);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
@@ -231,7 +231,7 @@ void read_messages(server_scope * scope) {
     socket_msg_t * msg = anscheduler_socket_read(desc);
     while (msg) {
       handle_message(scope, desc->descriptor, msg);
-      anscheduler_free(msg);
+      anscheduler_socket_msg_free(msg);
       msg = anscheduler_socket_read(desc);
     }
     
@@ -0,0 +1,273 @@
+/**
+ * Tests that messages from several threads sending on one socket all arrive
+ * exactly once and in each sender's order, while another thread keeps
+ * resizing the receiver's ring between sends and reads. Shallow depths make
+ * the senders block until the reader drains the ring.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/socket.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define CPU_COUNT 4
+#define SENDER_COUNT 3
+#define MSG_COUNT 0x1000
+#define READ_BATCH 0x10
+#define RESIZE_BURST 0x400
+
+static const uint64_t depths[] = {
+  1, ANSCHEDULER_SOCKET_DEPTH_MAX, 4, 0x40, 2, ANSCHEDULER_SOCKET_MSG_MAX, 0x100
+};
+
+static uint64_t senderFd, receiverFd;
+static uint64_t senderReady __attribute__((aligned(8))) = 0;
+static uint64_t receiverReady __attribute__((aligned(8))) = 0;
+static uint64_t sendersStarted __attribute__((aligned(8))) = 0;
+static uint64_t sendersDone __attribute__((aligned(8))) = 0;
+static uint64_t readerDone __attribute__((aligned(8))) = 0;
+static uint64_t resizerDone __attribute__((aligned(8))) = 0;
+static uint64_t resizeCount = 0;
+static uint64_t blockCount __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * flag);
+task_t * create_task(void (* method)(), uint64_t threadCount);
+void add_thread(task_t * task, void (* method)());
+void reader_main();
+void resizer_main();
+void sender_main();
+void connect_socket();
+void send_value(uint64_t value);
+void wait_for_message();
+void wait_cont(void * unused);
+void wait_poll(void * unused);
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread((void *)1, proc_enter);
+  int i;
+  for (i = 1; i < CPU_COUNT; i++) {
+    antest_launch_thread(NULL, proc_enter);
+  }
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * flag) {
+  if (flag) {
+    // the resizer shares the receiving task with the reader
+    task_t * receiver = create_task(reader_main, 1);
+    add_thread(receiver, resizer_main);
+    anscheduler_task_dereference(receiver);
+    anscheduler_task_dereference(create_task(sender_main, SENDER_COUNT));
+  }
+  anscheduler_loop_run();
+}
+
+task_t * create_task(void (* method)(), uint64_t threadCount) {
+  task_t * task = anscheduler_task_create();
+  anscheduler_task_launch(task);
+  uint64_t i;
+  for (i = 0; i < threadCount; i++) {
+    add_thread(task, method);
+  }
+  return task;
+}
+
+void add_thread(task_t * task, void (* method)()) {
+  thread_t * thread = anscheduler_thread_create(task);
+  antest_configure_user_thread(thread, method);
+  anscheduler_thread_add(task, thread);
+}
+
+void reader_main() {
+  anscheduler_cpu_lock();
+  uint64_t expected[SENDER_COUNT] = {0};
+  uint64_t received = 0, max = 1;
+  bool closed = false;
+
+  while (!closed) {
+    wait_for_message();
+
+    // give the senders a chance to fill the ring and block on it
+    anscheduler_cpu_unlock();
+    anscheduler_cpu_halt();
+    anscheduler_cpu_lock();
+
+    socket_desc_t * desc;
+    while ((desc = anscheduler_socket_next_pending())) {
+      if (!receiverReady) {
+        receiverFd = desc->descriptor;
+        __sync_synchronize();
+        receiverReady = 1;
+      }
+      socket_msg_t * msgs[READ_BATCH];
+      uint64_t i, count;
+      while ((count = anscheduler_socket_read_batch(desc, msgs, max))) {
+        max = (max % READ_BATCH) + 1;
+        for (i = 0; i < count; i++) {
+          if (msgs[i]->type == ANSCHEDULER_MSG_TYPE_CLOSE) {
+            closed = true;
+          } else if (msgs[i]->type == ANSCHEDULER_MSG_TYPE_DATA) {
+            uint64_t value;
+            assert(anscheduler_socket_msg_copy(msgs[i], &value, 8) == 8);
+            uint64_t sender = value >> 32;
+            assert(sender < SENDER_COUNT);
+            // a lost message skips ahead, a duplicate goes back
+            assert((value & 0xffffffff) == expected[sender]);
+            expected[sender]++;
+            received++;
+          }
+          anscheduler_socket_msg_free(msgs[i]);
+        }
+      }
+      if (closed) anscheduler_socket_close(desc, 0);
+      anscheduler_socket_dereference(desc);
+    }
+  }
+
+  // the close came after every sender's last message
+  uint64_t i;
+  for (i = 0; i < SENDER_COUNT; i++) {
+    assert(expected[i] == MSG_COUNT);
+  }
+  assert(received == SENDER_COUNT * MSG_COUNT);
+  printf("received 0x%llx messages across 0x%llx resizes, 0x%llx blocks\n",
+         (unsigned long long)received, (unsigned long long)resizeCount,
+         (unsigned long long)blockCount);
+
+  readerDone = 1;
+  anscheduler_cpu_unlock();
+  volatile uint64_t * done = &resizerDone;
+  while (!*done) anscheduler_cpu_halt();
+  anscheduler_cpu_lock();
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, check_for_leaks, NULL);
+  anscheduler_task_exit(0);
+}
+
+void resizer_main() {
+  volatile uint64_t * ready = &receiverReady;
+  while (!*ready) anscheduler_cpu_halt();
+
+  volatile uint64_t * done = &readerDone;
+  uint64_t i = 0;
+  while (!*done) {
+    anscheduler_cpu_lock();
+    // the reader drops the descriptor once the senders close it
+    socket_desc_t * desc = anscheduler_socket_for_descriptor(receiverFd);
+    if (desc) {
+      uint64_t depth = depths[i++ % (sizeof(depths) / sizeof(depths[0]))];
+      assert(anscheduler_socket_set_depth(desc, depth));
+      anscheduler_socket_dereference(desc);
+      resizeCount++;
+    }
+    anscheduler_cpu_unlock();
+    if (!(i % RESIZE_BURST)) anscheduler_cpu_halt();
+  }
+  __sync_fetch_and_add(&resizerDone, 1);
+  anscheduler_thread_exit(0);
+}
+
+void sender_main() {
+  uint64_t index = __sync_fetch_and_add(&sendersStarted, 1);
+  if (!index) {
+    connect_socket();
+  } else {
+    volatile uint64_t * ready = &senderReady;
+    while (!*ready) anscheduler_cpu_halt();
+  }
+
+  uint64_t seq;
+  for (seq = 0; seq < MSG_COUNT; seq++) {
+    send_value((index << 32) | seq);
+  }
+
+  // whoever finishes last closes the socket behind everyone's messages
+  if (__sync_add_and_fetch(&sendersDone, 1) == SENDER_COUNT) {
+    anscheduler_cpu_lock();
+    socket_desc_t * desc = anscheduler_socket_for_descriptor(senderFd);
+    assert(desc != NULL);
+    anscheduler_socket_close(desc, 0);
+    anscheduler_socket_dereference(desc);
+    anscheduler_task_exit(0);
+  }
+  anscheduler_thread_exit(0);
+}
+
+void connect_socket() {
+  anscheduler_cpu_lock();
+  socket_desc_t * desc = anscheduler_socket_new();
+  assert(desc != NULL);
+  senderFd = desc->descriptor;
+  task_t * target = anscheduler_task_for_pid(0);
+  assert(target != NULL);
+  assert(anscheduler_socket_connect(desc, target));
+  anscheduler_cpu_unlock();
+  __sync_synchronize();
+  senderReady = 1;
+}
+
+void send_value(uint64_t value) {
+  anscheduler_cpu_lock();
+  socket_msg_t * msg = anscheduler_socket_msg_data(&value, 8);
+  assert(msg != NULL);
+  while (1) {
+    socket_desc_t * desc = anscheduler_socket_for_descriptor(senderFd);
+    assert(desc != NULL);
+    if (anscheduler_socket_msg(desc, msg)) break;
+
+    // the message was refused, so it is still ours to send again
+    __sync_fetch_and_add(&blockCount, 1);
+    assert(anscheduler_socket_wait_writable(desc));
+  }
+  anscheduler_cpu_unlock();
+}
+
+void wait_for_message() {
+  thread_t * thread = anscheduler_cpu_get_thread();
+  anscheduler_save_return_state(thread, NULL, wait_cont);
+}
+
+void wait_cont(void * unused) {
+  anscheduler_cpu_stack_run(NULL, wait_poll);
+}
+
+void wait_poll(void * unused) {
+  task_t * task = anscheduler_cpu_get_task();
+  if (!anscheduler_thread_poll()) {
+    anscheduler_thread_run(task, anscheduler_cpu_get_thread());
+  } else {
+    anscheduler_cpu_set_task(NULL);
+    anscheduler_cpu_set_thread(NULL);
+    anscheduler_task_dereference(task);
+    anscheduler_loop_run();
+  }
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 4 CPU stacks = 5 pages!
+  if (antest_pages_alloced() != 5) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 5);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
@@ -0,0 +1,131 @@
+/**
+ * Tests that a batch of tasks spawned from a template share the template's
+ * data until they write to it, and that they are all scheduled.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include "env/vm.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/paging.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define INSTANCE_COUNT 8
+
+static task_t * template = NULL;
+static uint64_t templateEntry = 0;
+static uint64_t instancesDone __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * flag);
+void spawn_instances();
+void instance_main();
+void free_template();
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+  antest_launch_thread((void *)1, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * flag) {
+  if (flag) spawn_instances();
+  anscheduler_loop_run();
+}
+
+void spawn_instances() {
+  template = anscheduler_task_create();
+
+  // give the template a data page with a known value in it
+  uint64_t * page = anscheduler_alloc(0x1000);
+  page[0] = 0x1337;
+  uint16_t flags = ANSCHEDULER_PAGE_FLAG_PRESENT
+    | ANSCHEDULER_PAGE_FLAG_WRITE
+    | ANSCHEDULER_PAGE_FLAG_USER;
+  templateEntry = anscheduler_vm_physical(((uint64_t)page) >> 12);
+  anscheduler_vm_map(template->vm, ANSCHEDULER_TASK_DATA_PAGE,
+                     templateEntry, flags);
+
+  task_t * tasks[INSTANCE_COUNT];
+  assert(anscheduler_task_spawn(template, tasks, INSTANCE_COUNT)
+         == INSTANCE_COUNT);
+
+  int i;
+  for (i = 0; i < INSTANCE_COUNT; i++) {
+    assert(tasks[i]->firstThread != NULL);
+    antest_configure_user_thread(tasks[i]->firstThread, instance_main);
+  }
+  anscheduler_task_launch_batch(tasks, INSTANCE_COUNT);
+  for (i = 0; i < INSTANCE_COUNT; i++) {
+    anscheduler_task_dereference(tasks[i]);
+  }
+}
+
+void instance_main() {
+  anscheduler_cpu_lock();
+  task_t * task = anscheduler_cpu_get_task();
+  uint64_t vpage = ANSCHEDULER_TASK_DATA_PAGE;
+  void * addr = (void *)(vpage << 12);
+
+  uint16_t flags;
+  anscheduler_lock(&task->vmLock);
+  uint64_t entry = anscheduler_vm_lookup(task->vm, vpage, &flags);
+  anscheduler_unlock(&task->vmLock);
+  assert(entry == templateEntry);
+  assert(flags & ANSCHEDULER_PAGE_FLAG_COW);
+
+  // take our own copy, then get rid of it
+  antest_user_thread_page_fault(addr, true);
+  anscheduler_lock(&task->vmLock);
+  entry = anscheduler_vm_lookup(task->vm, vpage, &flags);
+  anscheduler_unlock(&task->vmLock);
+  assert(entry != templateEntry);
+  assert(flags & ANSCHEDULER_PAGE_FLAG_WRITE);
+  uint64_t * copy = (uint64_t *)(anscheduler_vm_virtual(entry) << 12);
+  assert(copy[0] == 0x1337);
+  assert(task->mem.user == 1);
+  anscheduler_page_unmap(task, vpage);
+  assert(!task->mem.user);
+
+  if (__sync_add_and_fetch(&instancesDone, 1) == INSTANCE_COUNT) {
+    printf("all instances ran!\n");
+    free_template();
+    pthread_t thread;
+    pthread_create(&thread, NULL, check_for_leaks, NULL);
+  }
+  anscheduler_task_exit(0);
+}
+
+void free_template() {
+  // every instance has its own copy, so the template owns its page again
+  anscheduler_page_unmap(template, ANSCHEDULER_TASK_DATA_PAGE);
+
+  anscheduler_task_kill(template, ANSCHEDULER_TASK_KILL_REASON_EXTERNAL);
+  anscheduler_task_dereference(template);
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  // one PID pool + 2 CPU stacks = 3 pages!
+  if (antest_pages_alloced() != 3) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 3);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
@@ -0,0 +1,141 @@
+/**
+ * Tests that a thread gets user and kernel stacks of the sizes it asked for,
+ * that its stack is prefaulted and faulted around as requested, and that
+ * touching the guard page below the user stack kills the task. The stack is
+ * large enough that tearing it down takes several pages of frame list, and
+ * a thread whose stack can't be mapped is rolled back without leaks. Each
+ * thread reserves only its stack and guard pages of the user stacks region.
+ */
+
+#include "env/user_thread.h"
+#include "env/threading.h"
+#include "env/alloc.h"
+#include "env/vm.h"
+#include <anscheduler/thread.h>
+#include <anscheduler/task.h>
+#include <anscheduler/loop.h>
+#include <anscheduler/functions.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define STACK_PAGES 0x400
+#define GUARD_PAGES 2
+#define KERN_PAGES 4
+#define PREFAULT_PAGES 0x300
+
+static uint64_t passedGuard __attribute__((aligned(8))) = 0;
+
+void proc_enter(void * unused);
+void thread_body();
+void * check_for_leaks(void * arg);
+
+int main() {
+  antest_launch_thread(NULL, proc_enter);
+
+  while (1) {
+    sleep(0xffffffff);
+  }
+
+  return 0;
+}
+
+void proc_enter(void * unused) {
+  task_t * task = anscheduler_task_create();
+  anscheduler_task_launch(task);
+  
+  // the stack and its guard have a size limit
+  thread_attr_t attr;
+  anscheduler_thread_attr_init(&attr);
+  attr.stackPages = ANSCHEDULER_THREAD_STACK_MAX;
+  attr.guardPages = 1;
+  assert(anscheduler_thread_create_attr(task, &attr) == NULL);
+  attr.stackPages = 0;
+  attr.guardPages = 0;
+  assert(anscheduler_thread_create_attr(task, &attr) == NULL);
+  
+  // the kernel stack needs room for its guard page
+  attr.stackPages = STACK_PAGES;
+  attr.guardPages = GUARD_PAGES;
+  attr.kernPages = ANSCHEDULER_THREAD_KERN_SLOT;
+  assert(anscheduler_thread_create_attr(task, &attr) == NULL);
+
+  attr.kernPages = KERN_PAGES;
+  attr.prefaultPages = STACK_PAGES + 1;
+  assert(anscheduler_thread_create_attr(task, &attr) == NULL);
+  
+  // the user stack's page tables can't be allocated
+  attr.prefaultPages = 0;
+  antest_vm_fail_tables(true);
+  assert(anscheduler_thread_create_attr(task, &attr) == NULL);
+  antest_vm_fail_tables(false);
+  assert(task->mem.kernStack == 0);
+  
+  attr.prefaultPages = PREFAULT_PAGES;
+  thread_t * thread = anscheduler_thread_create_attr(task, &attr);
+  assert(thread != NULL);
+  assert(task->mem.kernStack == KERN_PAGES);
+  assert(task->mem.stack == PREFAULT_PAGES);
+  uint64_t top = ANSCHEDULER_TASK_USER_STACKS_PAGE + GUARD_PAGES + STACK_PAGES;
+  assert(anscheduler_thread_user_stack(thread) == (void *)(top << 12));
+  antest_configure_user_thread(thread, thread_body);
+  
+  // a small thread goes right above the first one; it never runs
+  attr.stackPages = 1;
+  attr.guardPages = 1;
+  attr.prefaultPages = 0;
+  thread_t * small = anscheduler_thread_create_attr(task, &attr);
+  assert(small != NULL);
+  assert(anscheduler_thread_user_stack(small) == (void *)((top + 2) << 12));
+  anscheduler_thread_link(task, small);
+
+  anscheduler_thread_add(task, thread);
+  anscheduler_task_dereference(task);
+
+  pthread_t athread;
+  pthread_create(&athread, NULL, check_for_leaks, NULL);
+  anscheduler_loop_run();
+}
+
+void thread_body() {
+  anscheduler_cpu_lock();
+  task_t * task = anscheduler_cpu_get_task();
+  void * top = antest_user_thread_stack_addr();
+  
+  // the lowest page of the stack can be used
+  void * bottom = top - (STACK_PAGES << 12);
+  antest_user_thread_page_fault(bottom, true);
+  task_mem_t usage;
+  anscheduler_task_mem(task, &usage);
+  assert(usage.stack == PREFAULT_PAGES + 1);
+  
+  // a fault in the middle also allocates the pages below it
+  antest_user_thread_page_fault(bottom + 0x8000, true);
+  anscheduler_task_mem(task, &usage);
+  assert(usage.stack == PREFAULT_PAGES + 1 + ANSCHEDULER_THREAD_FAULT_PAGES);
+
+  // this is the guard page right below it
+  antest_user_thread_page_fault(bottom - 8, true);
+
+  passedGuard = 1;
+  anscheduler_task_exit(0);
+}
+
+void * check_for_leaks(void * arg) {
+  sleep(1);
+  if (passedGuard) {
+    fprintf(stderr, "task was not killed\n");
+    exit(1);
+  }
+  // one PID pool + 1 CPU stack = 2 pages!
+  if (antest_pages_alloced() != 2) {
+    fprintf(stderr, "leaked 0x%llx pages\n",
+            (unsigned long long)antest_pages_alloced() - 2);
+    exit(1);
+  }
+  printf("test passed!\n");
+  exit(0);
+  return NULL;
+}
@@ -78,7 +78,7 @@ void task_main() {
 
 void bg_method() {
   __sync_fetch_and_sub(&progCounter, 1);
-  anscheduler_thread_exit();
+  anscheduler_thread_exit(0);
 }
 
 void * test_leaks(void * unused) {